@@ -0,0 +1,514 @@
+/*
+** bench.c
+** Latency and throughput benchmark for the train controller server
+**
+** Drives a server with scripted workloads and reports how long commands take:
+**	single		one SET at a time, each waiting for its ack
+**	get			one GET at a time
+**	burst		SETs pipelined in bursts, acks gathered after each burst
+**	reversal	SETs alternating between forward and reverse with no fade
+**	throttle	a steady stream of udp throttles at a fixed rate
+**
+** For every workload it reports p50/p99/p999 of the round trip from send to
+** ack, as timed here, and of the time from the server receiving a setpoint
+** to the motor task applying it, from the server's MSG_MBOX_STATS histogram
+** (so those are the upper edges of its log2 buckets). It also reports
+** commands per second and commands dropped: never acked, nacked, replaced
+** before the motor task applied them, or lost or dropped as stale over udp.
+**
+** Results go to stdout, or the file given with -o, as JSON. Run it against a
+** host build of the server:
+**
+**		gcc -O2 -o bench bench.c
+**		./server_host & ./bench -o results.json 127.0.0.1
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define PORT "3333"				// the port the server listens on
+#define ACK_TIMEOUT_MS 1000		// an ack that takes longer than this counts as dropped
+#define LATENCY_BUCKETS 16		// buckets in the server's mailbox latency histogram
+
+// the server's mailbox statistics, see MSG_MBOX_STATS
+typedef struct {
+	uint32_t posted;
+	uint32_t dropped;
+	uint32_t latency[LATENCY_BUCKETS];
+} mboxStats_t;
+
+// what one workload measured
+typedef struct {
+	const char *name;
+	int sent;					// commands sent
+	int acked;					// acked with PROTO_OK
+	int failed;					// nacked or never acked
+	double seconds;				// wall time the workload took
+	double *rtt;				// round trips in microseconds, one per acked command
+	int rttCount;
+	mboxStats_t mbox;			// server mailbox activity during the workload
+	int udp;					// the workload used udp throttles
+	uint32_t udpReceived, udpLost, udpStale, udpRejected;
+} result_t;
+
+void usage(void);
+int connectServer(const char *host);
+long long nowUs(void);
+uint16_t sendFrame(uint8_t type, uint8_t train, const uint8_t *payload, uint8_t len);
+int recvFrame(proto_frame_t *f, int timeoutMs);
+int waitAck(uint16_t seq, proto_frame_t *f);
+int setDuty(int train, int duty, int fade);
+void getMbox(mboxStats_t *stats);
+void getUdpStats(int train, uint32_t *stats);
+void beginResult(result_t *r, const char *name, int max);
+void endResult(result_t *r, long long start, const mboxStats_t *before);
+void runSingle(result_t *r, int train, int count);
+void runGet(result_t *r, int train, int count);
+void runBurst(result_t *r, int train, int count, int burst);
+void runReversal(result_t *r, int train, int count);
+void runThrottle(result_t *r, int train, int rate, int ms);
+double percentile(double *sorted, int n, double p);
+double bucketPercentile(const uint32_t *buckets, double p);
+void writeResult(FILE *out, const result_t *r, int last);
+int compareDouble(const void *a, const void *b);
+
+int sock = -1;				// command connection
+int udpSock = -1;			// throttle channel, connected to the server's UDP_PORT
+uint32_t token = 0;			// from the server's hello, identifies our udp throttles
+uint16_t nextSeq = 0;		// sequence number of the next frame sent
+uint8_t rx[2 * PROTO_MAX_FRAME];	// received bytes not yet parsed
+int rxLen = 0;
+
+int main(int argc, char *argv[]){
+	const char *outName = NULL;
+	int count = 1000;
+	int burst = 32;
+	int rate = 500;
+	int ms = 2000;
+	int train = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "o:n:b:r:d:t:")) != -1){
+		switch(opt){
+			case 'o': outName = optarg; break;
+			case 'n': count = atoi(optarg); break;
+			case 'b': burst = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'd': ms = atoi(optarg); break;
+			case 't': train = atoi(optarg); break;
+			default: usage();
+		}
+	}
+	if(optind != argc - 1 || count <= 0 || burst <= 0 || rate <= 0 || ms <= 0)
+		usage();
+	if(connectServer(argv[optind]) != 0)
+		return 2;
+
+	result_t results[5];
+	runSingle(&results[0], train, count);
+	runGet(&results[1], train, count);
+	runBurst(&results[2], train, count, burst);
+	runReversal(&results[3], train, count);
+	runThrottle(&results[4], train, rate, ms);
+	setDuty(train, 0, 0);
+
+	FILE *out = stdout;
+	if(outName != NULL && (out = fopen(outName, "w")) == NULL){
+		perror(outName);
+		return 1;
+	}
+	time_t now = time(NULL);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(out, "{\n\t\"server\": \"%s\",\n\t\"date\": \"%s\",\n\t\"train\": %d,\n\t\"workloads\": [\n",
+			argv[optind], date, train);
+	for(int i = 0; i < 5; i++)
+		writeResult(out, &results[i], i == 4);
+	fprintf(out, "\t]\n}\n");
+	if(out != stdout)
+		fclose(out);
+	return 0;
+}
+
+void usage(void){
+	fprintf(stderr, "usage: bench [-o results.json] [-n commands] [-b burst] [-r throttle_hz] [-d throttle_ms] [-t train] host\n");
+	exit(1);
+}
+
+// connects to the server, switches it to frames and opens the udp throttle channel
+// returns 0 when successful, non-zero otherwise
+int connectServer(const char *host){
+	struct addrinfo hints, *servinfo, *p;
+	int rv;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, PORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return 1;
+	}
+	for(p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+		if (connect(sock, p->ai_addr, p->ai_addrlen) == -1) {
+			close(sock);
+			continue;
+		}
+		break;
+	}
+	if (p == NULL) {
+		fprintf(stderr, "bench: failed to connect\n");
+		freeaddrinfo(servinfo);
+		return 1;
+	}
+	int noDelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	if ((udpSock = socket(p->ai_family, SOCK_DGRAM, 0)) != -1) {
+		struct sockaddr_storage udpAddr;
+		memcpy(&udpAddr, p->ai_addr, p->ai_addrlen);
+		if (p->ai_family == AF_INET)
+			((struct sockaddr_in *)&udpAddr)->sin_port = htons(UDP_PORT);
+		else
+			((struct sockaddr_in6 *)&udpAddr)->sin6_port = htons(UDP_PORT);
+		if (connect(udpSock, (struct sockaddr *)&udpAddr, p->ai_addrlen) == -1) {
+			close(udpSock);
+			udpSock = -1;
+		}
+	}
+	freeaddrinfo(servinfo);
+
+	uint8_t version = PROTO_VERSION;
+	proto_frame_t f;
+	uint16_t seq = sendFrame(MSG_HELLO, 0, &version, 1);
+	if(recvFrame(&f, ACK_TIMEOUT_MS) <= 0 || f.type != MSG_HELLO || f.seq != seq || f.len < 6){
+		fprintf(stderr, "bench: server does not speak the binary protocol\n");
+		return 1;
+	}
+	token = proto_get32(f.payload + 2);
+	return 0;
+}
+
+// microseconds on a clock that only goes forward
+long long nowUs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// sends a frame to the server, returns its seq
+uint16_t sendFrame(uint8_t type, uint8_t train, const uint8_t *payload, uint8_t len){
+	uint8_t buf[PROTO_MAX_FRAME];
+	uint16_t seq = nextSeq++;
+	int frameLen = proto_encode(buf, type, train, seq, payload, len);
+	int sent = 0;
+	while(sent < frameLen){
+		int n = send(sock, buf + sent, frameLen - sent, 0);
+		if(n < 0){
+			perror("send");
+			exit(2);
+		}
+		sent += n;
+	}
+	return seq;
+}
+
+// receives the next frame from the server, waiting up to 'timeoutMs'
+// returns 1 with the frame in 'f', 0 on timeout
+int recvFrame(proto_frame_t *f, int timeoutMs){
+	static int consumed = 0;
+	long long deadline = nowUs() + timeoutMs * 1000LL;
+	memmove(rx, rx + consumed, rxLen - consumed);
+	rxLen -= consumed;
+	consumed = 0;
+	while(1){
+		int len = proto_decode(rx, rxLen, f);
+		if(len > 0){
+			consumed = len;
+			return 1;
+		}
+		if(len < 0){	// garbage, drop a byte and resync
+			memmove(rx, rx + 1, --rxLen);
+			continue;
+		}
+		long long wait = deadline - nowUs();
+		struct pollfd fd = {sock, POLLIN, 0};
+		if(wait <= 0 || poll(&fd, 1, (int)((wait + 999) / 1000)) <= 0)
+			return 0;
+		if((len = recv(sock, rx + rxLen, sizeof(rx) - rxLen, 0)) <= 0){
+			fprintf(stderr, "bench: server closed the connection\n");
+			exit(2);
+		}
+		rxLen += len;
+	}
+}
+
+// waits for the ack of 'seq', leaving it in 'f'
+// returns 1 when it arrived, 0 on timeout
+int waitAck(uint16_t seq, proto_frame_t *f){
+	while(recvFrame(f, ACK_TIMEOUT_MS))
+		if(f->type == MSG_ACK && f->seq == seq)
+			return 1;
+	return 0;
+}
+
+// sets duty of train, 'duty' in tenths of a percent, and waits for the ack
+// returns 1 when the server accepted it
+int setDuty(int train, int duty, int fade){
+	uint8_t payload[6];
+	proto_frame_t f;
+	proto_put16(payload, (int16_t)duty);
+	proto_put32(payload + 2, fade);
+	return waitAck(sendFrame(MSG_SET, train, payload, 6), &f) && f.len >= 1 && f.payload[0] == PROTO_OK;
+}
+
+// reads the server's mailbox statistics, all zero if it does not keep them
+void getMbox(mboxStats_t *stats){
+	proto_frame_t f;
+	memset(stats, 0, sizeof(*stats));
+	if(!waitAck(sendFrame(MSG_MBOX_STATS, 0, NULL, 0), &f) || f.len < 79 || f.payload[0] != PROTO_OK)
+		return;
+	stats->posted = proto_get32(f.payload + 1);
+	stats->dropped = proto_get32(f.payload + 5);
+	for(int i = 0; i < LATENCY_BUCKETS; i++)
+		stats->latency[i] = proto_get32(f.payload + 15 + 4 * i);
+}
+
+// reads received, lost, stale and rejected udp throttles for train
+void getUdpStats(int train, uint32_t *stats){
+	proto_frame_t f;
+	memset(stats, 0, 4 * sizeof(*stats));
+	if(!waitAck(sendFrame(MSG_UDP_STATS, train, NULL, 0), &f) || f.len < 17 || f.payload[0] != PROTO_OK)
+		return;
+	for(int i = 0; i < 4; i++)
+		stats[i] = proto_get32(f.payload + 1 + 4 * i);
+}
+
+void beginResult(result_t *r, const char *name, int max){
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->rtt = malloc(max * sizeof(double));
+	if(r->rtt == NULL){
+		perror("malloc");
+		exit(1);
+	}
+	fprintf(stderr, "bench: %s\n", name);
+}
+
+// finishes a workload: its wall time, what the server's mailbox did meanwhile and its sorted round trips
+void endResult(result_t *r, long long start, const mboxStats_t *before){
+	r->seconds = (nowUs() - start) / 1e6;
+	getMbox(&r->mbox);
+	r->mbox.posted -= before->posted;
+	r->mbox.dropped -= before->dropped;
+	for(int i = 0; i < LATENCY_BUCKETS; i++)
+		r->mbox.latency[i] -= before->latency[i];
+	qsort(r->rtt, r->rttCount, sizeof(double), compareDouble);
+}
+
+// one SET at a time between two duties, each waiting for its ack
+void runSingle(result_t *r, int train, int count){
+	mboxStats_t before;
+	beginResult(r, "single", count);
+	getMbox(&before);
+	long long start = nowUs();
+	for(int i = 0; i < count; i++){
+		uint8_t payload[6];
+		proto_frame_t f;
+		proto_put16(payload, i % 2 ? 300 : 200);
+		proto_put32(payload + 2, 0);
+		long long t = nowUs();
+		r->sent++;
+		if(waitAck(sendFrame(MSG_SET, train, payload, 6), &f) && f.len >= 1 && f.payload[0] == PROTO_OK){
+			r->rtt[r->rttCount++] = nowUs() - t;
+			r->acked++;
+		} else {
+			r->failed++;
+		}
+	}
+	endResult(r, start, &before);
+}
+
+// one GET at a time
+void runGet(result_t *r, int train, int count){
+	mboxStats_t before;
+	beginResult(r, "get", count);
+	getMbox(&before);
+	long long start = nowUs();
+	for(int i = 0; i < count; i++){
+		proto_frame_t f;
+		long long t = nowUs();
+		r->sent++;
+		if(waitAck(sendFrame(MSG_GET, train, NULL, 0), &f) && f.len >= 3 && f.payload[0] == PROTO_OK){
+			r->rtt[r->rttCount++] = nowUs() - t;
+			r->acked++;
+		} else {
+			r->failed++;
+		}
+	}
+	endResult(r, start, &before);
+}
+
+// SETs pipelined 'burst' at a time, the acks of a burst gathered before the next is sent
+void runBurst(result_t *r, int train, int count, int burst){
+	mboxStats_t before;
+	long long *sentAt = malloc(burst * sizeof(long long));
+	if(sentAt == NULL){
+		perror("malloc");
+		exit(1);
+	}
+	beginResult(r, "burst", count);
+	getMbox(&before);
+	long long start = nowUs();
+	for(int i = 0; i < count; i += burst){
+		int n = count - i < burst ? count - i : burst;
+		uint16_t first = nextSeq;
+		for(int j = 0; j < n; j++){
+			uint8_t payload[6];
+			proto_put16(payload, 100 + 10 * j);
+			proto_put32(payload + 2, 0);
+			sentAt[j] = nowUs();
+			sendFrame(MSG_SET, train, payload, 6);
+		}
+		r->sent += n;
+		int got = 0;
+		proto_frame_t f;
+		while(got < n && recvFrame(&f, ACK_TIMEOUT_MS)){
+			uint16_t j = f.seq - first;
+			if(f.type != MSG_ACK || j >= n)
+				continue;
+			got++;
+			if(f.len >= 1 && f.payload[0] == PROTO_OK){
+				r->rtt[r->rttCount++] = nowUs() - sentAt[j];
+				r->acked++;
+			}
+		}
+	}
+	r->failed = r->sent - r->acked;
+	endResult(r, start, &before);
+	free(sentAt);
+}
+
+// SETs alternating between forward and reverse with no fade, each waiting for its ack
+void runReversal(result_t *r, int train, int count){
+	mboxStats_t before;
+	beginResult(r, "reversal", count);
+	getMbox(&before);
+	long long start = nowUs();
+	for(int i = 0; i < count; i++){
+		uint8_t payload[6];
+		proto_frame_t f;
+		proto_put16(payload, (uint16_t)(int16_t)(i % 2 ? -400 : 400));
+		proto_put32(payload + 2, 0);
+		long long t = nowUs();
+		r->sent++;
+		if(waitAck(sendFrame(MSG_SET, train, payload, 6), &f) && f.len >= 1 && f.payload[0] == PROTO_OK){
+			r->rtt[r->rttCount++] = nowUs() - t;
+			r->acked++;
+		} else {
+			r->failed++;
+		}
+	}
+	endResult(r, start, &before);
+}
+
+// udp throttles at 'rate' a second for 'ms', after a SET over tcp to take the train and pick a direction
+// throttles are not acked, so this reports what the server received and dropped rather than round trips
+void runThrottle(result_t *r, int train, int rate, int ms){
+	mboxStats_t before = {0};
+	uint32_t udpBefore[4], udpAfter[4];
+	beginResult(r, "throttle", 1);
+	r->udp = 1;
+	if(udpSock == -1 || !setDuty(train, 100, 0)){
+		fprintf(stderr, "bench: no udp throttle channel, skipping\n");
+		getMbox(&before);
+		endResult(r, nowUs(), &before);
+		return;
+	}
+	getUdpStats(train, udpBefore);
+	getMbox(&before);
+	long long start = nowUs();
+	long long period = 1000000LL / rate;
+	uint16_t seq = 0;
+	for(long long next = start; next < start + ms * 1000LL; next += period){
+		long long wait = next - nowUs();
+		if(wait > 0)
+			usleep(wait);
+		uint8_t buf[PROTO_MAX_FRAME];
+		uint8_t payload[6];
+		proto_put32(payload, token);
+		proto_put16(payload + 4, 100 + (seq % 200));
+		send(udpSock, buf, proto_encode(buf, MSG_THROTTLE, train, seq++, payload, 6), 0);
+		r->sent++;
+	}
+	usleep(100000);	// let the last datagrams land
+	getUdpStats(train, udpAfter);
+	r->udpReceived = udpAfter[0] - udpBefore[0];
+	r->udpLost = udpAfter[1] - udpBefore[1];
+	r->udpStale = udpAfter[2] - udpBefore[2];
+	r->udpRejected = udpAfter[3] - udpBefore[3];
+	r->acked = r->udpReceived;
+	r->failed = r->sent - r->udpReceived;
+	endResult(r, start, &before);
+	r->seconds = ms / 1000.0;
+}
+
+// value at fraction 'p' of a sorted list
+double percentile(double *sorted, int n, double p){
+	if(n == 0)
+		return 0;
+	int i = (int)(p * n);
+	return sorted[i < n ? i : n - 1];
+}
+
+// upper edge of the log2 bucket holding fraction 'p' of the samples
+double bucketPercentile(const uint32_t *buckets, double p){
+	uint64_t total = 0, seen = 0;
+	for(int i = 0; i < LATENCY_BUCKETS; i++)
+		total += buckets[i];
+	if(total == 0)
+		return 0;
+	for(int i = 0; i < LATENCY_BUCKETS; i++){
+		seen += buckets[i];
+		if(seen > p * total)
+			return 1 << (i + 1);
+	}
+	return 1 << LATENCY_BUCKETS;
+}
+
+void writeResult(FILE *out, const result_t *r, int last){
+	fprintf(out, "\t\t{\n\t\t\t\"name\": \"%s\",\n", r->name);
+	fprintf(out, "\t\t\t\"sent\": %d,\n\t\t\t\"acked\": %d,\n", r->sent, r->acked);
+	fprintf(out, "\t\t\t\"dropped\": %u,\n", r->failed + r->mbox.dropped);
+	fprintf(out, "\t\t\t\"seconds\": %.6f,\n", r->seconds);
+	fprintf(out, "\t\t\t\"commands_per_second\": %.1f,\n", r->seconds > 0 ? r->acked / r->seconds : 0);
+	if(!r->udp)
+		fprintf(out, "\t\t\t\"rtt_us\": { \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f },\n",
+				percentile(r->rtt, r->rttCount, 0.5), percentile(r->rtt, r->rttCount, 0.99),
+				percentile(r->rtt, r->rttCount, 0.999), r->rttCount ? r->rtt[r->rttCount - 1] : 0);
+	else
+		fprintf(out, "\t\t\t\"udp\": { \"received\": %u, \"lost\": %u, \"stale\": %u, \"rejected\": %u },\n",
+				r->udpReceived, r->udpLost, r->udpStale, r->udpRejected);
+	fprintf(out, "\t\t\t\"apply_us\": { \"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f },\n",
+			bucketPercentile(r->mbox.latency, 0.5), bucketPercentile(r->mbox.latency, 0.99),
+			bucketPercentile(r->mbox.latency, 0.999));
+	fprintf(out, "\t\t\t\"setpoints_posted\": %u,\n\t\t\t\"setpoints_replaced\": %u\n", r->mbox.posted, r->mbox.dropped);
+	fprintf(out, "\t\t}%s\n", last ? "" : ",");
+}
+
+int compareDouble(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
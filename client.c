@@ -19,12 +19,18 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <ctype.h>
 #include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <curses.h>
 
 #include <arpa/inet.h>
 
+#include "protocol.h"
+
 #define PORT "3333" // the port client will be connecting to
 
 #define MAXDATASIZE 127 // max number of bytes we can get at once
@@ -34,17 +40,148 @@
 #define GET "0"
 #define SET "1"
 
+#define NUM_TRAINS 6 // number of trains the server drives
+#define TELEMETRY_HZ 2 // rate the server corrects our prediction of live duty cycles while a train is being driven
+#define REDRAW_HZ 20 // rate a duty cycle that is changing is redrawn, from the prediction
+#define TELEMETRY_STALE_MS 100 // longest telemetry may still show the target from before a set we started, see handleFrame()
+#define HEARTBEAT_MS 300 // server stops our trains if it hears nothing from us for this long
+#define ESTOP_MS 1000 // and takes this long to stop them from full speed
+#define CLOCK_SYNC_ROUNDS 8 // clock readings taken from the server, the quickest round trip is used
+#define GROUP_LEAD_MS 200 // how far ahead commands for a group of trains are scheduled, to reach the server in time
+#define SCRIPT_WINDOW 256 // most script commands waiting for their replies at once
+#define SCRIPT_TIMEOUT_MS 5000 // a script fails if the server goes this long without replying
+#define CAB_STEP 1 // percent an arrow key changes the duty cycle by in the cab
+#define CAB_BIG_STEP 10 // and page up or down
+#define FLEET_MAX_BOARDS 16 // controllers fleet mode can drive at once
+#define FLEET_WINDOW 64 // most commands waiting for replies from one controller
+#define FLEET_BACKOFF_MIN_MS 250 // first wait before reconnecting to a controller, doubled after each failure
+#define FLEET_BACKOFF_MAX_MS 8000
+#define SESSION_MAGIC "TSES" // starts a session file, followed by SESSION_VERSION
+#define SESSION_VERSION 1
+
 //#define NO_NETWORK
 //#define VERBOSE
 
-void directControl(int sock);
-void directControlFade(int sock);
+void directControl(int sock, int train);
+int runScript(int sock, FILE *script);
+int replaySession(int sock, FILE *session, double speed);
+int fleetControl(char **hosts, int numHosts, FILE *script);
+void directControlFade(int sock, int train);
+void udpControl(int sock, int train);
+void groupControl(int sock, int train);
+int cabControl(int sock, int train);
+int selectTrain(int train);
+void showStats(int sock);
+void dumpTrace(int sock);
+void inertiaSettings(int sock, int train);
+void curveSettings(int sock, int train);
+void pwmSettings(int sock, int train);
+void motorSettings(int sock, int train);
+void programSettings(int sock, int train);
+void printProgram(const uint8_t *code, int len, int pc);
+int compileProgram(char *text, uint8_t *code);
+void readInput(int sock, int train, char *usrBuf);
+void printStatus(int sock, int train);
 int isValidDuty(char *str);
 int isValidFade(char *str);
-void setDuty(int sock, int duty, int time);
-int getDuty(int sock);
-void tcp_send(int sock, char *buf);
+int isValidTrain(char *str);
+void setDuty(int sock, int train, int duty, int time);
+void setDutyAt(int sock, int train, int duty, int time, long long atUs);
+void emergencyStop(int sock);
+int getDuty(int sock, int train);
+void hello(int sock);
+void heartbeat(int sock);
+long long nowMs(void);
+long long nowUs(void);
+int syncClock(int sock);
+void subscribe(int sock, int hz);
+int takeTrain(int sock, int train);
+void releaseTrain(int sock, int train);
+void sendThrottle(int train, int throttle);
+void handleFrame(proto_frame_t *f);
+void startFade(int train, int duty, int time, long long now);
+int predict(int train, long long now);
+uint16_t sendFrame(int sock, uint8_t type, uint8_t train, const uint8_t *payload, uint8_t len);
+void waitAck(int sock, uint16_t seq, proto_frame_t *f);
+void tcp_send(int sock, const void *buf, int len);
 void tcp_recv(int sock, char *buf);
+void tcp_recv_frame(int sock, proto_frame_t *f);
+int tcp_frame_buffered(void);
+void sessionRecord(int dir, const uint8_t *frame, int len);
+
+int binary = 0;			// speaking frames, see hello()
+uint16_t next_seq = 0;	// sequence number of the next frame sent
+uint32_t token = 0;		// from the server's hello, identifies our udp throttles
+int udpSock = -1;		// udp throttle channel, connected to the server's UDP_PORT
+int heartbeatMs = 0;	// deadline agreed with the server, 0 when it is not watching us
+long long lastSentMs = 0;	// when we last sent the server anything
+long long clockOffsetUs = 0;	// server's clock less ours, see syncClock()
+
+// a session file holds every frame sent to the server and received from it, in order:
+//	SESSION_MAGIC version(1) then per frame: dir(1) delta_us(4) frame as sent on the wire
+// dir is SESSION_SENT or SESSION_RECEIVED and delta_us the time since the frame before, on a monotonic clock
+enum { SESSION_SENT, SESSION_RECEIVED };
+FILE *sessionFile = NULL;	// recording to, from -r
+long long sessionUs = 0;	// when the last frame was recorded
+
+// live state of each train, duties in tenths of a percent
+// the server's fades are carried on here from the sets it acks, so the duty can be shown as it
+// changes without asking; telemetry corrects the prediction now and then
+typedef struct {
+	int duty;			// at the last predict()
+	int target;
+	int progress;
+	int from;			// the fade being carried on, from 'from' at startUs to target over lenUs
+	long long startUs;
+	long long lenUs;	// -1 to hold at 'from' until corrected
+	long long zeroAtUs;	// into the fade, where it rests at zero for holdUs before driving the other way
+	long long holdUs;
+	long long restUs;	// of a fade through zero, the part after the rest
+	int dir;			// direction last driven, 1 forward, -1 reverse, 0 not yet
+	long long zeroUs;	// when it last came to rest at zero
+	int dwellMs;		// rest at zero before reversing, from the server's MSG_MOTOR
+	long long awaitUs;	// until then telemetry without 'target' predates the set, 0 once it has shown it
+	int modelled;		// follows the server's inertia model, which we only know the last rate of
+	int rate;			// of a modelled train, tenths of a percent per second, 0 when not known
+	int setPending;		// the newest set, waiting for its ack
+	uint16_t setSeq;
+	int setDuty, setTime;
+	long long setAtUs;	// on our clock, 0 to carry it out when acked
+	int next;			// a set acked for later, carried out at setAtUs
+} train_status_t;
+train_status_t trainStatus[NUM_TRAINS];
+void planDwell(train_status_t *t, long long now, int held);
+int predictErrMax = 0;	// widest a prediction has been of the server's telemetry, tenths of a percent
+
+// a controller in fleet mode, see fleetControl()
+typedef struct {
+	const char *host;
+	int base;				// its train 0, fleet-wide
+	int sock;				// -1 while down
+	int state;				// BOARD_
+	int numTrains;			// from its hello
+	uint8_t rx[2 * PROTO_MAX_FRAME];	// received bytes not yet parsed
+	int rxLen;
+	uint8_t tx[FLEET_WINDOW * 2 * PROTO_MAX_FRAME / 16];	// commands not yet sent
+	int txLen;
+	uint16_t nextSeq;
+	struct {
+		uint16_t seq;
+		uint8_t type;
+		int train;			// fleet-wide train number
+		int stop;			// part of an emergency stop
+	} pending[FLEET_WINDOW];	// commands waiting for their replies, in the order sent
+	int first, count;
+	int heartbeatMs;		// deadline agreed with the controller, 0 when it is not watching us
+	long long sentMs;		// when we last sent it anything
+	long long heardMs;		// when it last sent us anything
+	long long retryMs;		// when to try connecting again while down
+	int backoffMs;
+	int stopLeft;			// emergency stop commands it has not acked
+	int failed;				// a command to it failed
+} board_t;
+
+enum {BOARD_DOWN, BOARD_CONNECTING, BOARD_HELLO, BOARD_UP};
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -59,24 +196,65 @@ void *get_in_addr(struct sockaddr *sa)
 int main(int argc, char *argv[])
 {
 	int sockfd, numbytes;
+	FILE *script = NULL;
+	FILE *replay = NULL;
+	double speed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:r:p:x:")) != -1) {
+		if (opt == 's' && strcmp(optarg, "-") == 0) {
+			script = stdin;
+		} else if (opt == 's' && (script = fopen(optarg, "r")) == NULL) {
+			perror(optarg);
+			exit(2);
+		} else if (opt == 'r' && (sessionFile = fopen(optarg, "wb")) == NULL) {
+			perror(optarg);
+			exit(2);
+		} else if (opt == 'p' && (replay = fopen(optarg, "rb")) == NULL) {
+			perror(optarg);
+			exit(2);
+		} else if (opt == 'x') {
+			speed = strtod(optarg, NULL);
+			if (speed < 0)
+				argc = 0;
+		} else if (opt != 's' && opt != 'r' && opt != 'p') {
+			argc = 0;	// show usage
+		}
+	}
+	if (sessionFile != NULL) {	// unbuffered, so a session cut short by ^C is kept up to the last frame
+		setvbuf(sessionFile, NULL, _IONBF, 0);
+		fwrite(SESSION_MAGIC, 1, 4, sessionFile);
+		fputc(SESSION_VERSION, sessionFile);
+		sessionUs = nowUs();
+	}
 #ifndef NO_NETWORK
 	char buf[MAXDATASIZE+1];
 	struct addrinfo hints, *servinfo, *p;
 	int rv;
 	char s[INET6_ADDRSTRLEN];
 
-	if (argc != 2) {
-		fprintf(stderr,"usage: client hostname\n");
-		exit(1);
+	if (argc < optind + 1) {
+		fprintf(stderr,"usage: client [-s script] [-r session] [-p session [-x speed]] hostname [hostname...]\n");
+		fprintf(stderr,"\t-s script\trun the commands in script, - for stdin, instead of the menus\n");
+		fprintf(stderr,"\t-r session\trecord every frame sent and received to session\n");
+		fprintf(stderr,"\t-p session\tplay a recorded session back and check the replies against it\n");
+		fprintf(stderr,"\t-x speed\tplay it back this many times faster, 0 for as fast as possible\n");
+		fprintf(stderr,"\twith several hostnames, drive them all as one fleet from script or stdin\n");
+		exit(2);
+	}
+	if (argc > optind + 1 && (sessionFile != NULL || replay != NULL)) {
+		fprintf(stderr, "client: sessions are recorded from and played back to one controller\n");
+		exit(2);
 	}
+	if (argc > optind + 1)
+		return fleetControl(argv + optind, argc - optind, script != NULL ? script : stdin);
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
-	if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) {
+	if ((rv = getaddrinfo(argv[optind], PORT, &hints, &servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		return 1;
+		return 2;
 	}
 
 	// loop through all the results and connect to the first we can
@@ -101,22 +279,56 @@ int main(int argc, char *argv[])
 		return 2;
 	}
 
+	// send each command as soon as it is entered rather than waiting to coalesce them
+	int noDelay = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	// udp throttle channel, to the same address on UDP_PORT
+	if ((udpSock = socket(p->ai_family, SOCK_DGRAM, 0)) != -1) {
+		struct sockaddr_storage udpAddr;
+		memcpy(&udpAddr, p->ai_addr, p->ai_addrlen);
+		if (p->ai_family == AF_INET)
+			((struct sockaddr_in *)&udpAddr)->sin_port = htons(UDP_PORT);
+		else
+			((struct sockaddr_in6 *)&udpAddr)->sin6_port = htons(UDP_PORT);
+		if (connect(udpSock, (struct sockaddr *)&udpAddr, p->ai_addrlen) == -1) {
+			perror("client: udp connect");
+			close(udpSock);
+			udpSock = -1;
+		}
+	}
+
 	inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
 			  s, sizeof s);
-	printf("client: connecting to %s\n", s);
+	fprintf(stderr, "client: connecting to %s\n", s);
 
 	freeaddrinfo(servinfo); // all done with this structure
+
+	if (replay != NULL)	// the session has its own hello
+		return replaySession(sockfd, replay, speed);
+	hello(sockfd);
+	heartbeat(sockfd);
+	if (script != NULL) {
+		if (!binary) {
+			fprintf(stderr, "client: scripts need a server that speaks frames\n");
+			return 2;
+		}
+		return runScript(sockfd, script);
+	}
 #endif
+	setvbuf(stdin, NULL, _IONBF, 0); // so poll() on stdin sees every line not yet read
 
 	char usrBuf[MAXDATASIZE+1];
 	int badFlag = 0;
+	int train = 0;
 	do {
 		system("clear");
 		if(badFlag){
 			printf("%s is not a valid selection\n\n", usrBuf);
 			badFlag = 0;
 		}
-		printf("Select mode:\n\t(1) - direct control\n\t(2) - fade control\n\t(q) - quit\n> ");
+		printf("Controlling train %d\n", train);
+		printf("Select mode:\n\t(1) - direct control\n\t(2) - fade control\n\t(3) - udp throttle control\n\t(4) - group control\n\t(5) - cab\n\t(t) - select train\n\t(i) - train momentum\n\t(c) - speed curve\n\t(f) - pwm frequency\n\t(m) - motor stopping\n\t(p) - program\n\t(s) - server statistics\n\t(d) - duty trace\n\t(q) - quit\n> ");
 		scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
 		int c;
 		while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
@@ -127,13 +339,62 @@ int main(int argc, char *argv[])
 				case '1': {
 					system("clear");
 					printf("Please wait\n");
-					directControl(sockfd);
+					directControl(sockfd, train);
 					break;
 				}
 				case '2':{
 					system("clear");
 					printf("Please wait\n");
-					directControlFade(sockfd);
+					directControlFade(sockfd, train);
+					break;
+				}
+				case '3':{
+					system("clear");
+					printf("Please wait\n");
+					udpControl(sockfd, train);
+					break;
+				}
+				case '4':{
+					system("clear");
+					groupControl(sockfd, train);
+					break;
+				}
+				case '5':{
+					train = cabControl(sockfd, train);
+					break;
+				}
+				case 't':{
+					train = selectTrain(train);
+					break;
+				}
+				case 'i':{
+					inertiaSettings(sockfd, train);
+					break;
+				}
+				case 'c':{
+					curveSettings(sockfd, train);
+					break;
+				}
+				case 'f':{
+					pwmSettings(sockfd, train);
+					break;
+				}
+				case 'm':{
+					motorSettings(sockfd, train);
+					break;
+				}
+				case 'p':{
+					programSettings(sockfd, train);
+					break;
+				}
+				case 's':{
+					system("clear");
+					showStats(sockfd);
+					break;
+				}
+				case 'd':{
+					system("clear");
+					dumpTrace(sockfd);
 					break;
 				}
 				/*
@@ -169,19 +430,628 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
+// runs the commands in script, one per line, without the menus:
+//	set <train> <duty> <fade time>	set duty cycle, like fade control
+//	get <train>						print the train's duty cycle
+//	wait <ms>						pause before sending the next command
+//	# ...							comment
+// commands are pipelined: each is sent as soon as it is read, without waiting for the replies to those
+// before it, and replies are matched to their commands as they arrive
+// returns 0 when every command succeeded, 1 otherwise
+int runScript(int sock, FILE *script){
+	struct {
+		uint16_t seq;
+		int line;
+		int train;
+		uint8_t type;
+	} pending[SCRIPT_WINDOW];	// commands waiting for their replies, in the order sent
+	int first = 0, count = 0;
+	uint8_t out[SCRIPT_WINDOW * PROTO_MAX_FRAME / 16];	// commands read but not yet sent, they go out together
+	int outLen = 0;
+	char line[MAXDATASIZE+2];
+	int lineNum = 0;
+	int failed = 0;
+	int eof = 0;
+	long long resumeMs = 0;		// a wait holds back sending until then
+	long long heardMs = nowMs();	// when the server last replied
+	while(!eof || count > 0 || outLen > 0){
+		// queue every command up to the next wait, or until the window is full
+		while(!eof && count < SCRIPT_WINDOW && outLen + PROTO_MAX_FRAME <= sizeof(out) && nowMs() >= resumeMs){
+			if(fgets(line, sizeof(line), script) == NULL){
+				eof = 1;
+				break;
+			}
+			lineNum++;
+			char cmd[16];
+			int a, b, c;
+			int args = sscanf(line, "%15s %d %d %d", cmd, &a, &b, &c) - 1;
+			uint8_t payload[6];
+			uint8_t type;
+			if(args < 0 || cmd[0] == '#'){
+				continue;
+			} else if(strcmp(cmd, "wait") == 0 && args == 1 && a >= 0){
+				resumeMs = nowMs() + a;
+				break;
+			} else if(strcmp(cmd, "set") == 0 && args == 3 && a >= 0 && a < NUM_TRAINS && b >= -100 && b <= 100 && c >= 0){
+				type = MSG_SET;
+				proto_put16(payload, b * PROTO_DUTY_SCALE);
+				proto_put32(payload + 2, c);
+			} else if(strcmp(cmd, "get") == 0 && args == 1 && a >= 0 && a < NUM_TRAINS){
+				type = MSG_GET;
+			} else {
+				fprintf(stderr, "line %d: cannot understand %s", lineNum, line);
+				failed = 1;
+				continue;
+			}
+			int slot = (first + count++) % SCRIPT_WINDOW;
+			pending[slot].seq = next_seq;
+			pending[slot].line = lineNum;
+			pending[slot].train = a;
+			pending[slot].type = type;
+			outLen += proto_encode(out + outLen, type, a, next_seq++, payload, type == MSG_SET ? sizeof(payload) : 0);
+		}
+		if(outLen > 0){
+			tcp_send(sock, out, outLen);
+			outLen = 0;
+		}
+		if(count == 0 && eof)
+			break;
+
+		// wait for replies, the end of a wait or the next heartbeat, whichever comes first
+		long long now = nowMs();
+		long long timeout = count > 0 ? heardMs + SCRIPT_TIMEOUT_MS - now : -1;
+		if(!eof && resumeMs > now && (timeout < 0 || resumeMs - now < timeout))
+			timeout = resumeMs - now;
+		if(heartbeatMs){	// keep the server hearing from us at least three times a deadline
+			long long due = lastSentMs + heartbeatMs / 3 - now;
+			if(due <= 0){
+				sendFrame(sock, MSG_HEARTBEAT, 0, NULL, 0);
+				due = heartbeatMs / 3;
+			}
+			if(timeout < 0 || due < timeout)
+				timeout = due;
+		}
+		if(count > 0 && now - heardMs >= SCRIPT_TIMEOUT_MS){
+			fprintf(stderr, "line %d: no reply from the server\n", pending[first].line);
+			return 1;
+		}
+		struct pollfd fds = {sock, POLLIN, 0};
+		if(!tcp_frame_buffered() && poll(&fds, 1, timeout) <= 0)
+			continue;
+		do {
+			proto_frame_t f;
+			tcp_recv_frame(sock, &f);
+			heardMs = nowMs();
+			int i;
+			for(i = 0; i < count && pending[(first + i) % SCRIPT_WINDOW].seq != f.seq; i++);
+			if(f.type != MSG_ACK || i == count){
+				handleFrame(&f);
+				continue;
+			}
+			int slot = (first + i) % SCRIPT_WINDOW;
+			if(f.len < 1 || f.payload[0] != PROTO_OK){
+				fprintf(stderr, "line %d: failed with status %d\n", pending[slot].line, f.len >= 1 ? f.payload[0] : -1);
+				failed = 1;
+			} else if(pending[slot].type == MSG_GET && f.len >= 3){
+				printf("%d %.1f\n", pending[slot].train, (int16_t)proto_get16(f.payload + 1) / (float)PROTO_DUTY_SCALE);
+			}
+			// replies come back in order, so anything sent before it without one will never get one
+			for(int j = 0; j < i; j++){
+				fprintf(stderr, "line %d: no reply from the server\n", pending[(first + j) % SCRIPT_WINDOW].line);
+				failed = 1;
+			}
+			first = (slot + 1) % SCRIPT_WINDOW;
+			count -= i + 1;
+		} while(tcp_frame_buffered());
+	}
+	return failed;
+}
+
+// sends the frames of a recorded session to the server again at their recorded times divided by speed,
+// or as fast as the window allows when speed is 0, and checks that each reply the server sent in the
+// recording comes back with the same type, status and length; what the replies carry is not compared,
+// as most of it, times, live duties and counters, is never the same twice
+// telemetry is counted but not checked, and udp throttles are not recorded at all
+// returns 0 when every reply matched, 1 otherwise
+int replaySession(int sock, FILE *session, double speed){
+	typedef struct {
+		uint8_t dir;
+		long long us;		// since the start of the session
+		int reply;			// of a frame sent, the index of its reply in the recording, -1 for none
+		uint8_t frame[PROTO_MAX_FRAME];
+		int len;
+	} session_rec_t;
+	session_rec_t *recs = NULL;
+	int numRecs = 0, maxRecs = 0;
+	char magic[4];
+	if(fread(magic, 1, 4, session) != 4 || memcmp(magic, SESSION_MAGIC, 4) != 0 || fgetc(session) != SESSION_VERSION){
+		fprintf(stderr, "client: not a session file\n");
+		return 2;
+	}
+	long long us = 0;
+	uint8_t hdr[5];
+	size_t got;
+	while((got = fread(hdr, 1, 5, session)) == 5){
+		if(numRecs == maxRecs){
+			maxRecs = maxRecs ? maxRecs * 2 : 256;
+			if((recs = realloc(recs, maxRecs * sizeof(*recs))) == NULL){
+				perror("client");
+				return 2;
+			}
+		}
+		session_rec_t *r = &recs[numRecs];
+		proto_frame_t f;
+		us += proto_get32(hdr + 1);
+		r->dir = hdr[0];
+		r->us = us;
+		r->reply = -1;
+		if(fread(r->frame, 1, PROTO_HDR_LEN, session) != PROTO_HDR_LEN ||
+				fread(r->frame + PROTO_HDR_LEN, 1, r->frame[1] + 1, session) != r->frame[1] + 1u ||
+				(r->len = proto_decode(r->frame, PROTO_HDR_LEN + r->frame[1] + 1, &f)) <= 0){
+			got = 1;
+			break;
+		}
+		numRecs++;
+	}
+	if(got != 0)
+		fprintf(stderr, "client: session cut short or damaged after %d frames\n", numRecs);
+	// pair each reply with the latest frame sent before it with the same seq
+	int expected = 0;
+	for(int i = 0; i < numRecs; i++){
+		proto_frame_t f, sent;
+		proto_decode(recs[i].frame, recs[i].len, &f);
+		if(recs[i].dir != SESSION_RECEIVED || f.type == MSG_TELEMETRY)
+			continue;
+		for(int j = i - 1; j >= 0; j--){
+			proto_decode(recs[j].frame, recs[j].len, &sent);
+			if(recs[j].dir == SESSION_SENT && sent.seq == f.seq){
+				if(recs[j].reply < 0){
+					recs[j].reply = i;
+					expected++;
+				}
+				break;
+			}
+		}
+	}
+
+	int pending[SCRIPT_WINDOW];	// frames sent waiting for their replies, in the order sent
+	int first = 0, count = 0;
+	uint8_t out[SCRIPT_WINDOW * PROTO_MAX_FRAME / 16];	// frames due, they go out together
+	int next = 0, sent = 0;
+	int matched = 0, differed = 0, missing = 0, unexpected = 0, telemetry = 0;
+	long long startUs = nowUs();
+	long long heardMs = nowMs();	// when the server last replied
+	while(next < numRecs || count > 0){
+		// send every frame that is due, up to the window
+		int outLen = 0;
+		long long dueUs = -1;	// of the next frame, held back until its time
+		for(; next < numRecs; next++){
+			session_rec_t *r = &recs[next];
+			if(r->dir != SESSION_SENT)
+				continue;
+			if(speed > 0 && startUs + (long long)(r->us / speed) > nowUs()){
+				dueUs = startUs + (long long)(r->us / speed);
+				break;
+			}
+			if(count == SCRIPT_WINDOW || outLen + r->len > sizeof(out))
+				break;
+			memcpy(out + outLen, r->frame, r->len);
+			outLen += r->len;
+			sent++;
+			if(r->reply >= 0)
+				pending[(first + count++) % SCRIPT_WINDOW] = next;
+		}
+		if(outLen > 0)
+			tcp_send(sock, out, outLen);
+		if(next == numRecs && count == 0)
+			break;
+
+		// wait for replies or the next frame's time, whichever comes first
+		long long now = nowMs();
+		long long timeout = count > 0 ? heardMs + SCRIPT_TIMEOUT_MS - now : -1;
+		if(dueUs >= 0 && (timeout < 0 || (dueUs - nowUs()) / 1000 < timeout))
+			timeout = (dueUs - nowUs()) / 1000;
+		if(count > 0 && now - heardMs >= SCRIPT_TIMEOUT_MS){
+			fprintf(stderr, "frame %d: no reply from the server\n", pending[first]);
+			missing += count;
+			break;
+		}
+		struct pollfd fds = {sock, POLLIN, 0};
+		if(!tcp_frame_buffered() && poll(&fds, 1, timeout) <= 0)
+			continue;
+		do {
+			proto_frame_t f, want;
+			tcp_recv_frame(sock, &f);
+			heardMs = nowMs();
+			if(f.type == MSG_TELEMETRY){
+				telemetry++;
+				continue;
+			}
+			int i;
+			for(i = 0; i < count; i++){
+				session_rec_t *r = &recs[recs[pending[(first + i) % SCRIPT_WINDOW]].reply];
+				proto_decode(r->frame, r->len, &want);
+				if(want.seq == f.seq && want.type == f.type)
+					break;
+			}
+			if(i == count){
+				fprintf(stderr, "unexpected frame of type %d for seq %d\n", f.type, f.seq);
+				unexpected++;
+				continue;
+			}
+			int slot = (first + i) % SCRIPT_WINDOW;
+			if(want.len != f.len || (f.type == MSG_ACK && f.len >= 1 && want.payload[0] != f.payload[0])){
+				fprintf(stderr, "frame %d: type %d replied status %d with %d bytes, recorded status %d with %d bytes\n",
+						pending[slot], f.type, f.len >= 1 ? f.payload[0] : -1, f.len,
+						want.len >= 1 ? want.payload[0] : -1, want.len);
+				differed++;
+			} else {
+				matched++;
+			}
+			// replies come back in order, so anything sent before it without one will never get one
+			for(int j = 0; j < i; j++){
+				fprintf(stderr, "frame %d: no reply from the server\n", pending[(first + j) % SCRIPT_WINDOW]);
+				missing++;
+			}
+			first = (slot + 1) % SCRIPT_WINDOW;
+			count -= i + 1;
+		} while(tcp_frame_buffered());
+	}
+	fprintf(stderr, "client: replayed %d frames of %.3f s in %.3f s: %d of %d replies matched, %d differed, "
+			"%d missing, %d unexpected, %d telemetry\n", sent, numRecs > 0 ? recs[numRecs - 1].us / 1e6 : 0.0,
+			(nowUs() - startUs) / 1e6, matched, expected, differed, missing, unexpected, telemetry);
+	free(recs);
+	return matched == expected && unexpected == 0 ? 0 : 1;
+}
+
+// takes a controller down after an error, failing the commands it had not replied to,
+// and sets when to try connecting to it again
+void boardDown(board_t *b, const char *why){
+	if(b->sock != -1)
+		close(b->sock);
+	for(int i = 0; i < b->count; i++)
+		if(b->pending[(b->first + i) % FLEET_WINDOW].type == MSG_ESTOP){
+			fprintf(stderr, "fleet: %s is down before it stopped\n", b->host);
+			b->failed = 1;
+		} else if(b->pending[(b->first + i) % FLEET_WINDOW].type != MSG_HEARTBEAT_CFG){
+			fprintf(stderr, "train %d: %s is down\n", b->pending[(b->first + i) % FLEET_WINDOW].train, b->host);
+			b->failed = 1;
+		}
+	if(b->state != BOARD_DOWN)
+		fprintf(stderr, "fleet: %s %s, trying again in %d ms\n", b->host, why, b->backoffMs);
+	b->sock = -1;
+	b->state = BOARD_DOWN;
+	b->count = 0;
+	b->txLen = 0;
+	b->rxLen = 0;
+	b->stopLeft = 0;
+	b->heartbeatMs = 0;
+	b->retryMs = nowMs() + b->backoffMs;
+	b->backoffMs = b->backoffMs * 2 < FLEET_BACKOFF_MAX_MS ? b->backoffMs * 2 : FLEET_BACKOFF_MAX_MS;
+}
+
+// starts a non-blocking connection to a controller, fleetControl() finishes it once the socket is writable
+void boardConnect(board_t *b){
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	b->state = BOARD_CONNECTING;
+	b->heardMs = nowMs();
+	if(getaddrinfo(b->host, PORT, &hints, &res) != 0){
+		boardDown(b, "cannot be found");
+		return;
+	}
+	int noDelay = 1;
+	b->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if(b->sock != -1){
+		fcntl(b->sock, F_SETFL, fcntl(b->sock, F_GETFL) | O_NONBLOCK);
+		setsockopt(b->sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	}
+	if(b->sock == -1 || (connect(b->sock, res->ai_addr, res->ai_addrlen) == -1 && errno != EINPROGRESS))
+		boardDown(b, strerror(errno));
+	freeaddrinfo(res);
+}
+
+// queues a frame to a controller, it goes out with everything else queued when fleetControl() next flushes
+// commands other than MSG_HEARTBEAT wait for their replies as 'train', fleet-wide, or PROTO_ALL_TRAINS
+// returns 0 when successful, -1 when the controller is too far behind to take it
+int boardQueue(board_t *b, uint8_t type, int train, const uint8_t *payload, uint8_t len, int stop){
+	if(b->txLen + PROTO_MAX_FRAME > sizeof(b->tx) || b->count == FLEET_WINDOW)
+		return -1;
+	if(type != MSG_HEARTBEAT && type != MSG_HELLO){
+		int slot = (b->first + b->count++) % FLEET_WINDOW;
+		b->pending[slot].seq = b->nextSeq;
+		b->pending[slot].type = type;
+		b->pending[slot].train = train;
+		b->pending[slot].stop = stop;
+	}
+	b->txLen += proto_encode(b->tx + b->txLen, type, train == PROTO_ALL_TRAINS ? train : train % NUM_TRAINS,
+			b->nextSeq++, payload, len);
+	return 0;
+}
+
+// deals with a frame from a controller
+// returns 1 when it finished an emergency stop on this controller, 0 otherwise
+int boardFrame(board_t *b, const proto_frame_t *f){
+	if(b->state == BOARD_HELLO && f->type == MSG_HELLO && f->len >= 2){
+		uint8_t payload[4];
+		b->numTrains = f->payload[1] < NUM_TRAINS ? f->payload[1] : NUM_TRAINS;
+		b->state = BOARD_UP;
+		b->backoffMs = FLEET_BACKOFF_MIN_MS;
+		fprintf(stderr, "fleet: %s is up, its trains are %d to %d\n", b->host, b->base, b->base + b->numTrains - 1);
+		proto_put16(payload, HEARTBEAT_MS);
+		proto_put16(payload + 2, ESTOP_MS);
+		boardQueue(b, MSG_HEARTBEAT_CFG, 0, payload, sizeof(payload), 0);
+		return 0;
+	}
+	int i;
+	for(i = 0; i < b->count && b->pending[(b->first + i) % FLEET_WINDOW].seq != f->seq; i++);
+	if(f->type != MSG_ACK || i == b->count)
+		return 0;
+	int slot = (b->first + i) % FLEET_WINDOW;
+	int train = b->pending[slot].train;
+	int done = 0;
+	if(b->pending[slot].type == MSG_HEARTBEAT_CFG)
+		b->heartbeatMs = f->len >= 3 && f->payload[0] == PROTO_OK ? proto_get16(f->payload + 1) : 0;
+	else if(f->len < 1 || f->payload[0] != PROTO_OK){
+		if(train == PROTO_ALL_TRAINS)
+			fprintf(stderr, "fleet: %s failed to stop with status %d\n", b->host, f->len >= 1 ? f->payload[0] : -1);
+		else
+			fprintf(stderr, "train %d: failed with status %d\n", train, f->len >= 1 ? f->payload[0] : -1);
+		b->failed = 1;
+	} else if(b->pending[slot].type == MSG_GET && f->len >= 3)
+		printf("%d %.1f\n", train, (int16_t)proto_get16(f->payload + 1) / (float)PROTO_DUTY_SCALE);
+	if(b->pending[slot].stop)
+		done = --b->stopLeft == 0;
+	// replies come back in order, so anything sent before it without one will never get one
+	for(int j = 0; j < i; j++){
+		fprintf(stderr, "train %d: no reply from %s\n", b->pending[(b->first + j) % FLEET_WINDOW].train, b->host);
+		b->failed = 1;
+	}
+	b->first = (slot + 1) % FLEET_WINDOW;
+	b->count -= i + 1;
+	return done;
+}
+
+// drives the trains of several controllers as one fleet, with commands from script as in runScript():
+//	set <train> <duty> <fade time>, get <train>, wait <ms>
+//	stop							emergency stop of every train on every controller
+// trains are numbered across the fleet, NUM_TRAINS to a controller in the order the hosts were given,
+// so the second controller's train 0 is train NUM_TRAINS
+// one poll() loop holds a non-blocking connection to every controller, reconnecting with backoff when
+// one is lost, and a command for several controllers goes out to them all before any reply is waited for
+// returns 0 when every command succeeded, 1 otherwise
+int fleetControl(char **hosts, int numHosts, FILE *script){
+	board_t *boards = calloc(numHosts, sizeof(board_t));
+	char in[4 * MAXDATASIZE];		// script read but not yet run
+	int inLen = 0;
+	int eof = 0;
+	int skipping = 0;				// dropping the rest of a line too long to run
+	int failed = 0;
+	long long resumeMs = 0;			// a wait holds back the script until then
+	long long stopUs = 0;			// when the emergency stop being carried out was sent
+	int stopping = 0;				// controllers still to ack it
+	if(numHosts > FLEET_MAX_BOARDS || boards == NULL){
+		fprintf(stderr, "fleet: at most %d controllers\n", FLEET_MAX_BOARDS);
+		return 2;
+	}
+	for(int i = 0; i < numHosts; i++){
+		boards[i].host = hosts[i];
+		boards[i].base = i * NUM_TRAINS;
+		boards[i].sock = -1;
+		boards[i].backoffMs = FLEET_BACKOFF_MIN_MS;
+	}
+	while(1){
+		long long now = nowMs();
+		for(int i = 0; i < numHosts; i++)
+			if(boards[i].state == BOARD_DOWN && now >= boards[i].retryMs)
+				boardConnect(&boards[i]);
+
+		// run the script up to the next wait
+		char *line;
+		while(now >= resumeMs && (line = memchr(in, '\n', inLen)) != NULL){
+			*line = '\0';
+			char cmd[16];
+			int a, b, c;
+			int args = sscanf(in, "%15s %d %d %d", cmd, &a, &b, &c) - 1;
+			board_t *board = args >= 1 && a >= 0 && a < numHosts * NUM_TRAINS ? &boards[a / NUM_TRAINS] : NULL;
+			uint8_t payload[6];
+			if(args < 0 || cmd[0] == '#'){
+			} else if(strcmp(cmd, "wait") == 0 && args == 1 && a >= 0){
+				resumeMs = now + a;
+			} else if(strcmp(cmd, "stop") == 0 && args == 0){
+				stopUs = nowUs();
+				stopping = 0;
+				for(int i = 0; i < numHosts; i++){	// one MSG_ESTOP brakes every train on a controller, whoever has it
+					board_t *s = &boards[i];
+					s->stopLeft = 0;
+					if(s->state != BOARD_UP){
+						fprintf(stderr, "fleet: %s is down, its server will stop its trains\n", s->host);
+						failed = 1;
+					} else if(boardQueue(s, MSG_ESTOP, PROTO_ALL_TRAINS, NULL, 0, 1) != 0){
+						fprintf(stderr, "fleet: %s is too far behind to stop\n", s->host);
+						failed = 1;
+					} else {
+						s->stopLeft = 1;
+						stopping++;
+					}
+				}
+			} else if(board != NULL && (board->state != BOARD_UP || a % NUM_TRAINS >= board->numTrains)){
+				fprintf(stderr, "train %d: %s\n", a, board->state != BOARD_UP ? "its controller is down" : "no such train");
+				failed = 1;
+			} else if(board != NULL && strcmp(cmd, "set") == 0 && args == 3 && b >= -100 && b <= 100 && c >= 0){
+				proto_put16(payload, b * PROTO_DUTY_SCALE);
+				proto_put32(payload + 2, c);
+				if(boardQueue(board, MSG_SET, a, payload, sizeof(payload), 0) != 0){
+					fprintf(stderr, "train %d: %s is too far behind\n", a, board->host);
+					failed = 1;
+				}
+			} else if(board != NULL && strcmp(cmd, "get") == 0 && args == 1){
+				if(boardQueue(board, MSG_GET, a, NULL, 0, 0) != 0){
+					fprintf(stderr, "train %d: %s is too far behind\n", a, board->host);
+					failed = 1;
+				}
+			} else {
+				fprintf(stderr, "cannot understand %s\n", in);
+				failed = 1;
+			}
+			inLen -= line + 1 - in;
+			memmove(in, line + 1, inLen);
+		}
+		if(inLen == sizeof(in) && memchr(in, '\n', inLen) == NULL){	// too long to run, dropped up to its newline
+			fprintf(stderr, "line too long: %.20s...\n", in);
+			failed = 1;
+			inLen = 0;
+			skipping = 1;
+		}
+		if(eof && inLen > 0 && memchr(in, '\n', inLen) == NULL)	// last line without a newline
+			in[inLen++] = '\n';
+
+		// send everything queued, in one go to each controller, and keep quiet ones hearing from us
+		int busy = 0;
+		long long timeout = now < resumeMs ? resumeMs - now : -1;
+		for(int i = 0; i < numHosts; i++){
+			board_t *b = &boards[i];
+			if(b->state == BOARD_UP && b->heartbeatMs != 0){
+				if(now - b->sentMs >= b->heartbeatMs / 3)
+					boardQueue(b, MSG_HEARTBEAT, 0, NULL, 0, 0);
+				long long due = b->sentMs + b->heartbeatMs / 3 - now;
+				timeout = timeout < 0 || due < timeout ? (due > 0 ? due : 0) : timeout;
+			}
+			if(b->txLen > 0 && b->state >= BOARD_HELLO){
+				int sent = send(b->sock, b->tx, b->txLen, 0);
+				if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+					boardDown(b, strerror(errno));
+				} else if(sent > 0){
+					memmove(b->tx, b->tx + sent, b->txLen - sent);
+					b->txLen -= sent;
+					b->sentMs = now;
+				}
+			}
+			if((b->count > 0 || b->state != BOARD_UP) && b->state != BOARD_DOWN && now - b->heardMs >= SCRIPT_TIMEOUT_MS)
+				boardDown(b, b->state == BOARD_UP ? "stopped replying" : "did not answer");
+			if(b->state == BOARD_DOWN){
+				long long due = b->retryMs - now;
+				timeout = timeout < 0 || due < timeout ? (due > 0 ? due : 0) : timeout;
+			} else if(b->count > 0 || b->state != BOARD_UP){
+				long long due = b->heardMs + SCRIPT_TIMEOUT_MS - now;
+				timeout = timeout < 0 || due < timeout ? (due > 0 ? due : 0) : timeout;
+			}
+			busy |= b->count > 0 || b->txLen > 0;
+		}
+		if(eof && inLen == 0 && !busy)
+			break;
+
+		// wait for the script, the controllers or the next thing due
+		struct pollfd fds[FLEET_MAX_BOARDS + 1];
+		for(int i = 0; i < numHosts; i++){
+			board_t *b = &boards[i];
+			fds[i].fd = b->sock;
+			fds[i].events = POLLIN | (b->state == BOARD_CONNECTING || b->txLen > 0 ? POLLOUT : 0);
+			fds[i].revents = 0;
+		}
+		fds[numHosts].fd = eof || inLen == sizeof(in) ? -1 : fileno(script);
+		fds[numHosts].events = POLLIN;
+		fds[numHosts].revents = 0;
+		if(poll(fds, numHosts + 1, timeout) < 0 && errno != EINTR){
+			perror("poll");
+			return 2;
+		}
+		for(int i = 0; i < numHosts; i++){
+			board_t *b = &boards[i];
+			if(b->sock == -1 || fds[i].revents == 0)
+				continue;
+			if(b->state == BOARD_CONNECTING){
+				int err = 0;
+				socklen_t len = sizeof(err);
+				uint8_t version = PROTO_VERSION;
+				getsockopt(b->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+				if(err != 0){
+					boardDown(b, strerror(err));
+					continue;
+				}
+				b->state = BOARD_HELLO;
+				boardQueue(b, MSG_HELLO, 0, &version, 1, 0);
+				continue;
+			}
+			if(!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			int len = recv(b->sock, b->rx + b->rxLen, sizeof(b->rx) - b->rxLen, 0);
+			if(len <= 0){
+				if(len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+					boardDown(b, len == 0 ? "closed the connection" : strerror(errno));
+				continue;
+			}
+			b->rxLen += len;
+			b->heardMs = nowMs();
+			int pos = 0;
+			while(b->state != BOARD_DOWN){
+				proto_frame_t f;
+				int flen = proto_decode(b->rx + pos, b->rxLen - pos, &f);
+				if(flen == 0)
+					break;
+				if(flen < 0){
+					if(b->state == BOARD_HELLO){	// answered the hello in text, an old server
+						boardDown(b, "does not speak frames");
+						break;
+					}
+					pos++;
+					continue;
+				}
+				if(boardFrame(b, &f)){
+					fprintf(stderr, "fleet: %s stopped in %lld us\n", b->host, nowUs() - stopUs);
+					if(--stopping == 0)
+						fprintf(stderr, "fleet: every controller stopped in %lld us\n", nowUs() - stopUs);
+				}
+				pos += flen;
+			}
+			if(b->state != BOARD_DOWN){
+				memmove(b->rx, b->rx + pos, b->rxLen - pos);
+				b->rxLen -= pos;
+			}
+		}
+		if(fds[numHosts].revents & (POLLIN | POLLHUP)){
+			int len = read(fileno(script), in + inLen, sizeof(in) - inLen);
+			char *end;
+			if(len <= 0)
+				eof = 1;
+			else
+				inLen += len;
+			if(skipping && (end = memchr(in, '\n', inLen)) != NULL){	// the rest of a line too long to run
+				inLen -= end + 1 - in;
+				memmove(in, end + 1, inLen);
+				skipping = 0;
+			} else if(skipping){
+				inLen = 0;
+			}
+		}
+	}
+	for(int i = 0; i < numHosts; i++){
+		if(boards[i].sock != -1)
+			close(boards[i].sock);
+		failed |= boards[i].failed;
+	}
+	free(boards);
+	return failed;
+}
+
 // user simpy enters desired duty cycle. no fade.
-void directControl(int sock){
+void directControl(int sock, int train){
 	char usrBuf[MAXDATASIZE+1];
 	int badFlag = 0;
+	if(!takeTrain(sock, train))
+		return;
+	subscribe(sock, TELEMETRY_HZ);
 	do {
-		int cur_duty = getDuty(sock);
 		system("clear");
 		// get current duty cycle
 		if(badFlag){
 			printf("%s is not a valid entry.\nPlease enter a number between -100 and 100 or q.\n\n", usrBuf);
 			badFlag = 0;
 		}
-		printf("Current duty cycle is %d%%. Enter new duty cycle or q to quit.\n> ", cur_duty);
+		printStatus(sock, train);
+		printf("\nEnter new duty cycle or q to quit.\n> ");
 
 		// remove any input during delay
 		struct pollfd fds = {0, POLLIN, 0};
@@ -192,18 +1062,12 @@ void directControl(int sock){
 			poll(&fds, 1, 0);
 		}
 
-		// get user input
-		scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
-
-		// eat extraneous characters
-		int c;
-		while((c=fgetc(stdin)) != '\n' && c != EOF);
-		system("clear");
-		printf("Please wait\n");
+		// get user input, showing the train's live duty cycle while waiting
+		readInput(sock, train, usrBuf);
 
 		// deal with input
 		if (strcmp("q", usrBuf) == 0) {
-			setDuty(sock, 0, 0);
+			setDuty(sock, train, 0, 0);
 			printf("\nQuitting direct control. Train will stop.");
 		}
 		else{
@@ -213,25 +1077,29 @@ void directControl(int sock){
 				continue;
 			}
 			// send input and 0 fade time
-			setDuty(sock, strtol(usrBuf, NULL, 10), 0);
+			setDuty(sock, train, strtol(usrBuf, NULL, 10), 0);
 		}
 	}while(strcmp("q", usrBuf) != 0);
+	subscribe(sock, 0);
+	releaseTrain(sock, train);
 }
 
 // user simpy enters desired duty cycle and fade time
-void directControlFade(int sock){
+void directControlFade(int sock, int train){
 	char usrBuf[MAXDATASIZE+1];
 	int badFlag = 0;
+	if(!takeTrain(sock, train))
+		return;
+	subscribe(sock, TELEMETRY_HZ);
 	do {
-		int cur_duty = getDuty(sock);
 		system("clear");
 		// get current duty cycle
 		if(badFlag){
 			printf("%s is not a valid entry.\nPlease enter a number between -100 and 100 and a positive number or q.\n\n", usrBuf);
 			badFlag = 0;
 		}
-		// get current duty cycle
-		printf("Current duty cycle is %d%%.\nEnter new duty cycle and fade time separated by a comma or q to quit.\n> ", cur_duty);
+		printStatus(sock, train);
+		printf("\nEnter new duty cycle and fade time separated by a comma or q to quit.\n> ");
 
 		// remove any input during delay
 		struct pollfd fds = {0, POLLIN, 0};
@@ -242,19 +1110,13 @@ void directControlFade(int sock){
 			poll(&fds, 1, 0);
 		}
 
-		// get user input
-		scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
-
-		// eat extraneous characters
-		int c;
-		while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+		// get user input, showing the train's live duty cycle while waiting
+		readInput(sock, train, usrBuf);
 
-		system("clear");
-		printf("Please wait\n");
 
 		// deal with input
 		if (strcmp("q", usrBuf) == 0) {
-			setDuty(sock, 0, 0);
+			setDuty(sock, train, 0, 0);
 			printf("\nQuitting direct control. Train will stop.");
 		}
 		else{
@@ -270,9 +1132,886 @@ void directControlFade(int sock){
 				continue;
 			}
 			// send input and 0 fade time
-			setDuty(sock, strtol(dutyStr, NULL, 10), strtol(fadeStr, NULL, 10));
+			setDuty(sock, train, strtol(dutyStr, NULL, 10), strtol(fadeStr, NULL, 10));
 		}
 	}while(strcmp("q", usrBuf) != 0);
+	subscribe(sock, 0);
+	releaseTrain(sock, train);
+}
+
+// reads a line from the user into usrBuf, without the newline and truncated to MAXDATASIZE
+// while waiting, telemetry from the server is used to redraw the status line printed by
+// printStatus, two lines above the prompt, in place
+void readInput(int sock, int train, char *usrBuf){
+	char line[MAXDATASIZE+2];
+	struct pollfd fds[2] = {{0, POLLIN, 0}, {sock, POLLIN, 0}};
+	usrBuf[0] = '\0';
+	fflush(stdout);
+	while(usrBuf[0] == '\0'){
+		int timeout = -1;
+		if(heartbeatMs){	// keep the server hearing from us at least three times a deadline
+			long long due = lastSentMs + heartbeatMs / 3 - nowMs();
+			if(due <= 0){
+				sendFrame(sock, MSG_HEARTBEAT, 0, NULL, 0);
+				due = heartbeatMs / 3;
+			}
+			timeout = due;
+		}
+		int moving = binary && predict(train, nowUs());
+		if(moving && (timeout < 0 || timeout > 1000 / REDRAW_HZ))
+			timeout = 1000 / REDRAW_HZ;
+		int ready = poll(fds, binary ? 2 : 1, timeout);
+		if(ready < 0 || (ready == 0 && !moving))
+			continue;
+		if(ready == 0 || fds[1].revents & POLLIN){
+			proto_frame_t f;
+			while(ready > 0 && (fds[1].revents & POLLIN || tcp_frame_buffered())){
+				fds[1].revents = 0;
+				tcp_recv_frame(sock, &f);
+				handleFrame(&f);
+			}
+			printf("\0337\033[2A\r\033[K");	// save cursor, up to the status line and clear it
+			printStatus(sock, train);
+			printf("\0338");				// back to where the user is typing
+			fflush(stdout);
+		}
+		if(fds[0].revents & (POLLIN | POLLHUP)){
+			if(fgets(line, sizeof(line), stdin) == NULL){
+				strcpy(usrBuf, "q");	// stdin closed, stop the train and leave
+				break;
+			}
+			if(strchr(line, '\n') == NULL){
+				int c;
+				while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+			}
+			sscanf(line, "%"XSTR(MAXDATASIZE)"s", usrBuf);
+			if(usrBuf[0] == '\0'){
+				printf("\033[1A\r\033[K> ");	// blank line, prompt again in the same place
+				fflush(stdout);
+			}
+		}
+	}
+}
+
+// shows the server's counters and how setpoints have fared on their way to its motor task, then waits for enter
+void showStats(int sock){
+	const char *counters[] = {STATS_COUNTER_NAMES};
+	const char *histograms[] = {STATS_HISTOGRAM_NAMES};
+	proto_frame_t f;
+	if(!binary){
+		printf("The server does not keep statistics.\n");
+		sleep(2);
+		return;
+	}
+	waitAck(sock, sendFrame(sock, MSG_STATS, 0, NULL, 0), &f);
+	if(f.len >= 1 + 4 * (STATS_NUM_COUNTERS + STATS_NUM_HISTOGRAMS * STATS_BUCKETS) && f.payload[0] == PROTO_OK){
+		const uint8_t *p = f.payload + 1;
+		for(int i = 0; i < STATS_NUM_COUNTERS; i++, p += 4)
+			printf("%-20s %u\n", counters[i], proto_get32(p));
+		for(int i = 0; i < STATS_NUM_HISTOGRAMS; i++){
+			printf("%s:", histograms[i]);
+			for(int j = 0; j < STATS_BUCKETS; j++, p += 4)
+				if(proto_get32(p) != 0)
+					printf(" %u+:%u", j == 0 ? 0 : 1u << j, proto_get32(p));
+			printf("\n");
+		}
+		printf("\nLargest gap between the duty shown here and the server's: %.1f%%\n\n", predictErrMax / (float)PROTO_DUTY_SCALE);
+	}
+	waitAck(sock, sendFrame(sock, MSG_NET_STATS, 0, NULL, 0), &f);
+	if(f.len >= 39 && f.payload[0] == PROTO_OK){
+		const char *states[] = {NET_STATE_NAMES};
+		const uint8_t *p = f.payload + 1;
+		printf("Wi-Fi %s on channel %d: %u attempts, %u connects (%u from the cache), %u lost, server restarted %u times\n",
+				p[0] < sizeof(states) / sizeof(states[0]) ? states[p[0]] : "?", p[1], proto_get32(p + 2),
+				proto_get32(p + 6), proto_get32(p + 10), proto_get32(p + 14), proto_get32(p + 18));
+		printf("Boot to address %u ms, to first command %u ms, last reconnect %u ms, slowest %u ms\n\n",
+				proto_get32(p + 22), proto_get32(p + 26), proto_get32(p + 30), proto_get32(p + 34));
+	}
+	waitAck(sock, sendFrame(sock, MSG_MEM_STATS, 0, NULL, 0), &f);
+	if(f.len >= 1 + MEM_STATS_LEN && f.payload[0] == PROTO_OK){
+		const char *tasks[] = {MEM_TASK_NAMES};
+		const char *pools[] = {MEM_POOL_NAMES};
+		const uint8_t *p = f.payload + 1;
+		printf("Heap free %u bytes, least ever %u\n", proto_get32(p), proto_get32(p + 4));
+		p += 8;
+		for(int i = 0; i < MEM_NUM_TASKS; i++, p += 8)
+			printf("%-12s stack %u bytes, least ever unused %u\n", tasks[i], proto_get32(p), proto_get32(p + 4));
+		for(int i = 0; i < MEM_NUM_POOLS; i++, p += 6)
+			printf("%-12s %u of %u in use, most %u\n", pools[i], proto_get16(p), proto_get16(p + 4), proto_get16(p + 2));
+		printf("\n");
+	}
+	waitAck(sock, sendFrame(sock, MSG_MBOX_STATS, 0, NULL, 0), &f);
+	if(f.len < 79 || f.payload[0] != PROTO_OK){
+		printf("The server does not keep statistics.\n");
+		sleep(2);
+		return;
+	}
+	const uint8_t *p = f.payload + 1;
+	printf("Setpoints posted to the motor task: %u\n", proto_get32(p));
+	printf("Replaced before they were applied: %u\n", proto_get32(p + 4));
+	printf("Waiting now: %d, most waiting at once: %d\n", p[8], p[9]);
+	printf("Longest wait: %u us\n\nWait to be applied:\n", proto_get32(p + 10));
+	for(int i = 0; i < 16; i++){
+		uint32_t n = proto_get32(p + 14 + 4 * i);
+		if(n != 0)
+			printf("\t%6u us and up: %u\n", i == 0 ? 0 : 1u << i, n);
+	}
+	printf("\nPress enter to continue.\n");
+	int c;
+	while((c=fgetc(stdin)) != '\n' && c != EOF);
+}
+
+// fetches the server's trace of recent duty changes and writes it to a CSV file,
+// or prints it as a timeline when no file is given, then waits for enter
+// the server's 32 bit microsecond clock is unwrapped, assuming no gap of over 71 minutes between changes
+void dumpTrace(int sock){
+	const char *sources[] = {TRACE_SOURCE_NAMES};
+	const int numSources = sizeof(sources) / sizeof(sources[0]);
+	char usrBuf[MAXDATASIZE+1];
+	proto_frame_t f;
+	if(!binary){
+		printf("The server does not keep a trace.\n");
+		sleep(2);
+		return;
+	}
+	printf("File to save the trace to as CSV, or enter to show it here:\n> ");
+	if(fgets(usrBuf, sizeof(usrBuf), stdin) == NULL)
+		return;
+	usrBuf[strcspn(usrBuf, "\n")] = '\0';
+	FILE *out = stdout;
+	if(usrBuf[0] != '\0' && (out = fopen(usrBuf, "w")) == NULL){
+		perror(usrBuf);
+		sleep(2);
+		return;
+	}
+	if(out != stdout)
+		fprintf(out, "time_us,train,source,seq,from,to,fade_ms\n");
+
+	uint8_t payload[4];
+	uint32_t next = 0;
+	int len = 0;	// empty request for the oldest record
+	int count = 0;
+	uint32_t lost = 0;
+	uint32_t lastTime = 0;
+	long long timeUs = 0, startUs = 0;
+	while(1){
+		waitAck(sock, sendFrame(sock, MSG_TRACE, 0, payload, len), &f);
+		if(f.len < 9 || f.payload[0] != PROTO_OK){
+			printf("The server does not keep a trace.\n");
+			break;
+		}
+		uint32_t head = proto_get32(f.payload + 1);
+		uint32_t first = proto_get32(f.payload + 5);
+		int n = (f.len - 9) / TRACE_RECORD_LEN;
+		if(len != 0)
+			lost += first - next;	// overwritten before we got to them
+		for(int i = 0; i < n; i++){
+			const uint8_t *r = f.payload + 9 + i * TRACE_RECORD_LEN;
+			uint32_t t = proto_get32(r);
+			timeUs = count == 0 ? t : timeUs + (uint32_t)(t - lastTime);
+			lastTime = t;
+			if(count++ == 0)
+				startUs = timeUs;
+			int from = (int16_t)proto_get16(r + 8);
+			int to = (int16_t)proto_get16(r + 10);
+			const char *source = r[5] < numSources ? sources[r[5]] : "?";
+			if(out != stdout)
+				fprintf(out, "%lld,%d,%s,%u,%.1f,%.1f,%u\n", timeUs, r[4], source, proto_get16(r + 6),
+						from / (float)PROTO_DUTY_SCALE, to / (float)PROTO_DUTY_SCALE, proto_get32(r + 12));
+			else
+				printf("%10.3f s  train %d  %6.1f%% -> %6.1f%% over %5u ms  %s %u\n", (timeUs - startUs) / 1e6,
+						r[4], from / (float)PROTO_DUTY_SCALE, to / (float)PROTO_DUTY_SCALE, proto_get32(r + 12),
+						source, proto_get16(r + 6));
+		}
+		next = first + n;
+		if(n == 0 || next == head)
+			break;
+		proto_put32(payload, next);
+		len = sizeof(payload);
+	}
+	if(out != stdout){
+		fclose(out);
+		printf("Saved %d duty changes to %s.\n", count, usrBuf);
+	} else if(count == 0){
+		printf("The server has not changed any duty yet.\n");
+	}
+	if(lost != 0)
+		printf("%u duty changes were overwritten while the trace was read.\n", lost);
+	printf("\nPress enter to continue.\n");
+	int c;
+	while((c=fgetc(stdin)) != '\n' && c != EOF);
+}
+
+// prints the duty cycle of train, with the progress of its fade when one is running
+// uses the prediction, or asks the server when it only speaks text
+void printStatus(int sock, int train){
+	if(!binary){
+		printf("Train %d duty cycle is %d%%.", train, getDuty(sock, train));
+		return;
+	}
+	predict(train, nowUs());
+	printf("Train %d duty cycle is %.1f%%", train, trainStatus[train].duty / (float)PROTO_DUTY_SCALE);
+	if(trainStatus[train].progress < 100 && trainStatus[train].target != trainStatus[train].duty)
+		printf(", fading to %.1f%% (%d%% done)", trainStatus[train].target / (float)PROTO_DUTY_SCALE,
+				trainStatus[train].progress);
+	printf(".");
+}
+
+// user simpy enters desired duty cycle, like direct control
+// changes of speed in the same direction go over the udp throttle channel,
+// stops and changes of direction go over tcp
+// shows how many throttles the server has received, lost and dropped as stale
+void udpControl(int sock, int train){
+	char usrBuf[MAXDATASIZE+1];
+	int badFlag = 0;
+	int sent = 0;
+	if(!binary || udpSock == -1 || token == 0){
+		printf("The server does not have a udp throttle channel.\n");
+		sleep(2);
+		return;
+	}
+	if(!takeTrain(sock, train))
+		return;
+	subscribe(sock, TELEMETRY_HZ);
+	do {
+		proto_frame_t f;
+		waitAck(sock, sendFrame(sock, MSG_UDP_STATS, train, NULL, 0), &f);
+		system("clear");
+		if(badFlag){
+			printf("%s is not a valid entry.\nPlease enter a number between -100 and 100 or q.\n\n", usrBuf);
+			badFlag = 0;
+		}
+		if(f.len >= 17 && f.payload[0] == PROTO_OK)
+			printf("Sent %d throttles over udp. Server received %u, lost %u, dropped %u out of order.\n\n", sent,
+					proto_get32(f.payload + 1), proto_get32(f.payload + 5), proto_get32(f.payload + 9));
+		printStatus(sock, train);
+		printf("\nEnter new duty cycle or q to quit.\n> ");
+
+		// get user input, showing the train's live duty cycle while waiting
+		readInput(sock, train, usrBuf);
+
+		// deal with input
+		if (strcmp("q", usrBuf) == 0) {
+			setDuty(sock, train, 0, 0);
+			printf("\nQuitting udp control. Train will stop.");
+		}
+		else{
+			// check input is valid number
+			if(!isValidDuty(usrBuf)){
+				badFlag = 1;
+				continue;
+			}
+			int duty = strtol(usrBuf, NULL, 10);
+			int target = trainStatus[train].target / PROTO_DUTY_SCALE;
+			if(duty == 0 || target == 0 || (duty > 0) != (target > 0)){
+				setDuty(sock, train, duty, 0);	// stop or change of direction, needs to arrive
+			}
+			else{
+				sendThrottle(train, abs(duty));
+				sent++;
+			}
+		}
+	}while(strcmp("q", usrBuf) != 0);
+	subscribe(sock, 0);
+	releaseTrain(sock, train);
+}
+
+// drives trains from the keyboard on a screen that shows every train live
+// up and down step the duty cycle, page up and down step it further, space stops the train,
+// left and right or a train's number switch trains, f takes over a train another cab is driving
+// and q stops every train driven from here and quits
+// one poll() loop serves the keyboard, the server and the heartbeat, nothing blocks but taking a train
+// returns the train being driven when the user quit
+int cabControl(int sock, int train){
+	int duty[NUM_TRAINS] = {0};		// setpoint of each train, percent
+	int driving[NUM_TRAINS] = {0};	// trains we have taken
+	char message[80] = "";
+	long long inputUs = 0, drawUs = 0;	// longest time spent handling a key and redrawing
+	int take = 1, force = 0;
+	int dirty = 1;
+	if(!binary){
+		printf("The cab needs a server that speaks frames.\n");
+		sleep(2);
+		return train;
+	}
+	subscribe(sock, TELEMETRY_HZ);
+	initscr();
+	cbreak();
+	noecho();
+	keypad(stdscr, TRUE);
+	nodelay(stdscr, TRUE);
+	curs_set(0);
+	while(1){
+		if(take){	// become the train's controller, carrying on at the speed it is going
+			proto_frame_t f;
+			uint8_t payload = force;
+			waitAck(sock, sendFrame(sock, MSG_TAKE, train, &payload, 1), &f);
+			if(f.len >= 1 && f.payload[0] == PROTO_OK){
+				driving[train] = 1;
+				duty[train] = trainStatus[train].target / PROTO_DUTY_SCALE;
+				message[0] = '\0';
+			} else {
+				snprintf(message, sizeof(message), "Train %d is being driven by another cab, f takes it over.", train);
+			}
+			take = force = 0;
+			dirty = 1;
+		}
+		int moving = 0;
+		for(int i = 0; i < NUM_TRAINS; i++)
+			moving |= predict(i, nowUs());
+		if(dirty){
+			long long start = nowUs();
+			erase();
+			mvprintw(0, 0, "Cab - up/down %d%%, page up/down %d%%, space stops, e brakes every train, "
+					"left/right or 0-%d picks a train, q quits", CAB_STEP, CAB_BIG_STEP, NUM_TRAINS - 1);
+			for(int i = 0; i < NUM_TRAINS; i++){
+				int bar = abs(trainStatus[i].duty) * 40 / (100 * PROTO_DUTY_SCALE);
+				mvprintw(2 + i, 0, "%s Train %d %6.1f%% %c%-40.*s", i == train ? ">" : " ", i,
+						trainStatus[i].duty / (float)PROTO_DUTY_SCALE, trainStatus[i].duty < 0 ? '<' : '|',
+						bar, "########################################");
+				if(trainStatus[i].progress < 100 && trainStatus[i].target != trainStatus[i].duty)
+					printw(" to %.1f%%", trainStatus[i].target / (float)PROTO_DUTY_SCALE);
+				if(driving[i])
+					printw("  set %d%%", duty[i]);
+			}
+			mvprintw(3 + NUM_TRAINS, 0, "%s", message);
+			mvprintw(4 + NUM_TRAINS, 0, "slowest key %lld us, slowest redraw %lld us", inputUs, drawUs);
+			refresh();
+			dirty = 0;
+			if(nowUs() - start > drawUs)
+				drawUs = nowUs() - start;
+		}
+
+		int timeout = -1;
+		if(heartbeatMs){	// keep the server hearing from us at least three times a deadline
+			long long due = lastSentMs + heartbeatMs / 3 - nowMs();
+			if(due <= 0){
+				sendFrame(sock, MSG_HEARTBEAT, 0, NULL, 0);
+				due = heartbeatMs / 3;
+			}
+			timeout = due;
+		}
+		if(moving && (timeout < 0 || timeout > 1000 / REDRAW_HZ))
+			timeout = 1000 / REDRAW_HZ;
+		struct pollfd fds[2] = {{0, POLLIN, 0}, {sock, POLLIN, 0}};
+		if(!tcp_frame_buffered() && poll(fds, 2, timeout) <= 0){
+			dirty |= moving;	// redraw what is changing from the prediction
+			continue;
+		}
+		if(fds[1].revents & POLLIN || tcp_frame_buffered()){
+			proto_frame_t f;
+			do {
+				tcp_recv_frame(sock, &f);
+				if(f.type == MSG_ACK && f.len >= 1 && f.payload[0] != PROTO_OK)
+					snprintf(message, sizeof(message), "Command %d failed with status %d.", f.seq, f.payload[0]);
+				else
+					handleFrame(&f);
+			} while(tcp_frame_buffered());
+			dirty = 1;
+		}
+		if(fds[0].revents & (POLLIN | POLLHUP)){
+			int ch;
+			while((ch = getch()) != ERR){
+				long long start = nowUs();
+				int to = duty[train];
+				if(ch == 'q')
+					break;
+				else if(ch == KEY_UP)
+					to += CAB_STEP;
+				else if(ch == KEY_DOWN)
+					to -= CAB_STEP;
+				else if(ch == KEY_PPAGE)
+					to += CAB_BIG_STEP;
+				else if(ch == KEY_NPAGE)
+					to -= CAB_BIG_STEP;
+				else if(ch == ' ')
+					to = 0;
+				else if(ch == KEY_LEFT || ch == KEY_RIGHT || (ch >= '0' && ch < '0' + NUM_TRAINS)){
+					train = ch == KEY_LEFT ? (train + NUM_TRAINS - 1) % NUM_TRAINS :
+							ch == KEY_RIGHT ? (train + 1) % NUM_TRAINS : ch - '0';
+					take = !driving[train];
+				}
+				else if(ch == 'f' && !driving[train])
+					take = force = 1;
+				else if(ch == 'e'){	// every train, not just ours, so nothing starts again until asked
+					emergencyStop(sock);
+					memset(duty, 0, sizeof(duty));
+					to = 0;
+					snprintf(message, sizeof(message), "Emergency stop, every train is braked.");
+				}
+				to = to > 100 ? 100 : to < -100 ? -100 : to;
+				if(to != duty[train] && driving[train]){
+					duty[train] = to;
+					setDuty(sock, train, to, 0);
+				}
+				dirty = 1;
+				if(nowUs() - start > inputUs)
+					inputUs = nowUs() - start;
+			}
+			if(ch == 'q' || fds[0].revents & POLLHUP)	// quit, or the terminal went away
+				break;
+		}
+	}
+	endwin();
+	subscribe(sock, 0);
+	for(int i = 0; i < NUM_TRAINS; i++){
+		if(driving[i]){
+			setDuty(sock, i, 0, 0);
+			releaseTrain(sock, i);
+		}
+	}
+	return train;
+}
+
+// user enters the trains to move along with train, then duty cycles and fade times for them all, like fade control
+// each command is scheduled on the server for the same moment, so the trains start together
+// however the packets carrying them are delayed on the way
+void groupControl(int sock, int train){
+	char usrBuf[MAXDATASIZE+1];
+	int group[NUM_TRAINS];
+	int n = 0;
+	int badFlag = 0;
+	if(!binary || !syncClock(sock)){
+		printf("The server cannot schedule commands.\n");
+		sleep(2);
+		return;
+	}
+	printf("Enter the trains to move with train %d separated by commas.\n> ", train);
+	scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
+	int c;
+	while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+	group[n++] = train;
+	for(char *trainStr = strtok(usrBuf, ","); trainStr != NULL && n < NUM_TRAINS; trainStr = strtok(NULL, ",")){
+		if(!isValidTrain(trainStr))
+			continue;
+		int other = strtol(trainStr, NULL, 10);
+		int dup = 0;
+		for(int i = 0; i < n; i++)
+			dup |= group[i] == other;
+		if(!dup)
+			group[n++] = other;
+	}
+	for(int i = 0; i < n; i++){
+		if(!takeTrain(sock, group[i])){
+			while(i-- > 0)
+				releaseTrain(sock, group[i]);
+			return;
+		}
+	}
+	subscribe(sock, TELEMETRY_HZ);
+	do {
+		system("clear");
+		if(badFlag){
+			printf("%s is not a valid entry.\nPlease enter a number between -100 and 100 and a positive number or q.\n\n", usrBuf);
+			badFlag = 0;
+		}
+		for(int i = n - 1; i > 0; i--){
+			printStatus(sock, group[i]);
+			printf("\n");
+		}
+		printStatus(sock, train);	// last, it is the one readInput keeps up to date
+		printf("\nEnter new duty cycle and fade time for all %d trains separated by a comma or q to quit.\n> ", n);
+
+		// get user input, showing the train's live duty cycle while waiting
+		readInput(sock, train, usrBuf);
+
+		// deal with input
+		int duty, fade;
+		if (strcmp("q", usrBuf) == 0) {
+			duty = 0;
+			fade = 0;
+			printf("\nQuitting group control. Trains will stop.");
+		}
+		else{
+			// check input is valid number
+			char *dutyStr = strtok(usrBuf, ",");
+			char *fadeStr = strtok(NULL, ",");
+			if(!isValidDuty(dutyStr) || !isValidFade(fadeStr)){
+				badFlag = 1;
+				continue;
+			}
+			duty = strtol(dutyStr, NULL, 10);
+			fade = strtol(fadeStr, NULL, 10);
+		}
+		syncClock(sock);	// so the clocks have not drifted apart since the last command
+		long long atUs = nowUs() + clockOffsetUs + GROUP_LEAD_MS * 1000;
+		for(int i = 0; i < n; i++)
+			setDutyAt(sock, group[i], duty, fade, atUs);
+	}while(strcmp("q", usrBuf) != 0);
+	subscribe(sock, 0);
+	for(int i = 0; i < n; i++)
+		releaseTrain(sock, group[i]);
+}
+
+// user enters the number of the train to control
+// returns the selected train, or 'train' if the user quits
+int selectTrain(int train){
+	char usrBuf[MAXDATASIZE+1];
+	int badFlag = 0;
+	do {
+		system("clear");
+		if(badFlag){
+			printf("%s is not a valid entry.\nPlease enter a number between 0 and %d or q.\n\n", usrBuf, NUM_TRAINS - 1);
+			badFlag = 0;
+		}
+		printf("Controlling train %d. Enter train to control or q to quit.\n> ", train);
+
+		// get user input
+		scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
+
+		// eat extraneous characters
+		int c;
+		while((c=fgetc(stdin)) != '\n' && c != EOF);
+
+		if (strcmp("q", usrBuf) == 0)
+			return train;
+		if(!isValidTrain(usrBuf))
+			badFlag = 1;
+	}while(badFlag);
+	return strtol(usrBuf, NULL, 10);
+}
+
+// shows and changes the momentum the server gives train
+// while it is on, a duty cycle is the speed the train works up to as fast as its mass allows
+void inertiaSettings(int sock, int train){
+	char line[MAXDATASIZE+2];
+	int badFlag = 0;
+	if(!binary){
+		printf("The server does not model momentum.\n");
+		sleep(2);
+		return;
+	}
+	while(1){
+		proto_frame_t f;
+		waitAck(sock, sendFrame(sock, MSG_INERTIA, train, NULL, 0), &f);
+		system("clear");
+		if(f.len < 10 || f.payload[0] != PROTO_OK){
+			printf("The server does not model momentum.\n");
+			sleep(2);
+			return;
+		}
+		const uint8_t *p = f.payload + 1;
+		if(badFlag){
+			printf("%s is not a valid entry.\n\n", line);
+			badFlag = 0;
+		}
+		printf("Train %d momentum is %s.\nMass %d%%, accelerates at %.1f%%/s, brakes at %.1f%%/s, grade %.1f%%/s\n\n",
+				train, p[0] ? "on" : "off", proto_get16(p + 1), proto_get16(p + 3) / 10.0,
+				proto_get16(p + 5) / 10.0, (int16_t)proto_get16(p + 7) / 10.0);
+		printf("Enter on, off, 'mass accel brake grade' (e.g. 100 5 10 0) or q to quit.\n> ");
+		if(fgets(line, sizeof(line), stdin) == NULL)
+			return;
+		line[strcspn(line, "\n")] = '\0';
+		uint8_t payload[9];
+		int mass;
+		float accel, brake, grade;
+		memcpy(payload, p, sizeof(payload));
+		if(strcmp("q", line) == 0)
+			return;
+		else if(strcmp("on", line) == 0 || strcmp("off", line) == 0)
+			payload[0] = strcmp("on", line) == 0;
+		else if(sscanf(line, "%d %f %f %f", &mass, &accel, &brake, &grade) == 4 && mass > 0 && mass <= 1000 &&
+				accel >= 0.1 && accel <= 100 && brake >= 0.1 && brake <= 100 && grade >= -100 && grade <= 100){
+			proto_put16(payload + 1, mass);
+			proto_put16(payload + 3, (int)(accel * 10 + 0.5));
+			proto_put16(payload + 5, (int)(brake * 10 + 0.5));
+			proto_put16(payload + 7, (int16_t)(grade * 10 + (grade < 0 ? -0.5 : 0.5)));
+		} else {
+			badFlag = 1;
+			continue;
+		}
+		waitAck(sock, sendFrame(sock, MSG_INERTIA, train, payload, sizeof(payload)), &f);
+		if(f.len >= 1 && f.payload[0] == PROTO_ERR_OWNER){
+			printf("Train %d is being driven by another cab.\n", train);
+			sleep(2);
+		}
+	}
+}
+
+// selects the curve the server uses to turn train's duty cycle into motor power
+void curveSettings(int sock, int train){
+	const char *names[] = {"linear", "exponential", "s-curve", "calibrated"};
+	char usrBuf[MAXDATASIZE+1];
+	proto_frame_t f;
+	if(!binary){
+		printf("The server only has a linear speed curve.\n");
+		sleep(2);
+		return;
+	}
+	waitAck(sock, sendFrame(sock, MSG_CURVE, train, NULL, 0), &f);
+	if(f.len < 3 || f.payload[0] != PROTO_OK){
+		printf("The server only has a linear speed curve.\n");
+		sleep(2);
+		return;
+	}
+	int count = f.payload[2];
+	int calibrated = f.len >= 3 + 2 * CURVE_CAL_POINTS;	// the server keeps a calibration per train
+	system("clear");
+	printf("Train %d uses speed curve %d. Select a curve or q to quit.\n", train, f.payload[1]);
+	for(int i = 0; i < count; i++)
+		printf("\t(%d) - %s\n", i, i < 4 ? names[i] : "");
+	if(calibrated){
+		printf("Calibrated, it needs");
+		for(int j = 0; j < CURVE_CAL_POINTS; j++)
+			printf(" %.1f", proto_get16(f.payload + 3 + 2 * j) / (float)PROTO_DUTY_SCALE);
+		printf("%% power at 0%%, 10%% .. 100%% of speed.\n");
+	}
+	printf("> ");
+	scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
+	int c;
+	while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+	if(!isdigit((unsigned char)usrBuf[0]) || usrBuf[1] != '\0' || usrBuf[0] - '0' >= count)
+		return;
+	uint8_t payload[1 + 2 * CURVE_CAL_POINTS];
+	int len = 1;
+	payload[0] = usrBuf[0] - '0';
+	if(payload[0] == CURVE_CAL_CURVE && calibrated){
+		char line[512];
+		printf("Enter the power in %% train %d needs at 0%%, 10%% .. 100%% of speed, %d numbers rising to 100,\n"
+				"or nothing to keep its calibration\n> ", train, CURVE_CAL_POINTS);
+		if(fgets(line, sizeof(line), stdin) == NULL)
+			return;
+		char *p = line, *end;
+		int n = 0;
+		for(double power; n < CURVE_CAL_POINTS && (power = strtod(p, &end), end != p) && power >= 0 && power <= 100; p = end)
+			proto_put16(payload + 1 + 2 * n++, (int)(power * PROTO_DUTY_SCALE + 0.5));
+		if(n == CURVE_CAL_POINTS)
+			len += 2 * CURVE_CAL_POINTS;
+		else if(strspn(line, " \t\r\n") != strlen(line)){
+			printf("That is not %d powers from 0 to 100.\n", CURVE_CAL_POINTS);
+			sleep(2);
+			return;
+		}
+	}
+	waitAck(sock, sendFrame(sock, MSG_CURVE, train, payload, len), &f);
+	if(f.len >= 1 && f.payload[0] == PROTO_ERR_ARG){
+		printf("The server refused the calibration, the powers must not fall and must end at 100.\n");
+		sleep(2);
+	}
+	if(f.len >= 1 && f.payload[0] == PROTO_ERR_OWNER){
+		printf("Train %d is being driven by another cab.\n", train);
+		sleep(2);
+	}
+}
+
+// shows the pwm profile of the train and lets the user pick another
+void pwmSettings(int sock, int train){
+	const char *names[] = {PWM_PROFILE_NAMES};
+	char usrBuf[MAXDATASIZE+1];
+	proto_frame_t f;
+	if(!binary){
+		printf("The server only drives its trains at 10 kHz.\n");
+		sleep(2);
+		return;
+	}
+	waitAck(sock, sendFrame(sock, MSG_PWM, train, NULL, 0), &f);
+	if(f.len < 8 || f.payload[0] != PROTO_OK){
+		printf("The server only drives its trains at 10 kHz.\n");
+		sleep(2);
+		return;
+	}
+	int count = f.payload[2];
+	system("clear");
+	printf("Train %d is driven at %u Hz with %d bits of duty (%s). Select a profile or q to quit.\n", train,
+			proto_get32(f.payload + 3), f.payload[7], f.payload[1] < PWM_PROFILE_COUNT ? names[f.payload[1]] : "?");
+	for(int i = 0; i < count; i++)
+		printf("\t(%d) - %s\n", i, i < PWM_PROFILE_COUNT ? names[i] : "");
+	printf("> ");
+	scanf("%"XSTR(MAXDATASIZE)"s", usrBuf);
+	int c;
+	while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+	if(!isdigit((unsigned char)usrBuf[0]) || usrBuf[1] != '\0' || usrBuf[0] - '0' >= count)
+		return;
+	uint8_t profile = usrBuf[0] - '0';
+	waitAck(sock, sendFrame(sock, MSG_PWM, train, &profile, 1), &f);
+	if(f.len >= 1 && f.payload[0] == PROTO_ERR_OWNER){
+		printf("Train %d is being driven by another cab.\n", train);
+		sleep(2);
+	}
+}
+
+// shows how the train's motor stops and reverses and lets the user change it
+void motorSettings(int sock, int train){
+	const char *states[] = {MOTOR_STATE_NAMES};
+	char usrBuf[MAXDATASIZE+1];
+	proto_frame_t f;
+	if(!binary){
+		printf("The server only lets its trains coast to a stop.\n");
+		sleep(2);
+		return;
+	}
+	waitAck(sock, sendFrame(sock, MSG_MOTOR, train, NULL, 0), &f);
+	if(f.len < 5 || f.payload[0] != PROTO_OK){
+		printf("The server only lets its trains coast to a stop.\n");
+		sleep(2);
+		return;
+	}
+	system("clear");
+	printf("Train %d %s when stopped, rests %d ms at zero when reversing and is now %s.\n", train,
+			f.payload[1] == MOTOR_BRAKE ? "brakes" : "coasts", proto_get16(f.payload + 2),
+			f.payload[4] <= MOTOR_DRIVE ? states[f.payload[4]] : "?");
+	printf("Enter c to coast or b to brake when stopped, then the rest in ms, or q to quit\n> ");
+	uint8_t payload[3];
+	int dwell;
+	char mode;
+	if(fgets(usrBuf, sizeof(usrBuf), stdin) == NULL || sscanf(usrBuf, " %c %d", &mode, &dwell) != 2 ||
+			(mode != 'c' && mode != 'b') || dwell < 0 || dwell > UINT16_MAX)
+		return;
+	payload[0] = mode == 'b' ? MOTOR_BRAKE : MOTOR_COAST;
+	proto_put16(payload + 1, dwell);
+	waitAck(sock, sendFrame(sock, MSG_MOTOR, train, payload, sizeof(payload)), &f);
+	if(f.len >= 1 && f.payload[0] == PROTO_OK)
+		trainStatus[train].dwellMs = dwell;
+	if(f.len >= 1 && f.payload[0] == PROTO_ERR_OWNER){
+		printf("Train %d is being driven by another cab.\n", train);
+		sleep(2);
+	}
+}
+
+// shows the program the server runs on train and lets the user replace, run or stop it
+// running it hands the train over to the program, which carries on after we quit
+void programSettings(int sock, int train){
+	const char *states[] = {"stopped", "running", "paused while a cab drives the train"};
+	char line[512];
+	proto_frame_t f;
+	if(!binary){
+		printf("The server cannot run programs.\n");
+		sleep(2);
+		return;
+	}
+	while(1){
+		waitAck(sock, sendFrame(sock, MSG_PROGRAM, train, NULL, 0), &f);
+		if(f.len < 4 || f.payload[0] != PROTO_OK){
+			printf("The server cannot run programs.\n");
+			sleep(2);
+			return;
+		}
+		system("clear");
+		printf("Train %d program is %s.\n", train, f.payload[1] <= PROG_STATE_PAUSED ? states[f.payload[1]] : "?");
+		int len = f.payload[3] < f.len - 4 ? f.payload[3] : f.len - 4;
+		printProgram(f.payload + 4, len, f.payload[1] == PROG_STATE_STOPPED ? -1 : f.payload[2]);
+		printf("\nEnter a new program, r to run it, s to stop it or q to quit.\n");
+		printf("Separate steps with commas: ramp <duty> <fade time>, hold <time>, wait, reverse, loop <step> <count>, end\n> ");
+		if(fgets(line, sizeof(line), stdin) == NULL)
+			return;
+		if(strchr(line, '\n') == NULL){
+			int c;
+			while((c=fgetc(stdin)) != '\n' && c != EOF); // eat extra chars
+		}
+		line[strcspn(line, "\n")] = '\0';
+		uint8_t payload[1 + PROG_MAX_LEN];
+		len = 1;
+		if(strcmp("q", line) == 0)
+			return;
+		else if(strcmp("r", line) == 0)
+			payload[0] = PROG_RUN;
+		else if(strcmp("s", line) == 0)
+			payload[0] = PROG_STOP;
+		else {
+			int n = compileProgram(line, payload + 1);
+			if(n < 0){
+				printf("That is not a program the server can run.\n");
+				sleep(2);
+				continue;
+			}
+			payload[0] = PROG_LOAD;
+			len += n;
+		}
+		waitAck(sock, sendFrame(sock, MSG_PROGRAM, train, payload, len), &f);
+		if(f.len >= 1 && f.payload[0] == PROTO_ERR_OWNER){
+			printf("Train %d is being driven by another cab.\n", train);
+			sleep(2);
+		}
+		else if(f.len >= 1 && f.payload[0] != PROTO_OK){
+			printf("The server would not take that program.\n");
+			sleep(2);
+		}
+	}
+}
+
+// prints a program one numbered step per line, marking the step at offset pc
+void printProgram(const uint8_t *code, int len, int pc){
+	int offsets[PROG_MAX_LEN];
+	int step = 0;
+	if(len == 0)
+		printf("\t(no program)\n");
+	for(int i = 0; i < len && prog_op_len(code[i]) != 0 && i + prog_op_len(code[i]) <= len; i += prog_op_len(code[i])){
+		const uint8_t *op = code + i;
+		offsets[step] = i;
+		printf("%s%2d: ", i == pc ? "  -> " : "\t", step++);
+		switch(op[0]){
+			case PROG_OP_END:
+				printf("end\n");
+				break;
+			case PROG_OP_RAMP:
+				printf("ramp to %.1f%% over %u ms\n", (int16_t)proto_get16(op + 1) / (float)PROTO_DUTY_SCALE, proto_get32(op + 3));
+				break;
+			case PROG_OP_HOLD:
+				printf("hold for %u ms\n", proto_get32(op + 1));
+				break;
+			case PROG_OP_WAIT:
+				printf("wait to reach speed\n");
+				break;
+			case PROG_OP_REVERSE:
+				printf("reverse\n");
+				break;
+			case PROG_OP_LOOP:{
+				int target = 0;
+				while(target < step && offsets[target] != op[1])
+					target++;
+				if(op[2] == 0)
+					printf("loop back to step %d forever\n", target);
+				else
+					printf("loop back to step %d until run %d times\n", target, op[2]);
+				break;
+			}
+		}
+	}
+}
+
+// turns text such as "ramp 60 3000, hold 5000, ramp 0 3000, reverse, loop 0 0" into PROG_OP_ steps in code,
+// which must hold PROG_MAX_LEN bytes
+// loops name the step to go back to by its number, counting from 0
+// returns the length of the program, or -1 if the text is not a program
+int compileProgram(char *text, uint8_t *code){
+	int offsets[PROG_MAX_LEN];
+	int len = 0;
+	int steps = 0;
+	char *save;
+	for(char *stepStr = strtok_r(text, ",", &save); stepStr != NULL; stepStr = strtok_r(NULL, ",", &save)){
+		char name[16];
+		int a = 0, b = 0;
+		int args = sscanf(stepStr, "%15s %d %d", name, &a, &b) - 1;
+		if(args < 0)
+			return -1;
+		uint8_t op[7];
+		if(strcmp(name, "ramp") == 0 && args == 2 && a >= -100 && a <= 100 && b >= 0){
+			op[0] = PROG_OP_RAMP;
+			proto_put16(op + 1, a * PROTO_DUTY_SCALE);
+			proto_put32(op + 3, b);
+		} else if(strcmp(name, "hold") == 0 && args == 1 && a >= 0){
+			op[0] = PROG_OP_HOLD;
+			proto_put32(op + 1, a);
+		} else if(strcmp(name, "wait") == 0 && args == 0){
+			op[0] = PROG_OP_WAIT;
+		} else if(strcmp(name, "reverse") == 0 && args == 0){
+			op[0] = PROG_OP_REVERSE;
+		} else if(strcmp(name, "end") == 0 && args == 0){
+			op[0] = PROG_OP_END;
+		} else if(strcmp(name, "loop") == 0 && args >= 1 && a >= 0 && a < steps && b >= 0 && b <= 255){
+			op[0] = PROG_OP_LOOP;
+			op[1] = offsets[a];
+			op[2] = b;
+		} else {
+			return -1;
+		}
+		if(len + prog_op_len(op[0]) > PROG_MAX_LEN)
+			return -1;
+		memcpy(code + len, op, prog_op_len(op[0]));
+		offsets[steps++] = len;
+		len += prog_op_len(op[0]);
+	}
+	return len;
 }
 
 // returns 1 if str represents an int between -100 and 100 (inclusive) returns 0 otherwise
@@ -303,26 +2042,353 @@ int isValidFade(char *str){
 	return 1;
 }
 
-// requests current duty from esp32 and returns as int
+// returns 1 if str represents a train number between 0 and NUM_TRAINS-1 returns 0 otherwise
+int isValidTrain(char *str){
+	if(!isValidFade(str) || str[0] == '\0')
+		return 0;
+	return strtol(str, NULL, 10) < NUM_TRAINS;
+}
+
+
 int cur_duty = 0;
-int getDuty(int sock){
+
+// requests current duty of train from esp32 and returns as int
+int getDuty(int sock, int train){
 	char buf[MAXDATASIZE+1] = "42";
-	tcp_send(sock, "0");
-	tcp_recv(sock, buf);
 #ifdef NO_NETWORK
 	return cur_duty;
 #endif
+	if(binary){
+		proto_frame_t f;
+		waitAck(sock, sendFrame(sock, MSG_GET, train, NULL, 0), &f);
+		if(f.len < 3 || f.payload[0] != PROTO_OK)
+			return 0;
+		return (int16_t)proto_get16(f.payload + 1) / PROTO_DUTY_SCALE;
+	}
+	snprintf(buf, MAXDATASIZE, GET" %d", train);
+	tcp_send(sock, buf, strlen(buf));
+	tcp_recv(sock, buf);
 	return strtol(buf, NULL, 10);
 }
 
-// sends duty and fade time to server
-void setDuty(int sock, int duty, int time){
+// sends duty and fade time for train to server
+// does not wait for the ack, it is checked by the next waitAck
+void setDuty(int sock, int train, int duty, int time){
 	char buf[MAXDATASIZE+1];
-	snprintf(buf, MAXDATASIZE, "1 %d %d", duty, time);
-	tcp_send(sock, buf);
 #ifdef NO_NETWORK
 	cur_duty = duty;
+	return;
 #endif
+	if(binary){
+		uint8_t payload[6];
+		proto_put16(payload, duty * PROTO_DUTY_SCALE);
+		proto_put32(payload + 2, time);
+		trainStatus[train].setSeq = sendFrame(sock, MSG_SET, train, payload, sizeof(payload));
+		trainStatus[train].setPending = 1;
+		trainStatus[train].setDuty = duty * PROTO_DUTY_SCALE;
+		trainStatus[train].setTime = time;
+		trainStatus[train].setAtUs = 0;
+		return;
+	}
+	snprintf(buf, MAXDATASIZE, SET" %d %d %d", duty, time, train);
+	tcp_send(sock, buf, strlen(buf));
+}
+
+// sends duty and fade time for train to server, to be carried out at atUs on the server's clock
+// does not wait for the ack, it is checked by the next waitAck
+void setDutyAt(int sock, int train, int duty, int time, long long atUs){
+	uint8_t payload[14];
+	proto_put16(payload, duty * PROTO_DUTY_SCALE);
+	proto_put32(payload + 2, time);
+	proto_put64(payload + 6, atUs);
+	trainStatus[train].setSeq = sendFrame(sock, MSG_SET, train, payload, sizeof(payload));
+	trainStatus[train].setPending = 1;
+	trainStatus[train].setDuty = duty * PROTO_DUTY_SCALE;
+	trainStatus[train].setTime = time;
+	trainStatus[train].setAtUs = atUs - clockOffsetUs;
+}
+
+// brakes every train on the server to a stop at once, whoever is driving it
+// does not wait for the ack, it is checked by the next waitAck
+void emergencyStop(int sock){
+	uint16_t seq = sendFrame(sock, MSG_ESTOP, PROTO_ALL_TRAINS, NULL, 0);
+	for(int i = 0; i < NUM_TRAINS; i++){	// carried on like a set to zero once acked
+		trainStatus[i].setSeq = seq;
+		trainStatus[i].setPending = 1;
+		trainStatus[i].setDuty = 0;
+		trainStatus[i].setTime = 0;
+		trainStatus[i].setAtUs = 0;
+	}
+}
+
+// switches the connection to binary frames
+// an old server answers with a text duty instead of a MSG_HELLO, in which case we stay with text
+void hello(int sock){
+	uint8_t version = PROTO_VERSION;
+	proto_frame_t f;
+	uint16_t seq = sendFrame(sock, MSG_HELLO, 0, &version, 1);
+	tcp_recv_frame(sock, &f);
+	if(f.type == MSG_HELLO && f.seq == seq && f.len >= 2){
+		binary = 1;
+		if(f.len >= 6)
+			token = proto_get32(f.payload + 2);
+		fprintf(stderr, "client: server speaks protocol version %d with %d trains\n", f.payload[0], f.payload[1]);
+	}
+	else
+		fprintf(stderr, "client: server only speaks the text protocol\n");
+}
+
+// asks the server to stop our trains if it stops hearing from us
+void heartbeat(int sock){
+	uint8_t payload[4];
+	proto_frame_t f;
+	if(!binary)
+		return;
+	proto_put16(payload, HEARTBEAT_MS);
+	proto_put16(payload + 2, ESTOP_MS);
+	waitAck(sock, sendFrame(sock, MSG_HEARTBEAT_CFG, 0, payload, sizeof(payload)), &f);
+	if(f.len >= 5 && f.payload[0] == PROTO_OK)
+		heartbeatMs = proto_get16(f.payload + 1);
+	else
+		fprintf(stderr, "client: server does not support heartbeats\n");
+}
+
+// milliseconds on a clock that only goes forward
+long long nowMs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// microseconds on a clock that only goes forward
+long long nowUs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// works out clockOffsetUs from the reading of the server's clock with the quickest round trip,
+// taking the server to have read it halfway through
+// returns 1 when successful, 0 when the server does not share its clock
+int syncClock(int sock){
+	proto_frame_t f;
+	long long best = -1;
+	for(int i = 0; i < CLOCK_SYNC_ROUNDS; i++){
+		long long sent = nowUs();
+		waitAck(sock, sendFrame(sock, MSG_TIME, 0, NULL, 0), &f);
+		long long rtt = nowUs() - sent;
+		if(f.len < 9 || f.payload[0] != PROTO_OK)
+			return 0;
+		if(best < 0 || rtt < best){
+			best = rtt;
+			clockOffsetUs = (long long)proto_get64(f.payload + 1) - (sent + rtt / 2);
+		}
+	}
+	return 1;
+}
+
+// asks the server to push telemetry 'hz' times a second, 0 to stop
+void subscribe(int sock, int hz){
+	uint8_t payload[2];
+	if(!binary)
+		return;
+	proto_put16(payload, hz > 0 ? 1000 / hz : 0);
+	sendFrame(sock, MSG_SUBSCRIBE, 0, payload, sizeof(payload));
+}
+
+// becomes the controller of train, offering to take it over if another cab is driving it
+// the question is asked through readInput, so trains we already control keep their heartbeat while it waits
+// returns 1 when we control the train, 0 otherwise
+int takeTrain(int sock, int train){
+	char usrBuf[MAXDATASIZE+1];
+	uint8_t force = 0;
+	proto_frame_t f;
+	if(!binary)
+		return 1;
+	waitAck(sock, sendFrame(sock, MSG_TAKE, train, &force, 1), &f);
+	if(f.len >= 1 && f.payload[0] == PROTO_ERR_BUSY){
+		printStatus(sock, train);	// two lines above the answer, where readInput keeps it up to date
+		printf("\nTrain %d is being driven by another cab. Take it over? (y/n)\n> ", train);
+		readInput(sock, train, usrBuf);
+		if(strcmp("y", usrBuf) != 0)
+			return 0;
+		force = 1;
+		waitAck(sock, sendFrame(sock, MSG_TAKE, train, &force, 1), &f);
+	}
+	if(f.len < 1 || f.payload[0] != PROTO_OK)
+		return 0;
+	waitAck(sock, sendFrame(sock, MSG_MOTOR, train, NULL, 0), &f);	// the rest at zero our prediction has to make
+	trainStatus[train].dwellMs = f.len >= 5 && f.payload[0] == PROTO_OK ? proto_get16(f.payload + 2) : 0;
+	return 1;
+}
+
+// gives up control of train so another cab can drive it
+void releaseTrain(int sock, int train){
+	if(binary)
+		sendFrame(sock, MSG_RELEASE, train, NULL, 0);
+}
+
+// sends a throttle for train over the udp channel, in whichever direction it was last sent over tcp
+// datagrams can be lost or reordered, the server only applies one newer than any it has seen
+void sendThrottle(int train, int throttle){
+	static uint16_t throttleSeq[NUM_TRAINS];
+	uint8_t buf[PROTO_MAX_FRAME];
+	uint8_t payload[6];
+	proto_put32(payload, token);
+	proto_put16(payload + 4, throttle * PROTO_DUTY_SCALE);
+	int len = proto_encode(buf, MSG_THROTTLE, train, ++throttleSeq[train], payload, sizeof(payload));
+	if(send(udpSock, buf, len, 0) < 0)
+		perror("udp send");
+	else	// never acked, so carried on as if it arrived
+		startFade(train, (trainStatus[train].target < 0 ? -throttle : throttle) * PROTO_DUTY_SCALE, 0, nowUs());
+}
+
+// deals with a frame that is not the reply being waited for
+void handleFrame(proto_frame_t *f){
+	switch(f->type){
+		case MSG_TELEMETRY:{
+			long long now = nowUs();
+			for(const uint8_t *p = f->payload; p + TELEMETRY_ENTRY_LEN <= f->payload + f->len; p += TELEMETRY_ENTRY_LEN){
+				if(p[0] >= NUM_TRAINS)
+					continue;
+				int duty = (int16_t)proto_get16(p + 1);
+				int target = (int16_t)proto_get16(p + 3);
+				uint32_t remainingMs = proto_get32(p + 6);
+				// a frame built before the motor task took a set we started on its ack can arrive after the ack
+				if(trainStatus[p[0]].awaitUs != 0 && target != trainStatus[p[0]].target && now < trainStatus[p[0]].awaitUs)
+					continue;
+				trainStatus[p[0]].awaitUs = 0;
+				predict(p[0], now);
+				int err = abs(trainStatus[p[0]].duty - duty);
+				if(err > predictErrMax)
+					predictErrMax = err;
+				trainStatus[p[0]].from = trainStatus[p[0]].duty = duty;
+				trainStatus[p[0]].target = target;
+				trainStatus[p[0]].progress = p[5];
+				trainStatus[p[0]].startUs = now;
+				trainStatus[p[0]].lenUs = remainingMs * 1000LL;
+				trainStatus[p[0]].modelled = p[10] & TELEMETRY_MODELLED;
+				if(trainStatus[p[0]].modelled && remainingMs > 0)
+					trainStatus[p[0]].rate = abs(target - duty) * 1000LL / remainingMs;
+				planDwell(&trainStatus[p[0]], now, 1);
+			}
+			break;
+		}
+		case MSG_ACK:{
+			if(f->len >= 1 && f->payload[0] != PROTO_OK)
+				fprintf(stderr, "\ncommand %d failed with status %d\n", f->seq, f->payload[0]);
+			for(int i = 0; i < NUM_TRAINS; i++){	// a set the server took, carry it on from now
+				if(!trainStatus[i].setPending || trainStatus[i].setSeq != f->seq)
+					continue;
+				trainStatus[i].setPending = 0;
+				if(f->len < 1 || f->payload[0] != PROTO_OK)
+					continue;
+				if(trainStatus[i].setAtUs > nowUs())
+					trainStatus[i].next = 1;
+				else
+					startFade(i, trainStatus[i].setDuty, trainStatus[i].setTime, nowUs());
+			}
+			break;
+		}
+	}
+}
+
+// carries on a set of train to duty over time ms from now the way the server does, from wherever it is
+// a fade takes at least MIN_FADE_RATE ms per 1% change, but a stop can be instant,
+// and a modelled train changes speed at the last rate it was seen to
+void startFade(int train, int duty, int time, long long now){
+	predict(train, now);
+	int from = trainStatus[train].duty;
+	long long lenMs = abs(duty - from) * MIN_FADE_RATE / PROTO_DUTY_SCALE;
+	if(duty == 0 && lenMs > 1)
+		lenMs = 1;
+	if(time > lenMs)
+		lenMs = time;
+	if(trainStatus[train].modelled)
+		lenMs = trainStatus[train].rate > 0 ? abs(duty - from) * 1000LL / trainStatus[train].rate : -1;
+	trainStatus[train].from = from;
+	trainStatus[train].target = duty;
+	trainStatus[train].startUs = now;
+	trainStatus[train].lenUs = lenMs < 0 ? -1 : lenMs * 1000;
+	trainStatus[train].next = 0;
+	trainStatus[train].awaitUs = now + TELEMETRY_STALE_MS * 1000LL;
+	planDwell(&trainStatus[train], now, 0);
+}
+
+// rests a fade that changes direction at zero for the train's dwell, as the server does,
+// and carries it on from there at the same rate; a modelled train is left to its rate
+// 'held' when lenUs came from telemetry, which counts a rest the server has begun as part of the fade
+void planDwell(train_status_t *t, long long now, int held){
+	long long restUs = t->restUs;
+	t->holdUs = t->restUs = 0;
+	if(t->from != 0)
+		t->dir = t->from > 0 ? 1 : -1;
+	if(t->from != 0 && t->target == 0)
+		t->zeroUs = t->startUs + (t->lenUs > 0 ? t->lenUs : 0);
+	if(t->modelled || t->target == 0 || t->lenUs < 0)
+		return;
+	if(t->from != 0 && (t->from > 0) != (t->target > 0)){
+		t->zeroAtUs = t->lenUs * abs(t->from) / abs(t->target - t->from);
+		t->holdUs = t->dwellMs * 1000LL;
+		t->zeroUs = t->startUs + t->zeroAtUs;
+		t->restUs = t->lenUs - t->zeroAtUs;
+	} else if(t->from == 0 && t->dir != 0 && (t->target > 0) != (t->dir > 0)){
+		t->zeroAtUs = 0;
+		if(held && restUs > 0){	// the server's time left is what it has to go of the rest, then the fade we planned
+			t->holdUs = t->lenUs > restUs ? t->lenUs - restUs : 0;
+			t->lenUs -= t->holdUs;
+			t->restUs = restUs;
+		} else if(now < t->zeroUs + t->dwellMs * 1000LL){	// from when we reckon it came to zero
+			t->holdUs = t->zeroUs + t->dwellMs * 1000LL - now;
+			if(held)
+				t->lenUs = t->lenUs > t->holdUs ? t->lenUs - t->holdUs : 0;
+		}
+	}
+}
+
+// works out the duty of train at 'now' from the fade being carried on, into trainStatus
+// returns 1 while it is changing or a set is due to change it, 0 once it has settled
+int predict(int train, long long now){
+	train_status_t *t = &trainStatus[train];
+	if(t->next && now >= t->setAtUs){
+		t->next = 0;
+		startFade(train, t->setDuty, t->setTime, t->setAtUs);
+	}
+	long long elapsed = now - t->startUs;
+	if(t->holdUs > 0 && elapsed > t->zeroAtUs)	// resting at zero, or that much later carrying on
+		elapsed = elapsed < t->zeroAtUs + t->holdUs ? t->zeroAtUs : elapsed - t->holdUs;
+	if(t->lenUs < 0){
+		t->duty = t->from;
+		t->progress = 0;
+		return 0;
+	}
+	if(elapsed >= t->lenUs){
+		t->duty = t->target;
+		t->progress = 100;
+		return t->next;
+	}
+	t->duty = t->from + (t->target - t->from) * elapsed / t->lenUs;
+	t->progress = elapsed * 100 / t->lenUs;
+	return 1;
+}
+
+// sends a frame and returns its sequence number
+uint16_t sendFrame(int sock, uint8_t type, uint8_t train, const uint8_t *payload, uint8_t len){
+	uint8_t buf[PROTO_MAX_FRAME];
+	uint16_t seq = next_seq++;
+	tcp_send(sock, buf, proto_encode(buf, type, train, seq, payload, len));
+	return seq;
+}
+
+// receives frames until the ack of 'seq' arrives and leaves it in 'f'
+// anything else that arrives meanwhile is passed to handleFrame
+void waitAck(int sock, uint16_t seq, proto_frame_t *f){
+	while(1){
+		tcp_recv_frame(sock, f);
+		if(f->type == MSG_ACK && f->seq == seq)
+			return;
+		handleFrame(f);
+	}
 }
 
 // revives MAXDATASIZE bytes from server into buf and null terminates
@@ -343,21 +2409,83 @@ void tcp_recv(int sock, char *buf){
 #endif
 }
 
+// frames received from server but not yet returned by tcp_recv_frame
+static uint8_t rx[2 * PROTO_MAX_FRAME];
+static int rx_len = 0, consumed = 0;
+
+// returns 1 if tcp_recv_frame can return a frame without receiving
+int tcp_frame_buffered(void){
+	proto_frame_t f;
+	return proto_decode(rx + consumed, rx_len - consumed, &f) != 0;
+}
+
+// receives the next frame from server into f
+// f->payload is valid until the next call
+// anything that does not start with a frame is returned as a frame of type 0
+void tcp_recv_frame(int sock, proto_frame_t *f){
+	memmove(rx, rx + consumed, rx_len - consumed);
+	rx_len -= consumed;
+	consumed = 0;
+	while(1){
+		int len = proto_decode(rx, rx_len, f);
+		if(len > 0){
+			consumed = len;
+			sessionRecord(SESSION_RECEIVED, rx, len);
+			return;
+		}
+		if(len < 0){
+			f->type = 0;
+			f->len = 0;
+			consumed = rx_len;
+			return;
+		}
+		if ((len = recv(sock, rx + rx_len, sizeof(rx) - rx_len, 0)) <= 0) {
+			perror("receive");
+			exit(2);	// the connection is gone, a script calling us needs to know it failed
+		}
+		rx_len += len;
+#ifdef VERBOSE
+		printf("\nrecived %d bytes\n", len);
+#endif
+	}
+}
+
 // sends message of arbitrary length to server
-void tcp_send(int sock, char *buf){
-	int len = strlen(buf);
+void tcp_send(int sock, const void *buf, int len){
 #ifndef NO_NETWORK
+	const char *p = buf;
 	int to_write = len;
 	while (to_write > 0) {
-		int written = send(sock, buf + (len - to_write), to_write, 0);
+		int written = send(sock, p + (len - to_write), to_write, 0);
 		if (written < 0) {
 			perror("send");
-			exit(written);
+			exit(2);
 		}
 		to_write -= written;
 	}
+	lastSentMs = nowMs();
+	for(int pos = 0, flen; pos < len; pos += flen){	// one record per frame, text commands are not recorded
+		proto_frame_t f;
+		if((flen = proto_decode((const uint8_t *)buf + pos, len - pos, &f)) <= 0)
+			break;
+		sessionRecord(SESSION_SENT, (const uint8_t *)buf + pos, flen);
+	}
 #ifdef VERBOSE
-	printf("\nsent %s in %d bytes\n", buf, len);
+	printf("\nsent %d bytes\n", len);
 #endif
 #endif
-}
\ No newline at end of file
+}
+
+// appends a frame sent or received to the session being recorded, if there is one
+void sessionRecord(int dir, const uint8_t *frame, int len){
+	uint8_t rec[5 + PROTO_MAX_FRAME];
+	if(sessionFile == NULL || len > PROTO_MAX_FRAME)
+		return;
+	long long now = nowUs();
+	long long delta = now - sessionUs;
+	rec[0] = dir;
+	proto_put32(rec + 1, delta > UINT32_MAX ? UINT32_MAX : delta);
+	memcpy(rec + 5, frame, len);
+	fwrite(rec, 1, 5 + len, sessionFile);	// in one write, the file is unbuffered
+	sessionUs = now;
+}
@@ -0,0 +1,125 @@
+/*
+** curve_bench.c
+** Times the speed curve lookup against the duty cycle it replaced
+**
+** write_duty() used to set the PWM straight from the percentage asked for,
+** 255 * duty / 100 on an 8 bit timer. It now looks the duty up in the train's
+** speed curve, interpolates between the two entries either side of it and
+** scales the power to the bits of the train's timer. This times both, per
+** write, for every curve, over every duty the fade engine can produce, so a
+** change to the tables or to curve_power() can be checked against the budget
+** of a 10 ms fade tick.
+**
+** First it checks the tables: every curve must rise with speed and reach full
+** power, a train's calibrated table built at run time from the points built in
+** must match the one the compiler built from them, and a calibration that
+** falls must be refused. It exits with 1 if any check fails.
+**
+** server.c is built in, its main renamed, so the code timed is the server's:
+**
+**		gcc -O2 -DHOST_BUILD -o curve_bench curve_bench.c -lpthread
+**		./curve_bench [rounds]
+*/
+
+#define main server_main
+#include "server.c"
+#undef main
+
+#define BENCH_ROUNDS	200		// passes over every duty, by default
+
+static volatile uint32_t sink;	// keeps the compiler from dropping the work timed
+
+static long long benchNowNs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the old path: a whole percentage to an 8 bit duty
+static long long benchPercent(const uint32_t *duties, int n, int rounds){
+	uint32_t sum = 0;
+	long long start = benchNowNs();
+	for(int r = 0; r < rounds; r++)
+		for(int i = 0; i < n; i++)
+			sum += 255 * (duties[i] / DUTY_SCALE) / 100;
+	long long ns = benchNowNs() - start;
+	sink = sum;
+	return ns;
+}
+
+// the new path, as write_duty() takes it: through 'curve' to a level of a 'bits' timer with the fraction to dither
+static long long benchCurve(const uint32_t *duties, int n, int rounds, int curve, int bits){
+	uint32_t sum = 0;
+	long long start = benchNowNs();
+	for(int r = 0; r < rounds; r++)
+		for(int i = 0; i < n; i++){
+			uint32_t power = curve_power(speed_curves[curve], duties[i]);
+			sum += ((uint64_t)power * ((1u << bits) - 1)) / CURVE_FULL;
+		}
+	long long ns = benchNowNs() - start;
+	sink = sum;
+	return ns;
+}
+
+// returns non-zero when 'table' rises with speed and reaches full power
+static int benchSound(const uint16_t *table){
+	for(int i = 1; i < CURVE_LEN; i++)
+		if(table[i] < table[i - 1])
+			return 0;
+	return table[CURVE_LEN - 1] == CURVE_FULL;
+}
+
+// checks what the compiler and curve_calibrate() build, printing what is wrong
+// returns the number of checks failed
+static int benchCheck(const char *const *names){
+	static const uint16_t points[CURVE_CAL_POINTS] = CURVE_CAL_DEFAULT;
+	static const uint16_t falling[CURVE_CAL_POINTS] = { 0, 200, 150, 300, 400, 500, 600, 700, 800, 900, 1000 };
+	uint16_t table[CURVE_LEN];
+	int failed = 0;
+	for(int c = 0; c < CURVE_COUNT; c++){
+		if(!benchSound(speed_curves[c])){
+			printf("%s does not rise to full power\n", names[c]);
+			failed++;
+		}
+	}
+	curve_calibrate(table, points);
+	if(memcmp(table, speed_curves[CURVE_CALIBRATED], sizeof(table)) != 0 || !curve_cal_sound(points)){
+		printf("calibrating to the points built in does not give the table built in\n");
+		failed++;
+	}
+	if(curve_cal_sound(falling)){
+		printf("a calibration that falls is accepted\n");
+		failed++;
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[]){
+	static const char *names[CURVE_COUNT] = { "linear", "exponential", "s-curve", "calibrated" };
+	int rounds = argc > 1 ? atoi(argv[1]) : BENCH_ROUNDS;
+	int n = 100 * DUTY_SCALE + 1;
+	uint32_t *duties = malloc(n * sizeof(*duties));
+	if(duties == NULL || rounds <= 0){
+		fprintf(stderr, "usage: curve_bench [rounds]\n");
+		return 2;
+	}
+	// shuffled, so the table is read the way trains at different speeds read it rather than in order
+	for(int i = 0; i < n; i++)
+		duties[i] = i;
+	srand(1);
+	for(int i = n - 1; i > 0; i--){
+		int j = rand() % (i + 1);
+		uint32_t d = duties[i];
+		duties[i] = duties[j];
+		duties[j] = d;
+	}
+	if(benchCheck(names) != 0)
+		return 1;
+	int bits = pwm_bits(PWM_FREQ_STANDARD);	// what my_ledc_init() gives the standard profile
+	double writes = (double)n * rounds;
+	printf("%-12s %8.2f ns per write\n", "255*duty/100", benchPercent(duties, n, rounds) / writes);
+	for(int c = 0; c < CURVE_COUNT; c++)
+		printf("%-12s %8.2f ns per write at %d bits\n", names[c], benchCurve(duties, n, rounds, c, bits) / writes, bits);
+	free(duties);
+	return 0;
+}
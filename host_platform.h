@@ -0,0 +1,979 @@
+/*
+** host_platform.h
+** Stand-ins for the ESP-IDF, FreeRTOS, Wi-Fi and LEDC calls used by server.c
+** so the same server can be built and run on Linux:
+**
+**		gcc -DHOST_BUILD -o server_host server.c -lpthread
+**
+** LEDC channels are plain variables. Every duty update is logged with a
+** microsecond timestamp so the time from a received command to the change
+** in output can be read straight off the log. Two environment variables
+** turn the server into a simulator:
+**
+**		HOST_PWM_TRACE=file		records every duty change and reroute of a
+**								channel as CSV: time_us,channel,duty,gpio,
+**								bits,freq_hz, the last two of its timer
+**		HOST_MOTOR_TRACE=file	puts a model loco on each bridge and records
+**								its speed as CSV: time_us,train,state,speed,
+**								state being coast, brake or drive
+**		HOST_CLOCK_SCALE=n		runs the clock n times faster than real time,
+**								so a 10 s fade takes 10 ms at n = 1000
+**
+** Sockets are the host's own. Wi-Fi connects as soon as it is started and
+** reports 127.0.0.1, unless HOST_WIFI_SCAN_MS, HOST_WIFI_DHCP_MS,
+** HOST_WIFI_DROP_MS or HOST_WIFI_FAIL slow it down or make it drop out,
+** see host_wifi_thread().
+*/
+#ifndef HOST_PLATFORM_H
+#define HOST_PLATFORM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+/* esp_err.h */
+typedef int esp_err_t;
+#define ESP_OK					0
+#define ESP_FAIL				-1
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_ARG		0x102
+#define ESP_ERR_INVALID_STATE	0x103
+#define ESP_ERR_INVALID_SIZE	0x104
+#define ESP_ERR_NOT_FOUND		0x105
+#define ESP_ERR_TIMEOUT			0x107
+#define ESP_ERROR_CHECK(x) do {											\
+		esp_err_t err_rc_ = (x);										\
+		if (err_rc_ != ESP_OK) {										\
+			fprintf(stderr, "ESP_ERROR_CHECK failed: %d at %s:%d\n",	\
+					err_rc_, __FILE__, __LINE__);						\
+			abort();													\
+		}																\
+	} while(0)
+#define BIT0	(1 << 0)
+#define BIT1	(1 << 1)
+
+/* simulated clock */
+static int host_clock_scale = 1;	// simulated microseconds per real one, from HOST_CLOCK_SCALE
+static int64_t host_epoch_us;		// real time the server started
+
+static inline int64_t host_real_us(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* simulated heap */
+// only what the stand-ins allocate for the server is counted, task stacks and timers, out of the RAM of
+// an ESP32-S2; the host's own allocations, its thread stacks and sockets, are not the server's to budget
+#define HOST_HEAP_SIZE	(320 * 1024)
+static size_t host_heap_used, host_heap_peak;
+static pthread_mutex_t host_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void host_heap_take(size_t len){
+	pthread_mutex_lock(&host_heap_lock);
+	host_heap_used += len;
+	if(host_heap_used > host_heap_peak)
+		host_heap_peak = host_heap_used;
+	pthread_mutex_unlock(&host_heap_lock);
+}
+
+/* esp_timer.h */
+static inline int64_t esp_timer_get_time(void){
+	return (host_real_us() - host_epoch_us) * host_clock_scale;
+}
+
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef struct {
+	esp_timer_cb_t callback;
+	void *arg;
+	const char *name;
+} esp_timer_create_args_t;
+typedef struct esp_timer {
+	esp_timer_create_args_t args;
+	uint64_t period_us;
+	pthread_t thread;
+	pthread_mutex_t lock;	// guards the one-shot state below
+	pthread_cond_t cond;
+	int armed;				// a one-shot is pending
+	int64_t due_us;			// real time the one-shot fires
+} *esp_timer_handle_t;
+
+static inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out){
+	esp_timer_handle_t t = calloc(1, sizeof(*t));
+	host_heap_take(sizeof(*t));
+	if(t == NULL)
+		return ESP_ERR_NO_MEM;
+	t->args = *args;
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	*out = t;
+	return ESP_OK;
+}
+
+static void *host_timer_thread(void *arg){
+	esp_timer_handle_t t = arg;
+	struct timespec next;
+	uint64_t period_ns = t->period_us * 1000 / host_clock_scale;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(1){
+		next.tv_nsec += (long)(period_ns % 1000000000);
+		next.tv_sec += period_ns / 1000000000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		t->args.callback(t->args.arg);
+	}
+	return NULL;
+}
+
+static inline esp_err_t esp_timer_start_periodic(esp_timer_handle_t t, uint64_t period_us){
+	t->period_us = period_us;
+	if(pthread_create(&t->thread, NULL, host_timer_thread, t) != 0)
+		return ESP_FAIL;
+	pthread_detach(t->thread);
+	return ESP_OK;
+}
+
+// runs a timer's one-shots, waiting for it to be armed and then for it to come due
+static void *host_once_thread(void *arg){
+	esp_timer_handle_t t = arg;
+	pthread_mutex_lock(&t->lock);
+	while(1){
+		if(!t->armed){
+			pthread_cond_wait(&t->cond, &t->lock);
+			continue;
+		}
+		int64_t now_us = host_real_us();
+		if(now_us < t->due_us){
+			struct timespec due = { .tv_sec = t->due_us / 1000000, .tv_nsec = (t->due_us % 1000000) * 1000 };
+			pthread_cond_timedwait(&t->cond, &t->lock, &due);
+			continue;
+		}
+		t->armed = 0;
+		pthread_mutex_unlock(&t->lock);
+		t->args.callback(t->args.arg);
+		pthread_mutex_lock(&t->lock);
+	}
+	return NULL;
+}
+
+static inline esp_err_t esp_timer_start_once(esp_timer_handle_t t, uint64_t timeout_us){
+	pthread_mutex_lock(&t->lock);
+	if(t->armed){
+		pthread_mutex_unlock(&t->lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+	if(t->thread == 0){
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);	// so timedwait runs on host_real_us()'s clock
+		pthread_cond_destroy(&t->cond);
+		pthread_cond_init(&t->cond, &attr);
+		if(pthread_create(&t->thread, NULL, host_once_thread, t) != 0){
+			pthread_mutex_unlock(&t->lock);
+			return ESP_FAIL;
+		}
+		pthread_detach(t->thread);
+	}
+	t->due_us = host_real_us() + (timeout_us + host_clock_scale - 1) / host_clock_scale;	// never early
+	t->armed = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_timer_stop(esp_timer_handle_t t){
+	pthread_mutex_lock(&t->lock);
+	int armed = t->armed;
+	t->armed = 0;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	return armed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+/* esp_log.h */
+static inline void host_log(char level, const char *tag, const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "%c (%lld) %s: ", level, (long long)(esp_timer_get_time() / 1000), tag);
+	vfprintf(stderr, fmt, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+}
+#define ESP_LOGE(tag, fmt, ...) host_log('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log('D', tag, fmt, ##__VA_ARGS__)
+
+/* FreeRTOS */
+typedef void (*TaskFunction_t)(void *);
+typedef void *TaskHandle_t;
+typedef uint32_t TickType_t;
+typedef unsigned int UBaseType_t;
+#define pdPASS					1
+#define pdTRUE					1
+#define pdFALSE					0
+#define portMAX_DELAY			UINT32_MAX
+#define portTICK_PERIOD_MS		1
+#define pdMS_TO_TICKS(ms)		((TickType_t)(ms))
+
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED	PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux)			pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux)			pthread_mutex_unlock(mux)
+
+typedef struct {
+	TaskFunction_t fn;
+	void *arg;
+	pthread_mutex_t lock;		// guards notify
+	pthread_cond_t cond;
+	uint32_t notify;			// task notification value
+	uint32_t stack_depth;		// bytes asked for, as the IDF counts them
+} host_task_t;
+
+static __thread host_task_t *host_current_task;
+
+static void *host_task_entry(void *arg){
+	host_current_task = arg;
+	host_current_task->fn(host_current_task->arg);
+	return NULL;
+}
+
+// the handle is the host_task_t, which lives as long as the program
+static inline int xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth,
+		void *arg, int priority, TaskHandle_t *handle){
+	pthread_t thread;
+	host_task_t *task = calloc(1, sizeof(*task));
+	if(task == NULL)
+		return 0;
+	task->fn = fn;
+	task->arg = arg;
+	task->stack_depth = stack_depth;
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->cond, NULL);
+	if(pthread_create(&thread, NULL, host_task_entry, task) != 0){
+		free(task);
+		return 0;
+	}
+	pthread_detach(thread);
+	host_heap_take(sizeof(*task) + stack_depth);
+	if(handle != NULL)
+		*handle = task;
+	return pdPASS;
+}
+
+static inline void vTaskDelete(TaskHandle_t task){
+	if(task == NULL)
+		pthread_exit(NULL);
+}
+
+static inline void xTaskNotifyGive(TaskHandle_t handle){
+	host_task_t *task = handle;
+	pthread_mutex_lock(&task->lock);
+	task->notify++;
+	pthread_cond_signal(&task->cond);
+	pthread_mutex_unlock(&task->lock);
+}
+
+// only waits forever, which is all the server asks of it
+static inline uint32_t ulTaskNotifyTake(int clear, TickType_t ticks){
+	host_task_t *task = host_current_task;
+	pthread_mutex_lock(&task->lock);
+	while(task->notify == 0)
+		pthread_cond_wait(&task->cond, &task->lock);
+	uint32_t value = task->notify;
+	task->notify = clear ? 0 : value - 1;
+	pthread_mutex_unlock(&task->lock);
+	return value;
+}
+
+// tasks run on the host's own thread stacks, which are far larger, so the stack a task asked for
+// is never touched and is all reported free
+static inline UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle){
+	host_task_t *task = handle != NULL ? handle : host_current_task;
+	return task != NULL ? task->stack_depth : 0;
+}
+
+static inline void vTaskDelay(TickType_t ticks){
+	usleep((useconds_t)((uint64_t)ticks * 1000 / host_clock_scale));
+}
+
+/* freertos/event_groups.h */
+typedef uint32_t EventBits_t;
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	EventBits_t bits;
+} *EventGroupHandle_t;
+
+static inline EventGroupHandle_t xEventGroupCreate(void){
+	EventGroupHandle_t group = calloc(1, sizeof(*group));
+	if(group == NULL)
+		return NULL;
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	return group;
+}
+
+static inline void vEventGroupDelete(EventGroupHandle_t group){
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->cond);
+	free(group);
+}
+
+static inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits){
+	pthread_mutex_lock(&group->lock);
+	group->bits |= bits;
+	EventBits_t now = group->bits;
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->lock);
+	return now;
+}
+
+static inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits){
+	pthread_mutex_lock(&group->lock);
+	EventBits_t was = group->bits;
+	group->bits &= ~bits;
+	pthread_mutex_unlock(&group->lock);
+	return was;
+}
+
+// only waits forever, which is all the server asks of it
+static inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, int clear,
+		int all, TickType_t ticks){
+	pthread_mutex_lock(&group->lock);
+	while(all ? (group->bits & bits) != bits : (group->bits & bits) == 0)
+		pthread_cond_wait(&group->cond, &group->lock);
+	EventBits_t was = group->bits;
+	if(clear)
+		group->bits &= ~bits;
+	pthread_mutex_unlock(&group->lock);
+	return was;
+}
+
+/* esp_system.h */
+static inline uint32_t esp_random(void){
+	return ((uint32_t)random() << 16) ^ (uint32_t)random();
+}
+
+static inline uint32_t esp_get_free_heap_size(void){
+	pthread_mutex_lock(&host_heap_lock);
+	uint32_t free_bytes = HOST_HEAP_SIZE - host_heap_used;
+	pthread_mutex_unlock(&host_heap_lock);
+	return free_bytes;
+}
+
+static inline uint32_t esp_get_minimum_free_heap_size(void){
+	pthread_mutex_lock(&host_heap_lock);
+	uint32_t free_bytes = HOST_HEAP_SIZE - host_heap_peak;
+	pthread_mutex_unlock(&host_heap_lock);
+	return free_bytes;
+}
+
+/* nvs_flash.h, nvs.h */
+// blobs are kept in memory, so settings last until the server exits
+#define ESP_ERR_NVS_NOT_FOUND	0x1102
+#define HOST_NVS_ENTRIES		32
+#define HOST_NVS_BLOB_LEN		128
+typedef const char *nvs_handle_t;	// the namespace
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode_t;
+
+static struct {
+	char key[32];			// namespace/key
+	uint8_t blob[HOST_NVS_BLOB_LEN];
+	size_t len;
+} host_nvs[HOST_NVS_ENTRIES];
+static pthread_mutex_t host_nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline esp_err_t nvs_flash_init(void){
+	return ESP_OK;
+}
+
+static inline esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle){
+	*handle = name;
+	return ESP_OK;
+}
+
+static inline void nvs_close(nvs_handle_t handle){
+}
+
+static inline esp_err_t nvs_commit(nvs_handle_t handle){
+	return ESP_OK;
+}
+
+static inline esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out, size_t *len){
+	char full[32];
+	esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+	snprintf(full, sizeof(full), "%s/%s", handle, key);
+	pthread_mutex_lock(&host_nvs_lock);
+	for(int i = 0; i < HOST_NVS_ENTRIES; i++){
+		if(strcmp(host_nvs[i].key, full) == 0){
+			if(*len < host_nvs[i].len){
+				err = ESP_ERR_INVALID_SIZE;
+			} else {
+				memcpy(out, host_nvs[i].blob, host_nvs[i].len);
+				*len = host_nvs[i].len;
+				err = ESP_OK;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&host_nvs_lock);
+	return err;
+}
+
+static inline esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len){
+	char full[32];
+	esp_err_t err = ESP_ERR_NO_MEM;
+	if(len > HOST_NVS_BLOB_LEN)
+		return ESP_ERR_INVALID_SIZE;
+	snprintf(full, sizeof(full), "%s/%s", handle, key);
+	pthread_mutex_lock(&host_nvs_lock);
+	for(int i = 0; i < HOST_NVS_ENTRIES; i++){
+		if(strcmp(host_nvs[i].key, full) == 0 || host_nvs[i].key[0] == '\0'){
+			strcpy(host_nvs[i].key, full);
+			memcpy(host_nvs[i].blob, value, len);
+			host_nvs[i].len = len;
+			err = ESP_OK;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&host_nvs_lock);
+	return err;
+}
+
+/* lwip/sockets.h */
+#define inet_ntoa_r(addr, buf, len)	inet_ntop(AF_INET, &(addr), (buf), (len))
+
+// select() timeouts are simulated time
+static inline int host_select(int n, fd_set *r, fd_set *w, fd_set *e, struct timeval *timeout){
+	if(timeout == NULL || host_clock_scale == 1)
+		return select(n, r, w, e, timeout);
+	int64_t us = ((int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec) / host_clock_scale;
+	struct timeval real = { .tv_sec = us / 1000000, .tv_usec = us % 1000000 };
+	return select(n, r, w, e, &real);
+}
+#define select host_select
+
+/* esp_event.h */
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)(void *arg, esp_event_base_t base, int32_t id, void *data);
+typedef int esp_event_handler_instance_t;
+#define ESP_EVENT_ANY_ID		-1
+#define HOST_EVENT_HANDLERS		8
+static const char WIFI_EVENT[] = "WIFI_EVENT";
+static const char IP_EVENT[] = "IP_EVENT";
+
+// registered handlers, a NULL base marks a free slot
+static struct {
+	esp_event_base_t base;
+	int32_t id;
+	esp_event_handler_t handler;
+	void *arg;
+} host_event_handlers[HOST_EVENT_HANDLERS];
+
+static inline esp_err_t esp_event_loop_create_default(void){
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_event_handler_instance_register(esp_event_base_t base, int32_t id,
+		esp_event_handler_t handler, void *arg, esp_event_handler_instance_t *instance){
+	for(int i = 0; i < HOST_EVENT_HANDLERS; i++){
+		if(host_event_handlers[i].base == NULL){
+			host_event_handlers[i].base = base;
+			host_event_handlers[i].id = id;
+			host_event_handlers[i].handler = handler;
+			host_event_handlers[i].arg = arg;
+			*instance = i;
+			return ESP_OK;
+		}
+	}
+	return ESP_ERR_NO_MEM;
+}
+
+static inline esp_err_t esp_event_handler_instance_unregister(esp_event_base_t base, int32_t id,
+		esp_event_handler_instance_t instance){
+	if(instance < 0 || instance >= HOST_EVENT_HANDLERS)
+		return ESP_ERR_INVALID_ARG;
+	host_event_handlers[instance].base = NULL;
+	return ESP_OK;
+}
+
+// calls the handlers for an event straight away, on the caller's thread
+static inline void host_event_post(esp_event_base_t base, int32_t id, void *data){
+	for(int i = 0; i < HOST_EVENT_HANDLERS; i++)
+		if(host_event_handlers[i].base == base &&
+				(host_event_handlers[i].id == ESP_EVENT_ANY_ID || host_event_handlers[i].id == id))
+			host_event_handlers[i].handler(host_event_handlers[i].arg, base, id, data);
+}
+
+/* esp_netif.h */
+typedef struct { uint32_t addr; } esp_ip4_addr_t;
+typedef struct { esp_ip4_addr_t ip, netmask, gw; } esp_netif_ip_info_t;
+typedef struct { esp_netif_ip_info_t ip_info; } ip_event_got_ip_t;
+typedef struct { int unused; } esp_netif_t;
+enum { IP_EVENT_STA_GOT_IP };
+#define IPSTR			"%d.%d.%d.%d"
+#define IP2STR(ipaddr)	((ipaddr)->addr & 0xFF), (((ipaddr)->addr >> 8) & 0xFF), \
+						(((ipaddr)->addr >> 16) & 0xFF), (((ipaddr)->addr >> 24) & 0xFF)
+
+/* esp_wifi.h */
+enum { WIFI_EVENT_STA_START, WIFI_EVENT_STA_CONNECTED, WIFI_EVENT_STA_DISCONNECTED };
+enum { WIFI_REASON_BEACON_TIMEOUT = 200, WIFI_REASON_NO_AP_FOUND = 201 };
+typedef enum { WIFI_MODE_NULL, WIFI_MODE_STA } wifi_mode_t;
+typedef enum { WIFI_IF_STA } wifi_interface_t;
+typedef enum { WIFI_AUTH_OPEN, WIFI_AUTH_WPA2_PSK } wifi_auth_mode_t;
+typedef struct { int unused; } wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT()	{ 0 }
+typedef struct {
+	struct {
+		uint8_t ssid[32];
+		uint8_t password[64];
+		bool bssid_set;
+		uint8_t bssid[6];
+		uint8_t channel;
+		struct { wifi_auth_mode_t authmode; } threshold;
+		struct { bool capable; bool required; } pmf_cfg;
+	} sta;
+} wifi_config_t;
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t primary;
+} wifi_ap_record_t;
+typedef struct {
+	uint8_t reason;
+} wifi_event_sta_disconnected_t;
+
+// mocked access point, a thread that answers esp_wifi_connect() with the events the IDF would post
+// its timings come from the environment, all simulated milliseconds and 0 by default:
+//		HOST_WIFI_SCAN_MS	time to find the AP when not given its bssid and channel
+//		HOST_WIFI_DHCP_MS	time for dhcp to give an address, skipped with a static address
+//		HOST_WIFI_DROP_MS	the AP drops the connection this long after each address is given
+//		HOST_WIFI_FAIL		number of attempts that find no AP before one succeeds
+static struct {
+	pthread_mutex_t lock;		// guards everything below
+	pthread_cond_t cond;
+	pthread_t thread;
+	int connect;				// an attempt has been asked for
+	wifi_config_t cfg;
+	int dhcp;					// dhcp client running, otherwise static_ip is used
+	esp_netif_ip_info_t static_ip;
+	int scan_ms, dhcp_ms, drop_ms, fails;
+} host_wifi = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .dhcp = 1 };
+static esp_netif_t host_sta_netif;
+
+static inline esp_err_t esp_netif_init(void){
+	return ESP_OK;
+}
+
+static inline esp_netif_t *esp_netif_create_default_wifi_sta(void){
+	return &host_sta_netif;
+}
+
+static inline esp_err_t esp_netif_dhcpc_start(esp_netif_t *netif){
+	pthread_mutex_lock(&host_wifi.lock);
+	host_wifi.dhcp = 1;
+	pthread_mutex_unlock(&host_wifi.lock);
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_netif_dhcpc_stop(esp_netif_t *netif){
+	pthread_mutex_lock(&host_wifi.lock);
+	host_wifi.dhcp = 0;
+	pthread_mutex_unlock(&host_wifi.lock);
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_netif_set_ip_info(esp_netif_t *netif, const esp_netif_ip_info_t *info){
+	pthread_mutex_lock(&host_wifi.lock);
+	esp_err_t err = host_wifi.dhcp ? ESP_ERR_INVALID_STATE : ESP_OK;
+	if(err == ESP_OK)
+		host_wifi.static_ip = *info;
+	pthread_mutex_unlock(&host_wifi.lock);
+	return err;
+}
+
+static inline esp_err_t esp_wifi_init(const wifi_init_config_t *cfg){
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_set_mode(wifi_mode_t mode){
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_set_config(wifi_interface_t iface, wifi_config_t *cfg){
+	pthread_mutex_lock(&host_wifi.lock);
+	host_wifi.cfg = *cfg;
+	pthread_mutex_unlock(&host_wifi.lock);
+	return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap){
+	*ap = (wifi_ap_record_t){ .bssid = { 0x02, 0, 0, 0, 0, 0x01 }, .primary = 6 };
+	return ESP_OK;
+}
+
+static inline int host_env_ms(const char *name){
+	const char *value = getenv(name);
+	return value != NULL && atoi(value) > 0 ? atoi(value) : 0;
+}
+
+// plays the AP: each attempt finds it, or not, joins it, gets an address on the loopback
+// and, with HOST_WIFI_DROP_MS, loses it again
+static void *host_wifi_thread(void *arg){
+	pthread_mutex_lock(&host_wifi.lock);
+	while(1){
+		if(!host_wifi.connect){
+			pthread_cond_wait(&host_wifi.cond, &host_wifi.lock);
+			continue;
+		}
+		host_wifi.connect = 0;
+		int scan = !host_wifi.cfg.sta.bssid_set || host_wifi.cfg.sta.channel == 0;
+		int fail = host_wifi.fails > 0;
+		host_wifi.fails -= fail;
+		int dhcp = host_wifi.dhcp;
+		ip_event_got_ip_t got_ip = { .ip_info = host_wifi.static_ip };
+		if(dhcp)
+			got_ip.ip_info = (esp_netif_ip_info_t){ .ip.addr = htonl(INADDR_LOOPBACK), .netmask.addr = htonl(0xFF000000) };
+		pthread_mutex_unlock(&host_wifi.lock);
+
+		if(scan)
+			vTaskDelay(host_wifi.scan_ms);
+		if(fail){
+			wifi_event_sta_disconnected_t event = { .reason = WIFI_REASON_NO_AP_FOUND };
+			host_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event);
+		} else {
+			host_event_post(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, NULL);
+			if(dhcp)
+				vTaskDelay(host_wifi.dhcp_ms);
+			host_event_post(IP_EVENT, IP_EVENT_STA_GOT_IP, &got_ip);
+			if(host_wifi.drop_ms != 0){
+				wifi_event_sta_disconnected_t event = { .reason = WIFI_REASON_BEACON_TIMEOUT };
+				vTaskDelay(host_wifi.drop_ms);
+				host_event_post(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &event);
+			}
+		}
+		pthread_mutex_lock(&host_wifi.lock);
+	}
+	return NULL;
+}
+
+static inline esp_err_t esp_wifi_start(void){
+	host_wifi.scan_ms = host_env_ms("HOST_WIFI_SCAN_MS");
+	host_wifi.dhcp_ms = host_env_ms("HOST_WIFI_DHCP_MS");
+	host_wifi.drop_ms = host_env_ms("HOST_WIFI_DROP_MS");
+	host_wifi.fails = host_env_ms("HOST_WIFI_FAIL");
+	if(pthread_create(&host_wifi.thread, NULL, host_wifi_thread, NULL) != 0)
+		return ESP_FAIL;
+	pthread_detach(host_wifi.thread);
+	host_event_post(WIFI_EVENT, WIFI_EVENT_STA_START, NULL);
+	return ESP_OK;
+}
+
+// starts an attempt, answered by host_wifi_thread
+static inline esp_err_t esp_wifi_connect(void){
+	pthread_mutex_lock(&host_wifi.lock);
+	host_wifi.connect = 1;
+	pthread_cond_signal(&host_wifi.cond);
+	pthread_mutex_unlock(&host_wifi.lock);
+	return ESP_OK;
+}
+
+/* driver/gpio.h, esp_rom_gpio.h */
+#define HOST_GPIO_COUNT		48
+#define SIG_GPIO_OUT_IDX	256
+typedef enum { GPIO_MODE_DISABLE, GPIO_MODE_INPUT, GPIO_MODE_OUTPUT } gpio_mode_t;
+typedef struct {
+	uint64_t pin_bit_mask;
+	gpio_mode_t mode;
+} gpio_config_t;
+
+// virtual GPIO matrix: the ledc channel each pin is routed to (-1 for a plain output) and its level
+static int host_gpio_signal[HOST_GPIO_COUNT];
+static int host_gpio_level[HOST_GPIO_COUNT];
+
+static void host_motor_update(void);
+
+static inline void esp_rom_gpio_connect_out_signal(uint32_t gpio, uint32_t signal, bool out_inv, bool oen_inv){
+	if(gpio < HOST_GPIO_COUNT)
+		host_gpio_signal[gpio] = signal == SIG_GPIO_OUT_IDX ? -1 : (int)signal;
+	host_motor_update();
+}
+
+static inline esp_err_t gpio_config(const gpio_config_t *cfg){
+	for(int i = 0; i < HOST_GPIO_COUNT; i++)
+		if(cfg->pin_bit_mask & (1ULL << i))
+			host_gpio_signal[i] = -1;
+	return ESP_OK;
+}
+
+static inline esp_err_t gpio_set_level(int gpio, uint32_t level){
+	if(gpio < 0 || gpio >= HOST_GPIO_COUNT)
+		return ESP_ERR_INVALID_ARG;
+	host_gpio_level[gpio] = level;
+	host_motor_update();
+	return ESP_OK;
+}
+
+/* driver/ledc.h */
+typedef enum { LEDC_LOW_SPEED_MODE, LEDC_SPEED_MODE_MAX } ledc_mode_t;
+typedef enum { LEDC_TIMER_0, LEDC_TIMER_1, LEDC_TIMER_2, LEDC_TIMER_3, LEDC_TIMER_MAX } ledc_timer_t;
+typedef enum {
+	LEDC_CHANNEL_0, LEDC_CHANNEL_1, LEDC_CHANNEL_2, LEDC_CHANNEL_3,
+	LEDC_CHANNEL_4, LEDC_CHANNEL_5, LEDC_CHANNEL_6, LEDC_CHANNEL_7,
+	LEDC_CHANNEL_MAX
+} ledc_channel_t;
+typedef enum {
+	LEDC_TIMER_1_BIT = 1, LEDC_TIMER_2_BIT, LEDC_TIMER_3_BIT, LEDC_TIMER_4_BIT,
+	LEDC_TIMER_5_BIT, LEDC_TIMER_6_BIT, LEDC_TIMER_7_BIT, LEDC_TIMER_8_BIT,
+	LEDC_TIMER_9_BIT, LEDC_TIMER_10_BIT, LEDC_TIMER_11_BIT, LEDC_TIMER_12_BIT,
+	LEDC_TIMER_13_BIT, LEDC_TIMER_14_BIT, LEDC_TIMER_BIT_MAX
+} ledc_timer_bit_t;
+typedef enum { LEDC_AUTO_CLK } ledc_clk_cfg_t;
+
+typedef struct {
+	ledc_mode_t speed_mode;
+	ledc_timer_bit_t duty_resolution;
+	ledc_timer_t timer_num;
+	uint32_t freq_hz;
+	ledc_clk_cfg_t clk_cfg;
+} ledc_timer_config_t;
+
+typedef struct {
+	int gpio_num;
+	ledc_mode_t speed_mode;
+	ledc_channel_t channel;
+	ledc_timer_t timer_sel;
+	uint32_t duty;
+	int hpoint;
+} ledc_channel_config_t;
+
+// virtual LEDC: the duty each channel has been set to, the duty it is outputting and its timer,
+// and the resolution and frequency of each timer
+static uint32_t host_ledc_duty[LEDC_CHANNEL_MAX];
+static uint32_t host_ledc_out[LEDC_CHANNEL_MAX];
+static ledc_timer_t host_ledc_timer[LEDC_CHANNEL_MAX];
+static int host_timer_bits[LEDC_TIMER_MAX];
+static uint32_t host_timer_freq[LEDC_TIMER_MAX];
+static FILE *host_pwm_trace;	// every change of a channel's output, from HOST_PWM_TRACE
+
+// records the output of a channel to the pwm trace: when, its duty, the gpio it drives (-1 for none)
+// and the resolution and frequency of its timer, so the duty is a share of 2^bits - 1
+static inline void host_pwm_record(ledc_channel_t channel){
+	if(host_pwm_trace == NULL)
+		return;
+	int gpio = -1;
+	for(int i = 0; i < HOST_GPIO_COUNT; i++)
+		if(host_gpio_signal[i] == (int)channel)
+			gpio = i;
+	ledc_timer_t timer = host_ledc_timer[channel];
+	fprintf(host_pwm_trace, "%lld,%d,%u,%d,%d,%u\n", (long long)esp_timer_get_time(), channel,
+			host_ledc_out[channel], gpio, host_timer_bits[timer], host_timer_freq[timer]);
+}
+
+// refuses a resolution the timer could not count at the frequency from the 80 MHz clock, as the IDF does
+static inline esp_err_t ledc_timer_config(const ledc_timer_config_t *cfg){
+	if(cfg->timer_num >= LEDC_TIMER_MAX || cfg->duty_resolution >= LEDC_TIMER_BIT_MAX || cfg->freq_hz == 0 ||
+			80000000 / cfg->freq_hz < (1u << cfg->duty_resolution))
+		return ESP_ERR_INVALID_ARG;
+	host_timer_bits[cfg->timer_num] = cfg->duty_resolution;
+	host_timer_freq[cfg->timer_num] = cfg->freq_hz;
+	return ESP_OK;
+}
+
+static inline esp_err_t ledc_bind_channel_timer(ledc_mode_t mode, ledc_channel_t channel, ledc_timer_t timer){
+	if(channel >= LEDC_CHANNEL_MAX || timer >= LEDC_TIMER_MAX)
+		return ESP_ERR_INVALID_ARG;
+	host_ledc_timer[channel] = timer;
+	host_pwm_record(channel);
+	host_motor_update();
+	return ESP_OK;
+}
+
+static inline esp_err_t ledc_set_pin(int gpio, ledc_mode_t mode, ledc_channel_t channel){
+	if(gpio < 0 || gpio >= HOST_GPIO_COUNT || channel >= LEDC_CHANNEL_MAX)
+		return ESP_ERR_INVALID_ARG;
+	host_gpio_signal[gpio] = channel;
+	ESP_LOGD("ledc", "ch%d routed to gpio %d at %lld us", channel, gpio,
+			(long long)esp_timer_get_time());
+	host_pwm_record(channel);
+	host_motor_update();
+	return ESP_OK;
+}
+
+static inline esp_err_t ledc_channel_config(const ledc_channel_config_t *cfg){
+	if(cfg->channel >= LEDC_CHANNEL_MAX)
+		return ESP_ERR_INVALID_ARG;
+	if(cfg->gpio_num >= 0 && cfg->gpio_num < HOST_GPIO_COUNT)
+		host_gpio_signal[cfg->gpio_num] = cfg->channel;
+	host_ledc_duty[cfg->channel] = cfg->duty;
+	host_ledc_out[cfg->channel] = cfg->duty;
+	host_ledc_timer[cfg->channel] = cfg->timer_sel;
+	return ESP_OK;
+}
+
+static inline esp_err_t ledc_set_duty(ledc_mode_t mode, ledc_channel_t channel, uint32_t duty){
+	if(channel >= LEDC_CHANNEL_MAX)
+		return ESP_ERR_INVALID_ARG;
+	host_ledc_duty[channel] = duty;
+	return ESP_OK;
+}
+
+static inline esp_err_t ledc_update_duty(ledc_mode_t mode, ledc_channel_t channel){
+	if(channel >= LEDC_CHANNEL_MAX)
+		return ESP_ERR_INVALID_ARG;
+	host_ledc_out[channel] = host_ledc_duty[channel];
+	ESP_LOGD("ledc", "ch%d duty %u at %lld us", channel, host_ledc_out[channel],
+			(long long)esp_timer_get_time());
+	host_pwm_record(channel);
+	host_motor_update();
+	return ESP_OK;
+}
+
+static inline uint32_t ledc_get_duty(ledc_mode_t mode, ledc_channel_t channel){
+	return channel < LEDC_CHANNEL_MAX ? host_ledc_out[channel] : 0;
+}
+
+/* the loco on the end of each bridge */
+#define HOST_MOTORS				8
+#define HOST_MOTOR_TAU_DRIVE_US	200000	// how quickly the speed follows the bridge while it is closed
+#define HOST_MOTOR_TAU_COAST_US	3000000	// how slowly the loco runs down with the bridge open
+#define HOST_MOTOR_SAMPLE_US	1000	// how often the motor trace is checked for changes
+
+// a permanent magnet motor with its load: driven, the speed heads for the average voltage across it;
+// with both inputs high the shorted winding brakes it as quickly, and with both low it only coasts
+typedef struct {
+	int fwd, rev;		// bridge inputs, fwd == 0 && rev == 0 for a motor not attached
+	double speed;		// percent of full speed, negative when reversing
+	double f, r;		// share of the time each input is high
+	int64_t at_us;		// when 'speed' was brought up to date
+	int state;			// what was last written to the trace, -1 before the first row
+	double traced;		// and the speed it had
+} host_motor_t;
+
+static const char *host_motor_states[] = { "coast", "brake", "drive" };
+static host_motor_t host_motors[HOST_MOTORS];
+static pthread_mutex_t host_motor_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *host_motor_trace;	// the speed of each loco over time, from HOST_MOTOR_TRACE
+
+// share of the time 'gpio' is high: the duty of the channel it is routed to, or its level
+static double host_pin_level(int gpio){
+	int channel = host_gpio_signal[gpio];
+	if(channel < 0)
+		return host_gpio_level[gpio] ? 1.0 : 0.0;
+	int bits = host_timer_bits[host_ledc_timer[channel]];
+	return bits > 0 ? (double)host_ledc_out[channel] / ((1u << bits) - 1) : 0.0;
+}
+
+static int host_motor_state(const host_motor_t *m){
+	return m->f != m->r ? 2 : m->f > 0 ? 1 : 0;
+}
+
+// runs the model of every motor up to now with the inputs it had, then takes the inputs it has now
+// steps of at most a millisecond keep it accurate against time constants of hundreds
+static void host_motor_update(void){
+	int64_t now = esp_timer_get_time();
+	pthread_mutex_lock(&host_motor_lock);
+	for(int i = 0; i < HOST_MOTORS; i++){
+		host_motor_t *m = &host_motors[i];
+		if(m->fwd == 0 && m->rev == 0)
+			continue;
+		double closed = m->f > m->r ? m->f : m->r;
+		double drive = (m->f - m->r) * 100.0 / HOST_MOTOR_TAU_DRIVE_US;
+		double decay = closed / HOST_MOTOR_TAU_DRIVE_US + (1.0 - closed) / HOST_MOTOR_TAU_COAST_US;
+		for(int64_t left = now - m->at_us; left > 0; left -= 1000){
+			int64_t step = left < 1000 ? left : 1000;
+			m->speed += (drive - decay * m->speed) * step;
+		}
+		m->at_us = now;
+		m->f = host_pin_level(m->fwd);
+		m->r = host_pin_level(m->rev);
+	}
+	pthread_mutex_unlock(&host_motor_lock);
+}
+
+// puts a motor across the bridge inputs 'fwd' and 'rev' of train 'train', if anyone is watching
+static inline void host_motor_attach(int train, int fwd, int rev){
+	if(host_motor_trace == NULL || train < 0 || train >= HOST_MOTORS)
+		return;
+	pthread_mutex_lock(&host_motor_lock);
+	host_motors[train] = (host_motor_t){ .fwd = fwd, .rev = rev, .at_us = esp_timer_get_time(), .state = -1 };
+	pthread_mutex_unlock(&host_motor_lock);
+	host_motor_update();
+}
+
+// writes a row to the motor trace whenever a motor changes state or its speed by a tenth of a percent
+static void *host_motor_thread(void *arg){
+	while(1){
+		usleep(HOST_MOTOR_SAMPLE_US / host_clock_scale > 0 ? HOST_MOTOR_SAMPLE_US / host_clock_scale : 1);
+		host_motor_update();
+		pthread_mutex_lock(&host_motor_lock);
+		for(int i = 0; i < HOST_MOTORS; i++){
+			host_motor_t *m = &host_motors[i];
+			if(m->fwd == 0 && m->rev == 0)
+				continue;
+			int state = host_motor_state(m);
+			if(state == m->state && m->speed - m->traced < 0.1 && m->traced - m->speed < 0.1)
+				continue;
+			m->state = state;
+			m->traced = m->speed;
+			fprintf(host_motor_trace, "%lld,%d,%s,%.1f\n", (long long)m->at_us, i,
+					host_motor_states[state], m->speed);
+		}
+		pthread_mutex_unlock(&host_motor_lock);
+	}
+	return NULL;
+}
+
+/* entry point normally supplied by the IDF */
+void app_main(void);
+int main(void){
+	const char *scale = getenv("HOST_CLOCK_SCALE");
+	const char *trace = getenv("HOST_PWM_TRACE");
+	const char *motor_trace = getenv("HOST_MOTOR_TRACE");
+	if(scale != NULL && atoi(scale) > 0)
+		host_clock_scale = atoi(scale);
+	if(trace != NULL){
+		host_pwm_trace = fopen(trace, "w");
+		if(host_pwm_trace == NULL){
+			perror(trace);
+			return 1;
+		}
+		setvbuf(host_pwm_trace, NULL, _IOLBF, 0);
+		fprintf(host_pwm_trace, "time_us,channel,duty,gpio,bits,freq_hz\n");
+	}
+	for(int i = 0; i < HOST_GPIO_COUNT; i++)
+		host_gpio_signal[i] = -1;
+	host_epoch_us = host_real_us();
+	if(motor_trace != NULL){
+		pthread_t thread;
+		host_motor_trace = fopen(motor_trace, "w");
+		if(host_motor_trace == NULL){
+			perror(motor_trace);
+			return 1;
+		}
+		setvbuf(host_motor_trace, NULL, _IOLBF, 0);
+		fprintf(host_motor_trace, "time_us,train,state,speed\n");
+		pthread_create(&thread, NULL, host_motor_thread, NULL);
+		pthread_detach(thread);
+	}
+	srandom(time(NULL) ^ getpid());
+	app_main();
+	while(1)
+		pause();
+	return 0;
+}
+
+#endif
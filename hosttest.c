@@ -0,0 +1,456 @@
+/*
+** hosttest.c
+** Checks of the server's behaviour against a host build of it
+**
+** Each test starts its own server_host with the traces it needs, drives it
+** through the client's own code (client.c is built in, its main renamed) and
+** checks the result against the traces:
+**	heartbeat	a controller that goes quiet has its train at zero within the
+**				negotiated deadline plus the emergency stop time
+**	dither		the time-weighted average of the pwm output matches each duty
+**				asked for, the fraction of a count too fine for the timer included
+**	predict		the client's prediction of a train's duty through fades, reversals
+**				and stops stays within a tolerance of the server's telemetry
+**	latency		a stop sent in the middle of a slow fade reaches the pwm output on the
+**				next fade tick, rather than waiting behind the fade
+**	estop		an emergency stop brakes the bridge at once and keeps it braked, and
+**				a reversal rests at zero for the train's dwell before driving back
+**
+** Prints a line per test and exits with 0 when every test passed, 1 when any
+** failed, so it can gate a change:
+**
+**		gcc -DHOST_BUILD -o server_host server.c -lpthread
+**		gcc -o hosttest hosttest.c -lcurses
+**		./hosttest ./server_host [test...]
+*/
+
+#define main client_main
+#include "client.c"
+#undef main
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <math.h>
+
+#define TEST_TICK_MS		10		// the server's FADE_TICK_MS, the resolution of everything it does to a motor
+#define TEST_START_MS		2000	// longest a server is given to start listening
+#define TEST_MAX_ROWS		65536	// pwm trace rows read per channel
+
+#define HB_DEADLINE_MS		300		// heartbeat test: deadline negotiated
+#define HB_ESTOP_MS			500		// and time to stop from full speed once it passes
+
+#define DITHER_SETTLE_MS	1200	// dither test: time a duty is given to fade in, the slowest fade is 1 s
+#define DITHER_WINDOW_MS	4000	// and averaged over
+#define DITHER_TOLERANCE	0.005	// furthest the average may be from the duty, as a share of it: the linear
+									// curve's entries are whole 65535ths, 0.2% short of a 0.1% duty on their own
+
+#define PREDICT_HZ			20		// predict test: telemetry rate, the client's own TELEMETRY_HZ checks too seldom
+#define PREDICT_TOLERANCE	10		// widest the prediction may be of the telemetry, tenths of a percent
+
+#define LATENCY_SETS		20		// latency test: stops timed, each interrupting a slow fade
+#define LATENCY_FADE_MS		2000	// the fade each stop interrupts
+#define LATENCY_MAX_US		(2 * TEST_TICK_MS * 1000)	// longest a stop may take to reach the pwm output: the
+									// set is taken at once but the output only moves on the tick after
+
+#define ESTOP_SAMPLE_MS		1		// estop test: how often the model loco's bridge is sampled
+#define ESTOP_MAX_US		(2 * TEST_TICK_MS * 1000)	// longest the bridge may take to brake: the stop is
+									// applied as soon as it is taken, about a sample, but a loaded host
+									// can be slow to wake the motor task
+#define ESTOP_STOP_MS		1500	// and time a loco braked from 60% is given to stop
+#define ESTOP_REST_OVER_MS	50		// and longest a reversal may rest beyond its dwell: it waits for the tick
+									// after, and a loaded host can be slow to wake the motor task on both
+
+static pid_t serverPid = -1;
+static char pwmTrace[64];		// the running server's HOST_PWM_TRACE
+static char motorTrace[64];		// and HOST_MOTOR_TRACE
+
+// a row of the pwm trace
+typedef struct {
+	long long us;
+	unsigned duty;
+	int bits;
+} pwm_row_t;
+
+// a row of the motor trace
+typedef struct {
+	long long us;
+	char state[8];		// coast, brake or drive
+	double speed;		// percent of full speed, negative in reverse
+} motor_row_t;
+
+// starts 'server' recording its pwm outputs and model locos and connects to it, speaking frames
+// returns the socket, or -1 when the server did not come up
+static int serverStart(const char *server){
+	snprintf(pwmTrace, sizeof(pwmTrace), "/tmp/hosttest-pwm-%d.csv", (int)getpid());
+	snprintf(motorTrace, sizeof(motorTrace), "/tmp/hosttest-motor-%d.csv", (int)getpid());
+	if((serverPid = fork()) == 0){
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		setenv("HOST_PWM_TRACE", pwmTrace, 1);
+		setenv("HOST_MOTOR_TRACE", motorTrace, 1);
+		execl(server, server, (char *)NULL);
+		_exit(127);
+	}
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(atoi(PORT)) };
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for(long long start = nowMs(); nowMs() - start < TEST_START_MS; usleep(20000)){
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0){
+			int noDelay = 1;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+			rx_len = consumed = 0;	// the client's state from the test before
+			memset(trainStatus, 0, sizeof(trainStatus));
+			predictErrMax = heartbeatMs = binary = 0;
+			hello(sock);
+			if(binary)
+				return sock;
+		}
+		close(sock);
+	}
+	return -1;
+}
+
+static void serverStop(int sock){
+	if(sock >= 0)
+		close(sock);
+	if(serverPid > 0){
+		kill(serverPid, SIGTERM);
+		waitpid(serverPid, NULL, 0);
+		serverPid = -1;
+	}
+	unlink(pwmTrace);
+	unlink(motorTrace);
+}
+
+// reads the rows of the pwm trace for 'channel' into 'rows'
+// returns how many there were
+static int pwmLoad(int channel, pwm_row_t *rows, int max){
+	FILE *trace = fopen(pwmTrace, "r");
+	char line[128];
+	int n = 0;
+	if(trace == NULL)
+		return 0;
+	while(n < max && fgets(line, sizeof(line), trace) != NULL){
+		long long us;
+		unsigned duty, freq;
+		int ch, gpio, bits;
+		if(sscanf(line, "%lld,%d,%u,%d,%d,%u", &us, &ch, &duty, &gpio, &bits, &freq) == 6 && ch == channel)
+			rows[n++] = (pwm_row_t){ us, duty, bits };
+	}
+	fclose(trace);
+	return n;
+}
+
+// reads the rows of the motor trace for 'train' into 'rows'
+// returns how many there were
+static int motorLoad(int train, motor_row_t *rows, int max){
+	FILE *trace = fopen(motorTrace, "r");
+	char line[128];
+	int n = 0;
+	if(trace == NULL)
+		return 0;
+	while(n < max && fgets(line, sizeof(line), trace) != NULL){
+		motor_row_t r;
+		int t;
+		if(sscanf(line, "%lld,%d,%7[a-z],%lf", &r.us, &t, r.state, &r.speed) == 4 && t == train)
+			rows[n++] = r;
+	}
+	fclose(trace);
+	return n;
+}
+
+// the server's clock, which the traces are timed by
+static long long serverTime(int sock){
+	proto_frame_t f;
+	waitAck(sock, sendFrame(sock, MSG_TIME, 0, NULL, 0), &f);
+	return f.len >= 9 ? (long long)proto_get64(f.payload + 1) : -1;
+}
+
+// negotiates a heartbeat, runs train 0 at full speed and goes quiet: the server must leave the train
+// alone until the deadline has passed and have it at zero within the deadline plus the stop time
+static int testHeartbeat(const char *server, char *why, int whyLen){
+	static pwm_row_t rows[TEST_MAX_ROWS];
+	proto_frame_t f;
+	uint8_t payload[4];
+	int sock = serverStart(server);
+	if(sock < 0){
+		snprintf(why, whyLen, "server did not start");
+		return 0;
+	}
+	proto_put16(payload, HB_DEADLINE_MS);
+	proto_put16(payload + 2, HB_ESTOP_MS);
+	waitAck(sock, sendFrame(sock, MSG_HEARTBEAT_CFG, 0, payload, sizeof(payload)), &f);
+	setDuty(sock, 0, 100, 0);
+	// the train takes a second to get up to speed, asking after it keeps the server hearing from us
+	for(long long start = nowMs(); getDuty(sock, 0) != 100; usleep(50000)){
+		if(nowMs() - start > 5000){
+			serverStop(sock);
+			snprintf(why, whyLen, "train 0 never got to full speed");
+			return 0;
+		}
+	}
+	long long quietUs = serverTime(sock);	// the last the server hears from us
+	usleep((HB_DEADLINE_MS + HB_ESTOP_MS + 500) * 1000);
+	int n = pwmLoad(0, rows, TEST_MAX_ROWS);
+	serverStop(sock);
+
+	long long slowedUs = -1, stoppedUs = -1;
+	for(int i = 0; i < n && stoppedUs < 0; i++){
+		if(rows[i].us < quietUs)
+			continue;
+		if(slowedUs < 0 && rows[i].duty < rows[i > 0 ? i - 1 : 0].duty)
+			slowedUs = rows[i].us;
+		if(rows[i].duty == 0)
+			stoppedUs = rows[i].us;
+	}
+	long long limitUs = quietUs + (HB_DEADLINE_MS + HB_ESTOP_MS + 2 * TEST_TICK_MS) * 1000LL;
+	snprintf(why, whyLen, "slowed %lld ms and stopped %lld ms after the last frame, allowed %d to %d ms",
+			slowedUs < 0 ? -1 : (slowedUs - quietUs) / 1000, stoppedUs < 0 ? -1 : (stoppedUs - quietUs) / 1000,
+			HB_DEADLINE_MS, HB_DEADLINE_MS + HB_ESTOP_MS + 2 * TEST_TICK_MS);
+	return slowedUs >= quietUs + HB_DEADLINE_MS * 1000LL && stoppedUs >= 0 && stoppedUs <= limitUs;
+}
+
+// the time-weighted average share of full output 'rows' give between 'fromUs' and 'toUs'
+static double pwmAverage(const pwm_row_t *rows, int n, long long fromUs, long long toUs){
+	double level = 0, sum = 0;
+	long long at = fromUs;
+	for(int i = 0; i < n && rows[i].us < toUs; i++){
+		if(rows[i].us > at){
+			sum += level * (rows[i].us - at);
+			at = rows[i].us;
+		}
+		level = rows[i].duty / (double)((1u << rows[i].bits) - 1);
+	}
+	sum += level * (toUs - at);
+	return sum / (toUs - fromUs);
+}
+
+// sets train 0 to duties from a crawl, finer than a count of the timer, to full speed: once each
+// has faded in, the pwm output averaged over a window must come to the duty within the tolerance
+static int testDither(const char *server, char *why, int whyLen){
+	static const int duties[] = { 1, 10, 73, 500, 1000 };	// tenths of a percent
+	static pwm_row_t rows[TEST_MAX_ROWS];
+	long long fromUs[sizeof(duties) / sizeof(duties[0])], toUs[sizeof(duties) / sizeof(duties[0])];
+	proto_frame_t f;
+	uint8_t payload[6];
+	int sock = serverStart(server);
+	if(sock < 0){
+		snprintf(why, whyLen, "server did not start");
+		return 0;
+	}
+	for(int i = 0; i < sizeof(duties) / sizeof(duties[0]); i++){
+		proto_put16(payload, duties[i]);	// setDuty() only sends whole percents
+		proto_put32(payload + 2, 0);
+		waitAck(sock, sendFrame(sock, MSG_SET, 0, payload, sizeof(payload)), &f);
+		usleep(DITHER_SETTLE_MS * 1000);
+		fromUs[i] = serverTime(sock);
+		usleep(DITHER_WINDOW_MS * 1000);
+		toUs[i] = serverTime(sock);
+	}
+	int n = pwmLoad(0, rows, TEST_MAX_ROWS);
+	serverStop(sock);
+
+	double worst = 0;
+	int worstDuty = 0;
+	for(int i = 0; i < sizeof(duties) / sizeof(duties[0]); i++){
+		double duty = duties[i] / (100.0 * PROTO_DUTY_SCALE);
+		double err = fabs(pwmAverage(rows, n, fromUs[i], toUs[i]) - duty) / duty;
+		if(err >= worst){
+			worst = err;
+			worstDuty = duties[i];
+		}
+	}
+	snprintf(why, whyLen, "furthest average from its duty was %.3f%% off at %.1f%%, allowed %.3f%%",
+			worst * 100, worstDuty / (float)PROTO_DUTY_SCALE, DITHER_TOLERANCE * 100);
+	return n > 0 && worst <= DITHER_TOLERANCE;
+}
+
+// passes whatever the server sends in the next 'ms' to the client's handleFrame
+static void pumpFrames(int sock, int ms){
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	proto_frame_t f;
+	for(long long end = nowMs() + ms; nowMs() < end;){
+		if(!tcp_frame_buffered() && poll(&fds, 1, end - nowMs()) <= 0)
+			continue;
+		tcp_recv_frame(sock, &f);
+		handleFrame(&f);
+	}
+}
+
+// drives train 0 through fades at and above the fastest rate, reversals and stops with telemetry on:
+// the client's prediction, corrected by each telemetry frame, must be within the tolerance of it every time
+static int testPredict(const char *server, char *why, int whyLen){
+	static const struct {
+		int duty, fadeMs, holdMs;
+	} steps[] = {
+		{ 60, 1500, 2000 },		// slower than the fastest fade
+		{ 20, 0, 1000 },		// at the fastest
+		{ -40, 800, 1500 },		// through zero, resting there before reversing
+		{ 0, 300, 500 },		// stops fade, an instant one is over within a millisecond of the
+		{ 100, 0, 1500 },		// ack and so too quick for a frame caught during it to say anything
+		{ -100, 3000, 3500 },	// reversing from full speed
+		{ 0, 500, 1000 },
+		{ 50, 0, 200 },			// reversing again while still resting at zero
+	};
+	int sock = serverStart(server);
+	if(sock < 0){
+		snprintf(why, whyLen, "server did not start");
+		return 0;
+	}
+	if(!takeTrain(sock, 0)){	// as a cab does, which also learns the train's rest at zero before reversing
+		serverStop(sock);
+		snprintf(why, whyLen, "could not take train 0");
+		return 0;
+	}
+	subscribe(sock, PREDICT_HZ);
+	for(int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++){
+		setDuty(sock, 0, steps[i].duty, steps[i].fadeMs);
+		pumpFrames(sock, steps[i].holdMs);
+	}
+	serverStop(sock);
+	snprintf(why, whyLen, "widest the prediction was of the telemetry %.1f%%, allowed %.1f%%",
+			predictErrMax / (float)PROTO_DUTY_SCALE, PREDICT_TOLERANCE / (float)PROTO_DUTY_SCALE);
+	return predictErrMax <= PREDICT_TOLERANCE;
+}
+
+// sets train 0 fading slowly up to speed and stops it part way: the pwm output must be at zero by the tick
+// after the stop leaves the client, timed on the server's clock from just before it was sent, so the server
+// can only have taken it in later than that
+static int testLatency(const char *server, char *why, int whyLen){
+	static pwm_row_t rows[TEST_MAX_ROWS];
+	long long sentUs[LATENCY_SETS];
+	proto_frame_t f;
+	uint8_t payload[6];
+	int sock = serverStart(server);
+	if(sock < 0){
+		snprintf(why, whyLen, "server did not start");
+		return 0;
+	}
+	for(int i = 0; i < LATENCY_SETS; i++){
+		proto_put16(payload, 80 * PROTO_DUTY_SCALE);
+		proto_put32(payload + 2, LATENCY_FADE_MS);
+		waitAck(sock, sendFrame(sock, MSG_SET, 0, payload, sizeof(payload)), &f);
+		usleep(LATENCY_FADE_MS * 1000 / 4);		// part way up
+		proto_put16(payload, 0);
+		proto_put32(payload + 2, 0);
+		sentUs[i] = serverTime(sock);
+		waitAck(sock, sendFrame(sock, MSG_SET, 0, payload, sizeof(payload)), &f);
+		usleep(100 * 1000);
+	}
+	int n = pwmLoad(0, rows, TEST_MAX_ROWS);
+	serverStop(sock);
+
+	long long worst = -1, total = 0;
+	int missed = 0;
+	for(int i = 0; i < LATENCY_SETS; i++){
+		int j = 0;
+		while(j < n && !(rows[j].us >= sentUs[i] && rows[j].duty == 0))
+			j++;
+		if(j >= n){
+			missed++;
+			continue;
+		}
+		worst = rows[j].us - sentUs[i] > worst ? rows[j].us - sentUs[i] : worst;
+		total += rows[j].us - sentUs[i];
+	}
+	snprintf(why, whyLen, "stops reached the pwm in %lld us on average and %lld us at worst, allowed %d us%s",
+			missed < LATENCY_SETS ? total / (LATENCY_SETS - missed) : -1, worst, LATENCY_MAX_US,
+			missed > 0 ? ", some never did" : "");
+	return n > 0 && missed == 0 && worst <= LATENCY_MAX_US;
+}
+
+// runs train 0 at 60% and stops every train with MSG_ESTOP: the bridge must be braked at once after
+// the stop is sent and stay braked, driving nothing, until the loco has stopped; then runs it at 60%
+// again and reverses it, and it must rest at zero for at least its dwell, less a sample of the loco,
+// between driving one way and the other, and then carry on
+static int testEstop(const char *server, char *why, int whyLen){
+	static motor_row_t rows[TEST_MAX_ROWS];
+	proto_frame_t f;
+	int sock = serverStart(server);
+	if(sock < 0){
+		snprintf(why, whyLen, "server did not start");
+		return 0;
+	}
+	if(!takeTrain(sock, 0)){	// which also learns the train's dwell
+		serverStop(sock);
+		snprintf(why, whyLen, "could not take train 0");
+		return 0;
+	}
+	int dwellMs = trainStatus[0].dwellMs;
+	setDuty(sock, 0, 60, 0);
+	usleep(1500 * 1000);
+	long long stopUs = serverTime(sock);
+	waitAck(sock, sendFrame(sock, MSG_ESTOP, PROTO_ALL_TRAINS, NULL, 0), &f);
+	usleep(ESTOP_STOP_MS * 1000);
+	long long runUs = serverTime(sock);
+	setDuty(sock, 0, 60, 0);
+	usleep(1500 * 1000);
+	long long reverseUs = serverTime(sock);
+	setDuty(sock, 0, -60, 0);
+	usleep(1500 * 1000);
+	int n = motorLoad(0, rows, TEST_MAX_ROWS);
+	serverStop(sock);
+
+	// the stop: braked at once, never driven again before the next set, and at a standstill by then
+	long long brakedUs = -1;
+	int drove = 0;
+	double left = 100;
+	for(int i = 0; i < n && rows[i].us < runUs; i++){
+		if(rows[i].us < stopUs)
+			continue;
+		if(brakedUs < 0 && strcmp(rows[i].state, "brake") == 0)
+			brakedUs = rows[i].us;
+		drove |= brakedUs >= 0 && strcmp(rows[i].state, "brake") != 0;
+		left = fabs(rows[i].speed);
+	}
+	// the reversal: the last of driving forward, and the first of driving back after it
+	long long restUs = -1, backUs = -1;
+	for(int i = 0; i < n && backUs < 0; i++){
+		if(rows[i].us < reverseUs)
+			continue;
+		if(strcmp(rows[i].state, "drive") != 0 && restUs < 0)
+			restUs = rows[i].us;
+		else if(strcmp(rows[i].state, "drive") == 0 && restUs >= 0)
+			backUs = rows[i].us;
+	}
+	long long rested = restUs >= 0 && backUs >= 0 ? backUs - restUs : -1;
+	int restMin = dwellMs - ESTOP_SAMPLE_MS, restMax = dwellMs + ESTOP_REST_OVER_MS;
+	snprintf(why, whyLen, "braked %lld us after the stop, %.1f%% left when let go, rested %.1f ms reversing, "
+			"allowed %d us and %d to %d ms", brakedUs < 0 ? -1 : brakedUs - stopUs, left, rested / 1000.0,
+			ESTOP_MAX_US, restMin, restMax);
+	return brakedUs >= 0 && brakedUs - stopUs <= ESTOP_MAX_US && !drove && left < 1 &&
+			rested >= restMin * 1000LL && rested <= restMax * 1000LL;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(const char *server, char *why, int whyLen);
+} tests[] = {
+	{ "heartbeat", testHeartbeat },
+	{ "dither", testDither },
+	{ "predict", testPredict },
+	{ "latency", testLatency },
+	{ "estop", testEstop },
+};
+
+int main(int argc, char *argv[]){
+	int failed = 0;
+	if(argc < 2){
+		fprintf(stderr, "usage: hosttest server_host [test...]\n");
+		return 2;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	for(int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+		int chosen = argc == 2;
+		for(int j = 2; j < argc; j++)
+			chosen |= strcmp(argv[j], tests[i].name) == 0;
+		if(!chosen)
+			continue;
+		char why[160] = "";
+		int passed = tests[i].run(argv[1], why, sizeof(why));
+		printf("%s %s: %s\n", passed ? "PASS" : "FAIL", tests[i].name, why);
+		failed |= !passed;
+	}
+	return failed;
+}
@@ -0,0 +1,346 @@
+/*
+** protocol.h
+** Binary command protocol shared by server.c and client.c
+**
+** Every message is a frame:
+**
+**		magic(1) len(1) type(1) train(1) seq(2) payload(len) crc(1)
+**
+** 'len' is the payload length and multi-byte fields are little-endian.
+** 'crc' is a CRC-8 over everything from 'len' to the end of the payload.
+** Frames can be sent back to back; the receiver parses as many as it has.
+** The server answers every command with a MSG_ACK carrying the command's seq.
+** After a MSG_SUBSCRIBE the server also pushes MSG_TELEMETRY frames, with
+** their own running seq, until the period is set back to 0.
+**
+** Any number of clients can be connected. Each train has at most one
+** controller, the client allowed to drive it; everyone else can only watch.
+** Driving a train nobody controls makes you its controller, MSG_TAKE with
+** force takes a train from its controller and MSG_RELEASE gives it up.
+** When a controller disconnects its trains are stopped. MSG_ESTOP is the
+** exception: anyone can brake any train, or all of them, to a stop.
+**
+** Throttle changes can also be sent as MSG_THROTTLE datagrams to UDP_PORT.
+** They carry the token the server sent in its MSG_HELLO, only the train's
+** controller's are accepted, and only the newest counts: a datagram with a
+** seq older than one already applied is dropped. A throttle only sets the
+** speed in the direction the train was last sent over TCP, so stops and
+** changes of direction always go over TCP.
+**
+** A connection starts out speaking the original text protocol
+** ("0 [train]" and "1 duty time [train]"). The client switches it to frames
+** by sending MSG_HELLO; the server answers with its own MSG_HELLO and both
+** sides speak frames from then on. An old server answers a MSG_HELLO with a
+** text duty, which tells the client to stay with text.
+**
+** A client can ask for a heartbeat with MSG_HEARTBEAT_CFG. From then on the
+** server expects to hear from it at least every deadline; any frame counts,
+** and MSG_HEARTBEAT, which is never acked, is there for when it has nothing
+** else to say. If the deadline passes, the trains it controls are ramped
+** down to a stop over estop_ms (from full speed) and it keeps control.
+**
+** To move trains together a client can give a MSG_SET the time to carry it
+** out at, on the server's clock. MSG_TIME reads that clock; a client takes
+** the reply with the shortest round trip as read halfway through it to find
+** the offset from its own. The server holds up to SCHED_LEN commands until
+** they are due, and carries out one whose time has passed straight away.
+** Commands waiting for a train are dropped when another client takes it
+** or its controller disconnects, but not when it is released.
+**
+** Each train can also be given a program of PROG_OP_ steps, loaded with
+** MSG_PROGRAM and saved on the server, which drives it with nobody
+** connected. Running a program releases the train to it. A client that
+** takes the train pauses the program, which resumes where it left off once
+** the client releases the train or disconnects; a heartbeat e-stop only
+** affects trains a client controls. So an e-stop beats a client, and a
+** client beats a program.
+*/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#define PROTO_MAGIC			0xA5	// not printable, so never the start of a text command
+#define PROTO_VERSION		1
+#define PROTO_HDR_LEN		6
+#define PROTO_MAX_PAYLOAD	255
+#define PROTO_MAX_FRAME		(PROTO_HDR_LEN + PROTO_MAX_PAYLOAD + 1)
+#define PROTO_DUTY_SCALE	10		// duties are sent in tenths of a percent
+
+// message types
+enum {
+	MSG_HELLO = 1,	// version(1)	reply: version(1) num_trains(1) token(4)
+	MSG_ACK,		// status(1) then the reply data of the command acknowledged
+	MSG_SET,		// duty(2 signed) fade_ms(4), optionally at_us(8): server time to carry it out at
+	MSG_GET,		// reply: duty(2 signed)
+	MSG_SUBSCRIBE,	// period_ms(2), 0 to stop
+	MSG_TELEMETRY,	// pushed every period: per train train(1) duty(2 signed) target(2 signed) progress(1)
+					// remaining_ms(4) flags(1), enough for a client to carry the fade on between frames
+	MSG_TAKE,		// force(1), become the train's controller
+	MSG_RELEASE,	// stop being the train's controller
+	MSG_THROTTLE,	// udp only: token(4) throttle(2), seq counts up per train
+	MSG_UDP_STATS,	// reply: received(4) lost(4) stale(4) rejected(4) throttles for the train
+	MSG_HEARTBEAT_CFG,	// deadline_ms(2) estop_ms(2), deadline 0 to stop, empty to query
+					// reply: deadline_ms(2) estop_ms(2) late(4) missed(4)
+	MSG_HEARTBEAT,	// no payload and no ack, just proves the client is alive
+	MSG_MBOX_STATS,	// reply: posted(4) dropped(4) depth(1) depth_max(1) latency_max_us(4) latency(4)*16
+					// setpoints passed to the motor task, latency[i] counts those applied 2^i to 2^(i+1) us after posting
+	MSG_INERTIA,	// enabled(1) mass(2) accel(2) brake(2) grade(2 signed), empty to query
+					// reply: the same, the train's dynamics as saved on the server
+					// while enabled a MSG_SET duty is the speed to work up to and its fade_ms is ignored
+	MSG_CURVE,		// curve(1) [point(2)*CURVE_CAL_POINTS], empty to query
+					// reply: curve(1) num_curves(1) point(2)*CURVE_CAL_POINTS
+					// speed curve mapping the train's duty to motor power: 0 linear, 1 exponential,
+					// 2 s-curve, 3 calibrated, see speed_curve.h. The points are the train's own calibration,
+					// the power in tenths of a percent it needs at 0%, 10% .. 100% of speed; they must not fall
+					// and must end at 1000. Without them the train keeps the points it has.
+	MSG_STATS,		// reply: counter(4)*STATS_NUM_COUNTERS then histogram(4*STATS_BUCKETS)*STATS_NUM_HISTOGRAMS
+	MSG_TRACE,		// first(4), empty for the oldest	reply: head(4) first(4) record(TRACE_RECORD_LEN)*up to TRACE_PAGE
+					// the server's recent duty changes, numbered from when it started: 'first' is the number of
+					// the first record sent and 'head' of the next to be written, so ask again from 'first' plus
+					// the records sent until that reaches 'head'. Records older than asked for were overwritten.
+	MSG_TIME,		// reply: now_us(8), the server's clock
+	MSG_PROGRAM,	// action(1) then for PROG_LOAD the program, empty to query
+					// reply: state(1) step(1) len(1) program(len), state is a PROG_STATE_ and step the offset being run
+	MSG_NET_STATS,	// reply: state(1) channel(1) attempts(4) connects(4) fast_connects(4) disconnects(4) restarts(4)
+					// boot_ip_ms(4) boot_cmd_ms(4) reconnect_last_ms(4) reconnect_max_ms(4)
+					// the server's Wi-Fi: state is a NET_STATE_, channel the one it is on, fast_connects those that
+					// skipped the scan with the cached AP, restarts of its sockets on a new address, the time from
+					// boot to its first address and to its first command, and from losing the AP to having an
+					// address again; times not yet measured are 0
+	MSG_PWM,		// profile(1), empty to query	reply: profile(1) num_profiles(1) freq_hz(4) bits(1)
+					// PWM frequency of the train's motor, a PWM_PROFILE_, and the duty resolution it allows
+	MSG_MOTOR,		// stop_mode(1) dwell_ms(2), empty to query	reply: stop_mode(1) dwell_ms(2) state(1)
+					// how the train's h-bridge stops, MOTOR_COAST or MOTOR_BRAKE, how long it rests at zero when
+					// reversing, and the MOTOR_ state it is in
+	MSG_ESTOP,		// no payload, train PROTO_ALL_TRAINS for every train: brake to a stop at once, whoever is
+					// driving, stopping its program and dropping its scheduled commands. It stays braked until the
+					// next command for it.
+	MSG_MEM_STATS,	// reply: free_heap(4) min_free_heap(4) then per task stack(4) stack_free_min(4)
+					// then per pool used(2) peak(2) size(2), MEM_NUM_TASKS and MEM_NUM_POOLS of them
+					// the server's memory: heap in bytes, the stack each of its tasks was given and the least of
+					// it ever left unused, and how full each of its fixed pools is, was at most and can be
+};
+
+// MSG_MOTOR states of a train's h-bridge
+enum {
+	MOTOR_COAST,	// both inputs low, the motor runs freely
+	MOTOR_BRAKE,	// both inputs high, the motor is shorted and its back-emf stops it
+	MOTOR_DRIVE,	// pwm on the input for the direction of travel, the other low
+};
+#define MOTOR_STATE_NAMES	"coast", "brake", "drive"
+#define PROTO_ALL_TRAINS	0xFF	// train of a MSG_ESTOP for every train
+
+// MSG_PWM profiles, the frequency a train's motor is driven at
+enum {
+	PWM_PROFILE_STANDARD,	// 10 kHz, as the server always did
+	PWM_PROFILE_ULTRASONIC,	// 25 kHz, silent, for coreless motors
+	PWM_PROFILE_LOW,		// 100 Hz, kicks an open frame motor round at crawl speeds
+	PWM_PROFILE_COUNT
+};
+#define PWM_PROFILE_NAMES	"standard", "ultrasonic", "low frequency"
+
+// MSG_STATS counters and histograms, in the order they are sent
+// histograms have log2 buckets: bucket i counts values of 2^i to 2^(i+1), the last everything larger
+#define STATS_COUNTER_NAMES		"uptime_ms", "bytes_rx", "bytes_tx", "frames_rx", "text_rx", "parse_errors", "nacks", \
+								"connects", "disconnects", "overflows", "udp_rx", "setpoints", "setpoints_replaced", \
+								"heartbeats_missed"
+#define STATS_NUM_COUNTERS		14
+#define STATS_HISTOGRAM_NAMES	"recv_parse_us", "parse_apply_us", "fade_ticks", "send_us"
+#define STATS_NUM_HISTOGRAMS	4
+#define STATS_BUCKETS			12
+_Static_assert(4 * (1 + STATS_NUM_COUNTERS + STATS_NUM_HISTOGRAMS * STATS_BUCKETS) <= PROTO_MAX_PAYLOAD,
+		"MSG_STATS must fit in one ack");
+
+// MSG_MEM_STATS tasks and pools, in the order they are sent
+#define MEM_TASK_NAMES			"tcp_server", "motor"
+#define MEM_NUM_TASKS			2
+#define MEM_POOL_NAMES			"connections", "scheduled", "trace", "mailbox"
+#define MEM_NUM_POOLS			4
+#define MEM_STATS_LEN			(8 + 8 * MEM_NUM_TASKS + 6 * MEM_NUM_POOLS)
+
+// MSG_TRACE records: time_us(4) train(1) source(1) seq(2) from(2 signed) to(2 signed) fade_ms(4)
+// time_us is the server's clock in microseconds, wrapping every 71 minutes; duties are in tenths of a percent
+#define TRACE_RECORD_LEN	16
+#define TRACE_PAGE			((PROTO_MAX_PAYLOAD - 1 - 8) / TRACE_RECORD_LEN)
+
+// where a duty change in the trace came from
+enum {
+	TRACE_SRC_TEXT,			// text protocol command, no seq
+	TRACE_SRC_FRAME,		// MSG_SET
+	TRACE_SRC_UDP,			// MSG_THROTTLE
+	TRACE_SRC_DISCONNECT,	// stopped as its controller disconnected
+	TRACE_SRC_HEARTBEAT,	// stopped as its controller's heartbeat was missed
+	TRACE_SRC_SCHEDULED,	// MSG_SET with a time, carried out when due
+	TRACE_SRC_PROGRAM,		// the train's program, seq is the offset of the step
+	TRACE_SRC_ESTOP,		// MSG_ESTOP
+};
+#define TRACE_SOURCE_NAMES	"text", "frame", "udp", "disconnect", "heartbeat", "scheduled", "program", "estop"
+
+// MSG_NET_STATS states, the server's Wi-Fi connection
+enum {
+	NET_STATE_STARTING,
+	NET_STATE_CONNECTING,	// looking for the AP or joining it
+	NET_STATE_LINKED,		// joined, waiting for an address
+	NET_STATE_UP,
+	NET_STATE_WAITING,		// lost the AP or could not join it, trying again shortly
+};
+#define NET_STATE_NAMES	"starting", "connecting", "linked", "up", "waiting"
+
+#ifndef SCHED_LEN
+#define SCHED_LEN			32			// MSG_SETs with a time the server can hold
+#endif
+#define SCHED_MAX_AHEAD_US	60000000	// furthest ahead a MSG_SET can be scheduled
+
+// MSG_PROGRAM actions
+enum {
+	PROG_LOAD = 1,	// replace the train's program, stopping the old one
+	PROG_RUN,		// run it from the start, releasing the train to it, and again after the server restarts
+	PROG_STOP,		// stop it, a train it was driving ramps down to a stop
+};
+
+// MSG_PROGRAM states
+enum {
+	PROG_STATE_STOPPED,
+	PROG_STATE_RUNNING,
+	PROG_STATE_PAUSED,		// a client is driving the train
+};
+
+// program steps, each an op(1) followed by its arguments
+enum {
+	PROG_OP_END,		// stop running, the train carries on as it is
+	PROG_OP_RAMP,		// duty(2 signed) fade_ms(4): change speed like a MSG_SET, without waiting for it
+	PROG_OP_HOLD,		// ms(4): carry on for a time
+	PROG_OP_WAIT,		// wait until the train has reached the speed last ramped to
+	PROG_OP_REVERSE,	// swap forward and reverse for the ramps that follow
+	PROG_OP_LOOP,		// step(1) count(1): go back to the step at offset 'step', until the steps
+						// in between have run 'count' times, 0 forever
+};
+#define PROG_MAX_LEN		64	// bytes of program a train can have
+#define PROG_MAX_LOOPS		4	// PROG_OP_LOOPs in a program
+
+// length of program step 'op' with its arguments, 0 for an unknown op
+static inline int prog_op_len(uint8_t op){
+	switch(op){
+		case PROG_OP_RAMP:		return 7;
+		case PROG_OP_HOLD:		return 5;
+		case PROG_OP_LOOP:		return 3;
+		case PROG_OP_END:
+		case PROG_OP_WAIT:
+		case PROG_OP_REVERSE:	return 1;
+		default:				return 0;
+	}
+}
+
+#define UDP_PORT	3334	// throttle channel, 0 on the server to disable it
+
+#define TELEMETRY_MIN_PERIOD_MS	10	// no faster than the server's fade tick
+#define TELEMETRY_ENTRY_LEN		11
+#define TELEMETRY_MODELLED		0x01	// flag: the train follows its inertia model, remaining_ms is at its current rate
+
+#define CURVE_CAL_POINTS	11		// MSG_CURVE calibration points, the same as speed_curve.h's
+#define CURVE_CAL_CURVE		3		// MSG_CURVE curve they calibrate, speed_curve.h's CURVE_CALIBRATED
+
+// the server fades linearly to a new duty over its fade time, but no faster than this many ms per 1% change,
+// except that a stop may be instant
+#define MIN_FADE_RATE	10
+
+// ack status
+enum {
+	PROTO_OK = 0,
+	PROTO_ERR_CHECKSUM,		// frame was corrupt, seq may not be trustworthy
+	PROTO_ERR_TYPE,			// unknown message type
+	PROTO_ERR_LENGTH,		// payload too short for the message type
+	PROTO_ERR_ARG,			// train, duty or time out of range
+	PROTO_ERR_HANDSHAKE,	// frame received before MSG_HELLO
+	PROTO_ERR_BUSY,			// train has another controller, take it with force
+	PROTO_ERR_OWNER,		// command needs the train's controller
+	PROTO_ERR_FULL,			// no room to hold another scheduled command
+};
+
+// a decoded frame, 'payload' points into the receive buffer
+typedef struct {
+	uint8_t type;
+	uint8_t train;
+	uint16_t seq;
+	uint8_t len;
+	const uint8_t *payload;
+} proto_frame_t;
+
+static inline void proto_put16(uint8_t *p, uint16_t v){
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static inline void proto_put32(uint8_t *p, uint32_t v){
+	proto_put16(p, v & 0xFFFF);
+	proto_put16(p + 2, v >> 16);
+}
+
+static inline void proto_put64(uint8_t *p, uint64_t v){
+	proto_put32(p, v & 0xFFFFFFFF);
+	proto_put32(p + 4, v >> 32);
+}
+
+static inline uint16_t proto_get16(const uint8_t *p){
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t proto_get32(const uint8_t *p){
+	return proto_get16(p) | ((uint32_t)proto_get16(p + 2) << 16);
+}
+
+static inline uint64_t proto_get64(const uint8_t *p){
+	return proto_get32(p) | ((uint64_t)proto_get32(p + 4) << 32);
+}
+
+// CRC-8, polynomial 0x07
+static inline uint8_t proto_crc8(const uint8_t *p, int len){
+	uint8_t crc = 0;
+	while(len--){
+		crc ^= *p++;
+		for(int i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+// builds a frame in 'buf', which must hold PROTO_HDR_LEN + len + 1 bytes
+// returns the length of the frame
+static inline int proto_encode(uint8_t *buf, uint8_t type, uint8_t train, uint16_t seq,
+		const uint8_t *payload, uint8_t len){
+	buf[0] = PROTO_MAGIC;
+	buf[1] = len;
+	buf[2] = type;
+	buf[3] = train;
+	proto_put16(buf + 4, seq);
+	for(int i = 0; i < len; i++)
+		buf[PROTO_HDR_LEN + i] = payload[i];
+	buf[PROTO_HDR_LEN + len] = proto_crc8(buf + 1, PROTO_HDR_LEN - 1 + len);
+	return PROTO_HDR_LEN + len + 1;
+}
+
+// decodes the frame at the start of 'buf'
+// returns the length of the frame, 0 if 'avail' bytes do not yet hold a whole frame,
+// or -1 if 'buf' does not start with a valid frame (the caller should drop a byte and resync)
+static inline int proto_decode(const uint8_t *buf, int avail, proto_frame_t *f){
+	if(avail < 1)
+		return 0;
+	if(buf[0] != PROTO_MAGIC)
+		return -1;
+	if(avail < PROTO_HDR_LEN)
+		return 0;
+	int frame_len = PROTO_HDR_LEN + buf[1] + 1;
+	if(avail < frame_len)
+		return 0;
+	if(proto_crc8(buf + 1, frame_len - 2) != buf[frame_len - 1])
+		return -1;
+	f->len = buf[1];
+	f->type = buf[2];
+	f->train = buf[3];
+	f->seq = proto_get16(buf + 4);
+	f->payload = buf + PROTO_HDR_LEN;
+	return frame_len;
+}
+
+#endif
@@ -9,58 +9,440 @@
 ** Connect to serial port to read assigned IP address the esp32 connects to wifi
 */
 #include <string.h>
+#include <stdlib.h>
 #include <sys/param.h>
+#include <fcntl.h>
+#ifdef HOST_BUILD
+#include "host_platform.h"
+#else
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "driver/ledc.h"
+#include "driver/gpio.h"
+#include "esp_rom_gpio.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
+#include "nvs.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#endif
+
+#include "protocol.h"
+#include "speed_curve.h"
 
 #define CONFIG_EXAMPLE_IPV4 y;
 
 static const char *TAG = "tcp_example";
 
-#define MIN_FADE_RATE	10	// minimum number of miliseconds per % change in duty cycle
-static int cur_duty = 0;
-static int set_duty(int duty, int time);
-static int get_duty(void);
+#define FADE_TICK_MS	10	// period of the fade engine tick
+#define DUTY_SCALE		1000	// the fade engine works in 1/1000ths of a percent
+#define HEARTBEAT_MIN_MS	50		// shortest heartbeat deadline a client can ask for
+#define ESTOP_MS		500		// default time to stop from full speed when a heartbeat is missed
+#define INERTIA_ACCEL		50		// default acceleration of a modelled train, tenths of a percent per second
+#define INERTIA_BRAKE		100		// default braking
+#define INERTIA_MIN_RATE	10		// slowest a modelled train speeds up or slows down, tenths of a percent per second
+#define INERTIA_NVS			"inertia"	// nvs namespace of the per train dynamics, one blob per train
+#define CURVE_NVS			"curve"		// nvs namespace of the speed curve each train uses
+#define PROGRAM_NVS			"program"	// nvs namespace of the program of each train
+#define PROG_MAX_STEPS		16			// most steps of a program run in one go, so a loop with no hold can't hog the motor task
+#define PWM_NVS				"pwm"		// nvs namespace of the pwm profile each train uses
+#define MOTOR_NVS			"motor"		// nvs namespace of how each train's h-bridge stops and reverses
+#define MOTOR_DWELL_MS		100			// default time a motor rests at zero before it is driven the other way
+#define PWM_CLK_HZ			80000000	// clock the ledc timers count, the APB clock
+#ifndef PWM_MAX_BITS
+#define PWM_MAX_BITS		14			// widest duty resolution of the ESP32-S2's ledc timers
+#endif
+#define PWM_DITHER_BITS		8			// bits below the ledc's resolution kept by curve_power() and dithered by write_duty()
+#ifndef PWM_FREQ_STANDARD
+#define PWM_FREQ_STANDARD	10000		// frequencies of the pwm profiles in protocol.h
+#endif
+#ifndef PWM_FREQ_ULTRASONIC
+#define PWM_FREQ_ULTRASONIC	25000
+#endif
+#ifndef PWM_FREQ_LOW
+#define PWM_FREQ_LOW		100
+#endif
+
+// compile-time log verbosity, on top of the IDF's log level:
+// 0 logs connections and settings, 1 also every command applied, 2 also every packet
+// production builds use 0 so the hot path never formats a string
+#ifndef LOG_VERBOSITY
+#define LOG_VERBOSITY		0
+#endif
+#if LOG_VERBOSITY >= 1
+#define LOG_COMMAND(...)	ESP_LOGI(TAG, __VA_ARGS__)
+#else
+#define LOG_COMMAND(...)	do {} while(0)
+#endif
+#if LOG_VERBOSITY >= 2
+#define LOG_PACKET(...)		ESP_LOGI(TAG, __VA_ARGS__)
+#else
+#define LOG_PACKET(...)		do {} while(0)
+#endif
+
+// software fade, interpolated by fade_tick() and retargeted by set_duty()
+// duties are signed (positive is forward) and scaled by DUTY_SCALE
+typedef struct {
+	int32_t from;		// duty when the fade started
+	int32_t to;			// duty at the end of the fade
+	int32_t now;		// duty written to the ledc on the last tick
+	int64_t start_us;	// esp_timer time the fade started
+	int64_t len_us;		// length of the fade
+} fade_t;
+
+// dynamics of a train, stored in nvs
+// rates are in tenths of a percent of duty per second
+typedef struct {
+	uint8_t enabled;	// model the train instead of fading linearly
+	uint16_t mass;		// percent of a nominal train, a heavier train takes longer to speed up and to stop
+	uint16_t accel;		// fastest speed up on the level
+	uint16_t brake;		// fastest slow down on the level
+	int16_t grade;		// load from the gradient, taken off accel and added to brake while climbing
+						// positive is uphill going forward
+} inertia_cfg_t;
+
+// train dynamics model, integrated by fade_tick() every FADE_TICK_MS
+// takes the place of fades while enabled: a setpoint becomes the target speed and the
+// speed moves towards it as fast as the train's acceleration or braking allows
+// speeds are signed duties scaled by DUTY_SCALE
+typedef struct {
+	inertia_cfg_t cfg;
+	int32_t target;		// speed asked for
+	int32_t start;		// speed when the target was set
+	int32_t speed;		// speed now, written as the duty
+	int estop_ms;		// stopping at no less than the emergency rate, 0 normally
+} inertia_t;
+
+// how a train's h-bridge stops and reverses, stored in nvs
+typedef struct {
+	uint8_t stop_mode;		// MOTOR_COAST or MOTOR_BRAKE from protocol.h, what the bridge does at zero duty
+	uint16_t dwell_ms;		// time at zero before the motor is driven the other way
+} motor_cfg_t;
+
+// the speed curve of a train and its own calibration, stored in nvs
+typedef struct {
+	uint8_t curve;			// from speed_curve.h
+	uint16_t cal_points[CURVE_CAL_POINTS];	// power in tenths of a percent at 0%, 10% .. 100% of speed
+} curve_cfg_t;
+_Static_assert(CURVE_CAL_CURVE == CURVE_CALIBRATED, "protocol.h must name the calibrated curve");
+
+// one h-bridge per train
+// each train has a single ledc channel which is routed to whichever bridge input matches
+// the direction of travel, the other input is held low. The ESP32-S2 only has 8 ledc channels,
+// so a channel per bridge input would limit the controller to 4 trains.
+typedef struct {
+	int fwd_gpio;			// bridge input driven when duty > 0
+	int rev_gpio;			// bridge input driven when duty < 0
+	ledc_channel_t channel;
+	fade_t fade;
+	int dir;				// input the channel is routed to: 1 forward, -1 reverse
+	uint32_t out;			// duty last written to the channel
+	int64_t watchdog_us;	// esp_timer time the controller's next heartbeat is due by, 0 when not watched
+	int estop_ms;			// time to stop from full speed when the heartbeat is missed
+	inertia_t inertia;
+	uint8_t curve;			// speed curve mapping its duty to power, from speed_curve.h
+	uint16_t cal_points[CURVE_CAL_POINTS];	// the loco's own calibration, see curve_cfg_t
+	uint16_t cal_curve[2][CURVE_LEN];		// CURVE_CALIBRATED built from them, the motor task reads cal_curve[cal_live]
+	uint8_t cal_live;
+	uint8_t profile;		// pwm profile, from protocol.h
+	uint8_t bound;			// profile whose timer the channel is bound to, changed by the motor task
+	uint32_t dither;		// fraction of a count owed to the output, in 1/2^PWM_DITHER_BITS
+	motor_cfg_t motor_cfg;
+	uint8_t motor;			// MOTOR_ state of the bridge, from protocol.h, changed by the motor task
+	uint8_t braked;			// held in MOTOR_BRAKE by an emergency stop until the next setpoint, guarded by fade_lock
+	int64_t zero_us;		// esp_timer time the duty last came to zero, 0 while it is not
+} train_t;
+
+#define NUM_TRAINS		6
+static train_t trains[NUM_TRAINS] = {
+	{ .fwd_gpio = 1,  .rev_gpio = 2,  .channel = LEDC_CHANNEL_0 },
+	{ .fwd_gpio = 3,  .rev_gpio = 4,  .channel = LEDC_CHANNEL_1 },
+	{ .fwd_gpio = 5,  .rev_gpio = 6,  .channel = LEDC_CHANNEL_2 },
+	{ .fwd_gpio = 7,  .rev_gpio = 8,  .channel = LEDC_CHANNEL_3 },
+	{ .fwd_gpio = 9,  .rev_gpio = 10, .channel = LEDC_CHANNEL_4 },
+	{ .fwd_gpio = 11, .rev_gpio = 12, .channel = LEDC_CHANNEL_5 },
+};
+// a ledc timer for each pwm profile, running at the profile's frequency with as many bits of duty as it can count
+// a train's channel is bound to the timer of its profile
+typedef struct {
+	uint32_t freq_hz;
+	ledc_timer_t timer;
+	int bits;				// duty resolution, set by my_ledc_init()
+} pwm_profile_t;
+static pwm_profile_t pwm_profiles[PWM_PROFILE_COUNT] = {
+	[PWM_PROFILE_STANDARD]		= { .freq_hz = PWM_FREQ_STANDARD,	.timer = LEDC_TIMER_1 },
+	[PWM_PROFILE_ULTRASONIC]	= { .freq_hz = PWM_FREQ_ULTRASONIC,	.timer = LEDC_TIMER_2 },
+	[PWM_PROFILE_LOW]			= { .freq_hz = PWM_FREQ_LOW,		.timer = LEDC_TIMER_3 },
+};
+static portMUX_TYPE fade_lock = portMUX_INITIALIZER_UNLOCKED;	// guards the fade_t and watchdog of every train
+static uint32_t heartbeats_missed;	// trains stopped by the watchdog, guarded by fade_lock
+static uint32_t heartbeats_late;	// heartbeats that came in with less than a third of the deadline left
+static esp_timer_handle_t fade_timer;
+
+// the motor task owns the ledc hardware and runs at a higher priority than the network
+// commands reach it through a slot per train holding only the newest setpoint,
+// so a setpoint superseded before the motor task gets to it is dropped rather than queued
+typedef struct {
+	int32_t duty;		// scaled by DUTY_SCALE
+	int time;			// fade time in ms
+	int64_t posted_us;	// esp_timer time set_duty() posted it
+	uint8_t source;		// where it came from, a TRACE_SRC_ from protocol.h
+	uint16_t seq;		// seq of the frame or datagram that carried it
+	int full;			// holds a setpoint the motor task has not applied yet
+} mbox_slot_t;
+
+#define MBOX_LATENCY_BUCKETS	16	// bucket i counts latencies of 2^i to 2^(i+1) us, the last everything slower
+
+typedef struct {
+	uint32_t posted;							// setpoints posted
+	uint32_t dropped;							// overwritten before the motor task applied them
+	int depth_max;								// most slots full at once
+	uint32_t latency_max_us;					// longest from post to apply
+	uint32_t latency[MBOX_LATENCY_BUCKETS];		// post to apply latencies, log2 histogram
+} mbox_stats_t;
+
+#define MOTOR_TASK_PRIORITY	10	// above tcp_server, so sockets and logging never hold up the motors
+#ifndef MOTOR_TASK_STACK
+#define MOTOR_TASK_STACK	3072	// bytes, MSG_MEM_STATS reports the least of it ever left unused
+#endif
+static TaskHandle_t motor_task_handle;
+static mbox_slot_t mbox[NUM_TRAINS];
+static mbox_stats_t mbox_stats;
+static portMUX_TYPE mbox_lock = portMUX_INITIALIZER_UNLOCKED;	// guards mbox and mbox_stats
+static void motor_task(void *arg);
+static void motor_wake(void *arg);
+
+// every duty change the motor task makes, kept in a ring so a lurch or stall can be looked into afterwards
+// the motor task is the only writer and never waits: it fills the record, then publishes it by
+// advancing trace_head, and a reader copies records out and checks afterwards which were overwritten
+#ifndef TRACE_LEN
+#define TRACE_LEN	256		// records kept, a power of 2 so trace_head can wrap
+#endif
+_Static_assert((TRACE_LEN & (TRACE_LEN - 1)) == 0 && TRACE_LEN <= UINT16_MAX, "TRACE_LEN must be a power of 2");
+typedef struct {
+	uint32_t time_us;	// esp_timer time, low 32 bits
+	int16_t from;		// duty before, in tenths of a percent
+	int16_t to;			// duty asked for
+	uint32_t fade_ms;	// time given to get there
+	uint8_t train;
+	uint8_t source;		// TRACE_SRC_ from protocol.h
+	uint16_t seq;		// seq of the command, 0 when it did not come in a frame
+} trace_rec_t;
+static trace_rec_t trace[TRACE_LEN];
+static uint32_t trace_head;	// records ever written, the newest is trace[(trace_head - 1) % TRACE_LEN]
+static void trace_add(int train, int32_t from, int32_t to, uint32_t fade_ms, int source, uint16_t seq);
+static int trace_read(uint32_t *first, trace_rec_t *recs, int max, uint32_t *head);
+
+// setpoints held until their time, a binary heap with the earliest at sched[0]
+// the tcp_server task adds and cancels them, the motor task carries them out when due
+// and is the only one to arm sched_timer, a one-shot for the earliest
+typedef struct {
+	int64_t at_us;		// esp_timer time to carry it out
+	uint32_t order;		// breaks ties between setpoints due at the same time, first come first served
+	uint8_t train;
+	mbox_slot_t set;
+} sched_entry_t;
+static sched_entry_t sched[SCHED_LEN];
+static int sched_len;
+static int sched_peak;	// most setpoints ever held at once
+static uint32_t sched_order;
+static portMUX_TYPE sched_lock = portMUX_INITIALIZER_UNLOCKED;	// guards sched, sched_len and sched_order
+static esp_timer_handle_t sched_timer;
+static int schedule_duty(int train, int32_t duty, int time, int64_t at_us, uint16_t seq);
+static void sched_cancel(int train);
+static void sched_take(void);
+
+// a train's program as saved in nvs, PROG_OP_ steps from protocol.h
+typedef struct {
+	uint8_t run;		// was running, so it starts again after a restart
+	uint8_t len;
+	uint8_t code[PROG_MAX_LEN];
+} prog_code_t;
+
+// a program driving a train, stepped by prog_tick() on the motor task
+typedef struct {
+	prog_code_t prog;
+	int running;
+	int paused;							// a client controls the train, the program waits for it to let go
+	int resume;							// the client let go, take up the program's speed again
+	int pc;								// offset of the step being run
+	int dir;							// 1, or -1 after an odd number of PROG_OP_REVERSE
+	int32_t duty;						// speed last ramped to, signed and scaled by DUTY_SCALE
+	int64_t hold_us;					// esp_timer time the PROG_OP_HOLD being run ends, 0 when not holding
+	uint8_t loop_pc[PROG_MAX_LOOPS];	// offset of each PROG_OP_LOOP
+	uint8_t loop_runs[PROG_MAX_LOOPS];	// times round each loop so far
+} prog_t;
+static prog_t progs[NUM_TRAINS];
+static portMUX_TYPE prog_lock = portMUX_INITIALIZER_UNLOCKED;	// guards progs
+static int prog_check(const uint8_t *code, int len, uint8_t *loop_pc);
+static int set_program(int train, const uint8_t *code, int len);
+static int run_program(int train, int run);
+static void pause_program(int train, int paused);
+static void prog_tick(int64_t now_us, const int *settled);
+
+// counters and log2 histograms of the hot paths, fixed size and never allocated
+// each field has a single writer: the motor task for fade_ticks, the tcp_server task for the rest
+// histograms have STATS_BUCKETS log2 buckets, see protocol.h
+typedef struct {
+	uint32_t bytes_rx;
+	uint32_t bytes_tx;
+	uint32_t frames_rx;
+	uint32_t text_rx;						// text protocol commands
+	uint32_t parse_errors;					// corrupt frames, bytes skipped resyncing and bad text commands
+	uint32_t nacks;							// acks sent with an error status
+	uint32_t connects;
+	uint32_t disconnects;
+	uint32_t overflows;						// clients closed for not reading their replies
+	uint32_t udp_rx;						// throttle datagrams
+	uint32_t recv_parse_us[STATS_BUCKETS];	// from recv() returning to the command being handled
+	uint32_t fade_ticks[STATS_BUCKETS];		// length of each fade started, in FADE_TICK_MS
+	uint32_t send_us[STATS_BUCKETS];		// time in each tcp_server_send()
+	uint32_t boot_cmd_ms;					// from boot to the first command handled, 0 until then
+} stats_t;
+static stats_t stats;
+static void hist_add(uint32_t *hist, int buckets, uint32_t value);
+static void get_mbox_stats(mbox_stats_t *stats, int *depth);
+
+static int set_duty(int train, int32_t duty, int time, int source, uint16_t seq);
+static int32_t get_duty(int train);
+static void get_fade(int train, int32_t *duty, int32_t *target, int *progress, uint32_t *remaining_ms, int *modelled);
+static void load_train_settings(void);
+static int set_inertia(int train, const inertia_cfg_t *cfg);
+static void get_inertia(int train, inertia_cfg_t *cfg);
+static int set_curve(int train, int curve, const uint16_t *points);
+static int set_pwm(int train, int profile);
+static int set_motor(int train, const motor_cfg_t *cfg);
+static void emergency_stop(int train, uint16_t seq);
+static esp_err_t nvs_load(const char *space, int train, void *blob, size_t len);
+static esp_err_t nvs_save(const char *space, int train, const void *blob, size_t len);
+static void fade_tick(void);
 
-static int tcp_server_send(int sock, char *buf);
+// state of a client connection
+typedef struct {
+	int sock;							// -1 when the slot is free
+	int overflow;						// replies did not fit in tx, connection will be closed
+	int binary;							// handshake done, speaking frames
+	uint8_t rx[2 * PROTO_MAX_FRAME];	// received bytes not yet parsed
+	int rx_len;
+	uint8_t tx[2 * PROTO_MAX_FRAME];	// replies not yet sent
+	int tx_len;
+	int64_t telemetry_us;				// period of the telemetry stream, 0 when not subscribed
+	int64_t next_telemetry_us;			// esp_timer time the next telemetry frame is due
+	uint16_t telemetry_seq;
+	uint32_t token;						// identifies the client's udp throttles
+	int64_t heartbeat_us;				// deadline for hearing from the client, 0 when it has no heartbeat
+	int64_t last_rx_us;					// esp_timer time the client was last heard from
+	int estop_ms;						// time its trains take to stop from full speed if it goes quiet
+	int64_t rx_us;						// esp_timer time of the last recv, for the recv to parse histogram
+} conn_t;
+
+static int tcp_server_send(int sock, const void *buf, int len);
+
+static int tcp_server_talk(conn_t *c);
+
+// connections are served by one task from a select() loop, each is a cab or an observer
+// a train is driven by at most one connection, its controller, everyone can watch it
+#ifndef MAX_CLIENTS
+#ifdef HOST_BUILD
+#define MAX_CLIENTS                 512
+#else
+#define MAX_CLIENTS                 8	// lwIP allows CONFIG_LWIP_MAX_SOCKETS (10 by default) in total
+#endif
+#endif
+_Static_assert(MAX_CLIENTS <= UINT16_MAX, "MAX_CLIENTS is reported in 16 bits");
+#ifndef TCP_SERVER_STACK
+#define TCP_SERVER_STACK	4096	// bytes, MSG_MEM_STATS reports the least of it ever left unused
+#endif
+static TaskHandle_t tcp_server_handle;
+static conn_t conns[MAX_CLIENTS];		// every connection's buffers, there is no other allocation per client
+static int conns_used, conns_peak;		// slots of conns taken now and at most, only the tcp_server task uses them
+static conn_t *train_owner[NUM_TRAINS];	// controller of each train, NULL when nobody has it
+static int train_dir[NUM_TRAINS];		// direction last sent over tcp, 1 forward -1 reverse
 
-static void tcp_server_talk(int sock);
+// udp throttles for one train, from its current controller
+typedef struct {
+	uint16_t seq;		// seq of the newest throttle applied
+	int have_seq;		// a throttle has been applied since the controller took the train
+	uint32_t received;	// throttles applied
+	uint32_t lost;		// skipped over in seq, some may turn up later as stale
+	uint32_t stale;		// arrived after a newer throttle, dropped
+	uint32_t rejected;	// not from the train's controller, dropped
+} udp_train_t;
+static udp_train_t udp_trains[NUM_TRAINS];
+static void udp_server_recv(int udp_sock);
 
 #define PORT                        3333
 #define KEEPALIVE_IDLE              5
 #define KEEPALIVE_INTERVAL          5
 #define KEEPALIVE_COUNT             3
 static void tcp_server_task(void *pvParameter);
+static void tcp_server_run(int addr_family, uint32_t gen);
 
-#define LEDC_LS_TIMER          LEDC_TIMER_1
 #define LEDC_LS_MODE           LEDC_LOW_SPEED_MODE
-#define LEDC_LS_CH0_GPIO       (1)
-#define LEDC_LS_CH0_CHANNEL    LEDC_CHANNEL_0
-#define LEDC_LS_CH1_GPIO       (2)
-#define LEDC_LS_CH1_CHANNEL    LEDC_CHANNEL_1
 static void my_ledc_init(void);
 
 #define ESP_WIFI_SSID      ("ssid")		// replace with correct ssid
 #define ESP_WIFI_PASS      ("password")	// replace with correct password
-#define EXAMPLE_ESP_MAXIMUM_RETRY  5
+#define WIFI_RETRY_MIN_MS	100		// wait before the second attempt to reconnect, doubled after each failure
+#define WIFI_RETRY_MAX_MS	30000	// longest wait between attempts, it never gives up
+#define WIFI_NVS			"wifi"	// nvs namespace of the cached connection parameters
+#define NET_CHECK_MS		100		// longest the tcp server goes without checking its address is still current
+// reconnect with the address dhcp gave last time rather than asking again
+// off by default: nothing checks the lease is still ours, so once it has gone to another host
+// both would answer to it; only turn on where the router reserves the address for this board
+#ifndef WIFI_REUSE_IP
+#define WIFI_REUSE_IP		0
+#endif
 void wifi_init_sta(void);
 
+// the AP and address of the last good connection, saved in nvs so a reconnect,
+// or the next boot, goes straight to the AP's channel and skips dhcp
+typedef struct {
+	uint8_t bssid[6];
+	uint8_t channel;	// 0 when nothing is cached
+	uint32_t ip;		// 0 when dhcp has to be used
+	uint32_t netmask;
+	uint32_t gw;
+} wifi_cache_t;
+
+// the connection state machine, moved on by event_handler() and wifi_retry_timer
+// nothing waits on it: the tcp server is started straight away and serves once there is an address
+typedef struct {
+	int state;					// a NET_STATE_ from protocol.h
+	wifi_cache_t cache;
+	int use_cache;				// try the cache, cleared when an attempt with it fails
+	int fast;					// the attempt being made uses the cache
+	int retry_ms;				// wait before the next attempt, 0 to try again at once
+	uint32_t ip;				// address the tcp server should be serving on
+	uint32_t ip_gen;			// counts changes of address
+	int64_t down_us;			// esp_timer time the connection was lost, 0 while it is up
+	uint32_t attempts;
+	uint32_t connects;			// addresses got
+	uint32_t fast_connects;		// of them with the cache
+	uint32_t disconnects;		// connections lost
+	uint32_t restarts;			// times the tcp server reopened its sockets on a new address
+	uint32_t boot_ip_ms;		// from boot to the first address
+	uint32_t reconnect_last_ms;	// from losing the connection to having an address again
+	uint32_t reconnect_max_ms;
+} wifi_t;
+static wifi_t wifi;
+static portMUX_TYPE wifi_lock = portMUX_INITIALIZER_UNLOCKED;	// guards wifi
+static esp_timer_handle_t wifi_retry_timer;
+static esp_netif_t *sta_netif;
+static wifi_config_t wifi_config;
+static void wifi_connect(void *arg);
+static uint32_t wifi_ip_gen(void);
+
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-static int s_retry_num = 0;
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data);
 
@@ -68,171 +450,1673 @@ static void event_handler(void* arg, esp_event_base_t event_base,
 static EventGroupHandle_t s_wifi_event_group;
 
 void app_main(void){
+    ESP_LOGI(TAG, "Fixed pools: %d connections of %u bytes, %d scheduled setpoints of %u, %d trace records of %u, "
+            "%d trains of %u", MAX_CLIENTS, (unsigned)sizeof(conn_t), SCHED_LEN, (unsigned)sizeof(sched_entry_t),
+            TRACE_LEN, (unsigned)sizeof(trace_rec_t), NUM_TRAINS, (unsigned)sizeof(train_t));
     ESP_ERROR_CHECK(nvs_flash_init());
     my_ledc_init();
     wifi_init_sta();
 
 #ifdef CONFIG_EXAMPLE_IPV4
-    xTaskCreate(tcp_server_task, "tcp_server", 4096, (void*)AF_INET, 5, NULL);
+    xTaskCreate(tcp_server_task, "tcp_server", TCP_SERVER_STACK, (void*)AF_INET, 5, &tcp_server_handle);
 #endif
 #ifdef CONFIG_EXAMPLE_IPV6
-    xTaskCreate(tcp_server_task, "tcp_server", 4096, (void*)AF_INET6, 5, NULL);
+    xTaskCreate(tcp_server_task, "tcp_server", TCP_SERVER_STACK, (void*)AF_INET6, 5, &tcp_server_handle);
 #endif
 }
 
-// sets duty when both initial and final duties are >= 0
-// returns 0 when successful, non-zero otherwise
-static int set_duty_pos(int duty, int time){
-	int _duty = (255*duty)/100;	// scale duty to correct precision
-	if(duty < 0){
-		ESP_LOGE(TAG, "set_duty_neg incorrectly used (duty neg)");
-		return ESP_ERR_INVALID_ARG;
+// duty of fade 'f' at time 'now_us'
+// a fade that starts after 'now_us' is still at its start
+// caller must hold fade_lock
+static int32_t fade_position(const fade_t *f, int64_t now_us){
+	int64_t elapsed = now_us - f->start_us;
+	if(elapsed >= f->len_us)
+		return f->to;
+	if(elapsed <= 0)
+		return f->from;
+	return f->from + (int32_t)(((int64_t)(f->to - f->from) * elapsed) / f->len_us);
+}
+
+// connects the train's ledc channel to the bridge input for 'dir' and holds the other input low
+static void route_bridge(train_t *t, int dir){
+	int on = dir > 0 ? t->fwd_gpio : t->rev_gpio;
+	int off = dir > 0 ? t->rev_gpio : t->fwd_gpio;
+	esp_rom_gpio_connect_out_signal(off, SIG_GPIO_OUT_IDX, false, false);
+	gpio_set_level(off, 0);
+	ledc_set_pin(on, LEDC_LS_MODE, t->channel);
+	t->dir = dir;
+}
+
+// drives both of the train's bridge inputs high, shorting the motor so its own back-emf brakes it
+// route_bridge() hands the input for the direction of travel back to the channel
+static void brake_bridge(train_t *t){
+	esp_rom_gpio_connect_out_signal(t->fwd_gpio, SIG_GPIO_OUT_IDX, false, false);
+	esp_rom_gpio_connect_out_signal(t->rev_gpio, SIG_GPIO_OUT_IDX, false, false);
+	gpio_set_level(t->fwd_gpio, 1);
+	gpio_set_level(t->rev_gpio, 1);
+}
+
+// power for a duty (scaled by DUTY_SCALE, 0 to 100%) on a speed curve, in 1/65535ths of full power
+// with PWM_DITHER_BITS bits of fraction
+// interpolates between the two table entries either side of it
+static uint32_t curve_power(const uint16_t *curve, uint32_t duty){
+	uint32_t i = duty / (DUTY_SCALE / CURVE_STEPS);
+	uint32_t frac = duty % (DUTY_SCALE / CURVE_STEPS);
+	if(i >= CURVE_LEN - 1)
+		return curve[CURVE_LEN - 1] << PWM_DITHER_BITS;
+	return (curve[i] << PWM_DITHER_BITS) +
+			(((uint64_t)(curve[i + 1] - curve[i]) << PWM_DITHER_BITS) * frac) / (DUTY_SCALE / CURVE_STEPS);
+}
+
+// writes a signed, scaled duty to a train's h-bridge through the train's speed curve
+// at the full resolution of its profile's timer, dithering the fraction of a count left over:
+// the fraction builds up tick by tick and adds a count whenever it comes to a whole one,
+// so the average output over a few ticks is as fine as the duty
+// at zero duty the bridge coasts or brakes as the train is set up to, and brakes after an emergency stop
+// on a change of direction, or out of a brake, the duty is written before the channel is rerouted,
+// so the new input never sees the old duty
+static void write_duty(train_t *t, int32_t duty){
+	int profile = t->profile;	// read once, set_pwm() can change it at any time
+	if(profile != t->bound){
+		ledc_bind_channel_timer(LEDC_LS_MODE, t->channel, pwm_profiles[profile].timer);
+		t->bound = profile;
+		t->out = UINT32_MAX;	// at the new resolution the old count means something else
 	}
-	if(cur_duty < 0){
-		ESP_LOGE(TAG, "set_duty_neg incorrectly used (cur_duty neg");
-		return ESP_ERR_INVALID_STATE;
+	int curve = t->curve;		// and the curve, set_curve() swaps a new calibration in whole
+	const uint16_t *table = curve == CURVE_CALIBRATED ? t->cal_curve[__atomic_load_n(&t->cal_live, __ATOMIC_ACQUIRE)]
+			: speed_curves[curve];
+	int state = duty != 0 ? MOTOR_DRIVE : t->braked || t->motor_cfg.stop_mode == MOTOR_BRAKE ? MOTOR_BRAKE : MOTOR_COAST;
+	uint32_t power = state == MOTOR_DRIVE ? curve_power(table, abs(duty)) : 0;
+	uint32_t level = ((uint64_t)power * ((1u << pwm_profiles[profile].bits) - 1)) / CURVE_FULL;
+	uint32_t out = level >> PWM_DITHER_BITS;
+	t->dither = level == 0 ? 0 : t->dither + (level & ((1u << PWM_DITHER_BITS) - 1));
+	if(t->dither >> PWM_DITHER_BITS){
+		t->dither -= 1u << PWM_DITHER_BITS;
+		out++;
 	}
-	int success = ledc_set_fade_with_time(LEDC_LS_MODE, LEDC_LS_CH0_CHANNEL, _duty, time);
-	if(success != ESP_OK)
-		return success;
-    success = ledc_fade_start(LEDC_LS_MODE, LEDC_LS_CH0_CHANNEL, LEDC_FADE_WAIT_DONE);
-    if(success == ESP_OK){
-    	cur_duty = duty;
-    }
-    return success;
+	if(out != t->out){
+		ledc_set_duty(LEDC_LS_MODE, t->channel, out);
+		ledc_update_duty(LEDC_LS_MODE, t->channel);
+		t->out = out;
+	}
+	if(state == MOTOR_BRAKE && t->motor != MOTOR_BRAKE)
+		brake_bridge(t);
+	else if(state != MOTOR_BRAKE && (t->motor == MOTOR_BRAKE || (duty != 0 && (duty > 0) != (t->dir > 0))))
+		route_bridge(t, duty == 0 ? t->dir : duty > 0 ? 1 : -1);
+	t->motor = state;
+}
+
+// holds a train about to be driven the other way at zero until it has rested there for its dwell,
+// so the bridge is never driven against a motor still turning the other way
+// 'goal' is the duty the train would go to next; a fade is put off until the dwell is over
+// and carries on from zero at the rate it was going
+// returns non-zero while the train is held
+// caller must hold fade_lock
+static int reverse_dwell(train_t *t, int32_t goal, int64_t now_us){
+	if(goal == 0 || (goal > 0) == (t->dir > 0))
+		return 0;
+	int64_t until_us = (t->zero_us != 0 ? t->zero_us : now_us) + (int64_t)t->motor_cfg.dwell_ms * 1000;
+	if(now_us >= until_us)
+		return 0;
+	if(!t->inertia.cfg.enabled){
+		fade_t *f = &t->fade;
+		f->len_us = ((int64_t)f->len_us * abs(f->to)) / MAX(abs(f->to - f->from), 1);
+		f->from = 0;
+		f->start_us = until_us;
+	}
+	return 1;
+}
+
+// starts fade 'f' from its position at 'now_us' to 'to' taking 'len_us'
+// caller must hold fade_lock
+static void fade_start(fade_t *f, int32_t to, int64_t now_us, int64_t len_us){
+	f->from = fade_position(f, now_us);
+	f->to = to;
+	f->start_us = now_us;
+	f->len_us = len_us;
+}
+
+// how far a modelled train's speed moves in one FADE_TICK_MS, speeding up when 'away' from zero
+// caller must hold fade_lock
+static int32_t inertia_step_size(const inertia_t *m, int away){
+	int dir = m->speed > 0 || (m->speed == 0 && m->target > 0) ? 1 : -1;
+	int grade = dir * m->cfg.grade;
+	int rate = away ? m->cfg.accel - grade : m->cfg.brake + grade;
+	if(rate < INERTIA_MIN_RATE)
+		rate = INERTIA_MIN_RATE;
+	int32_t step = ((int64_t)rate * (DUTY_SCALE / 10) * FADE_TICK_MS * 100) / (1000 * m->cfg.mass);
+	if(m->estop_ms > 0 && step < (100 * DUTY_SCALE * FADE_TICK_MS) / m->estop_ms)
+		step = (100 * DUTY_SCALE * FADE_TICK_MS) / m->estop_ms;
+	return step < 1 ? 1 : step;
+}
+
+// moves a modelled train one FADE_TICK_MS towards its target speed
+// caller must hold fade_lock
+static void inertia_step(inertia_t *m){
+	int32_t v = m->speed;
+	int32_t goal = m->target;
+	if(v == goal)
+		return;
+	int away = (v >= 0 && goal > v) || (v <= 0 && goal < v);	// speeding up rather than slowing down
+	int32_t step = inertia_step_size(m, away);
+	if(away){
+		v = goal > v ? MIN(v + step, goal) : MAX(v - step, goal);
+	} else {
+		int32_t stop = (goal > 0) == (v > 0) ? goal : 0;	// stop at zero before reversing
+		v = v > 0 ? MAX(v - step, stop) : MIN(v + step, stop);
+	}
+	m->speed = v;
+}
+
+// starts the fade for a setpoint taken from the mailbox
+// an emergency stop drops the duty to zero at once and holds the bridge braked until the next setpoint
+// the fade takes 'time' or 'MIN_FADE_RATE'*change (whichever is larger) and starts from wherever the motor is now,
+// so a running fade is retargeted rather than waited for
+// a modelled train takes it as its new target speed instead
+static void apply_duty(int train, const mbox_slot_t *slot, int64_t now_us){
+	train_t *t = &trains[train];
+	int32_t duty = slot->duty;
+	portENTER_CRITICAL(&fade_lock);
+	t->braked = slot->source == TRACE_SRC_ESTOP;
+	if(t->braked){	// stop dead, the brake does the rest
+		int32_t from = t->inertia.cfg.enabled ? t->inertia.speed : fade_position(&t->fade, now_us);
+		fade_start(&t->fade, 0, now_us, 0);
+		t->inertia.target = t->inertia.start = t->inertia.speed = 0;
+		portEXIT_CRITICAL(&fade_lock);
+		trace_add(train, from, 0, 0, slot->source, slot->seq);
+		return;
+	}
+	if(t->inertia.cfg.enabled){
+		int32_t from = t->inertia.speed;
+		t->inertia.target = duty;
+		t->inertia.start = from;
+		t->inertia.estop_ms = 0;
+		portEXIT_CRITICAL(&fade_lock);
+		trace_add(train, from, duty, slot->time, slot->source, slot->seq);
+		return;
+	}
+	int32_t from = fade_position(&t->fade, now_us);
+	int duty_delta = abs(duty - from);
+	int min_fade_time = duty == 0 ? 1 : (duty_delta * MIN_FADE_RATE) / DUTY_SCALE;
+	int fade_time = slot->time > min_fade_time ? slot->time : min_fade_time;
+	fade_start(&t->fade, duty, now_us, (int64_t)fade_time * 1000);
+	portEXIT_CRITICAL(&fade_lock);
+	hist_add(stats.fade_ticks, STATS_BUCKETS, fade_time / FADE_TICK_MS);
+	trace_add(train, from, duty, fade_time, slot->source, slot->seq);
+}
+
+// records a duty change in the trace, called only from the motor task
+static void trace_add(int train, int32_t from, int32_t to, uint32_t fade_ms, int source, uint16_t seq){
+	uint32_t head = trace_head;
+	trace_rec_t *r = &trace[head % TRACE_LEN];
+	r->time_us = esp_timer_get_time();
+	r->from = from / (DUTY_SCALE / PROTO_DUTY_SCALE);
+	r->to = to / (DUTY_SCALE / PROTO_DUTY_SCALE);
+	r->fade_ms = fade_ms;
+	r->train = train;
+	r->source = source;
+	r->seq = seq;
+	__atomic_store_n(&trace_head, head + 1, __ATOMIC_RELEASE);	// publish only once the record is whole
+}
+
+// copies up to 'max' trace records, starting with record number '*first' or the oldest still kept
+// sets '*first' to the number of the first record copied and '*head' to the number of records ever written
+// returns the number of records copied
+static int trace_read(uint32_t *first, trace_rec_t *recs, int max, uint32_t *head){
+	uint32_t h = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint32_t oldest = h > TRACE_LEN ? h - TRACE_LEN : 0;
+	if(*first - oldest > h - oldest)	// overwritten already, or not written yet
+		*first = oldest;
+	int n = MIN((uint32_t)max, h - *first);
+	for(int i = 0; i < n; i++)
+		recs[i] = trace[(*first + i) % TRACE_LEN];
+	// the motor task may have lapped the reader while it copied, drop what it overwrote
+	uint32_t after = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	int skip = after - *first > TRACE_LEN ? MIN(n, (int)(after - *first - TRACE_LEN)) : 0;
+	memmove(recs, recs + skip, (n - skip) * sizeof(*recs));
+	*first += skip;
+	*head = after;
+	return n - skip;
+}
+
+// counts 'value' in the log2 histogram 'hist' of 'buckets' buckets
+static void hist_add(uint32_t *hist, int buckets, uint32_t value){
+	int bucket = 0;
+	while(bucket < buckets - 1 && (value >> (bucket + 1)) != 0)
+		bucket++;
+	hist[bucket]++;
+}
+
+// applies the setpoints waiting in the mailbox, recording how long each waited
+// the time is read after the slot is copied, so it is never before the setpoint was posted
+static void mbox_take(void){
+	for(int i = 0; i < NUM_TRAINS; i++){
+		portENTER_CRITICAL(&mbox_lock);
+		mbox_slot_t slot = mbox[i];
+		mbox[i].full = 0;
+		int64_t now_us = esp_timer_get_time();
+		if(slot.full){
+			uint32_t latency = MAX(now_us - slot.posted_us, 0);
+			hist_add(mbox_stats.latency, MBOX_LATENCY_BUCKETS, latency);
+			if(latency > mbox_stats.latency_max_us)
+				mbox_stats.latency_max_us = latency;
+		}
+		portEXIT_CRITICAL(&mbox_lock);
+		if(slot.full)
+			apply_duty(i, &slot, now_us);
+	}
+}
+
+// returns non-zero when 'a' is due before 'b'
+static int sched_before(const sched_entry_t *a, const sched_entry_t *b){
+	return a->at_us != b->at_us ? a->at_us < b->at_us : (int32_t)(a->order - b->order) < 0;
+}
+
+// puts 'e' at 'i' or below it, moving up children that are due sooner
+// caller must hold sched_lock
+static void sched_sift_down(int i, sched_entry_t e){
+	while(2 * i + 1 < sched_len){
+		int child = 2 * i + 1;
+		if(child + 1 < sched_len && sched_before(&sched[child + 1], &sched[child]))
+			child++;
+		if(!sched_before(&sched[child], &e))
+			break;
+		sched[i] = sched[child];
+		i = child;
+	}
+	sched[i] = e;
+}
+
+// carries out the scheduled setpoints that are due and arms sched_timer for the next
+// a fade starts at the time it was due rather than when the motor task got to it,
+// so trains scheduled together move together
+static void sched_take(void){
+	static int64_t armed_us;	// when sched_timer was last armed to fire
+	int64_t now_us = esp_timer_get_time();
+	int64_t next_us;
+	while(1){
+		portENTER_CRITICAL(&sched_lock);
+		if(sched_len == 0 || sched[0].at_us > now_us){
+			next_us = sched_len > 0 ? sched[0].at_us : 0;
+			portEXIT_CRITICAL(&sched_lock);
+			break;
+		}
+		sched_entry_t e = sched[0];
+		if(--sched_len > 0)
+			sched_sift_down(0, sched[sched_len]);
+		portEXIT_CRITICAL(&sched_lock);
+		apply_duty(e.train, &e.set, e.at_us);
+	}
+	if(next_us != armed_us){
+		esp_timer_stop(sched_timer);
+		if(next_us != 0)
+			esp_timer_start_once(sched_timer, next_us - now_us);
+		armed_us = next_us;
+	}
+}
+
+// advances the fade engine for every train, runs on the motor task every FADE_TICK_MS
+// modelled trains are stepped at exactly FADE_TICK_MS, however often the motor task is woken
+// a train whose controller's heartbeat is overdue is ramped down to a stop at its emergency rate
+static void fade_tick(void){
+	static int64_t next_step_us;	// when the models are due their next step
+	int32_t duty[NUM_TRAINS];
+	int64_t now_us = esp_timer_get_time();
+	int steps = 0;
+	if(next_step_us == 0)
+		next_step_us = now_us;
+	while(now_us >= next_step_us && steps < 10){
+		next_step_us += FADE_TICK_MS * 1000;
+		steps++;
+	}
+	if(now_us >= next_step_us)	// fell well behind, don't try to catch up
+		next_step_us = now_us + FADE_TICK_MS * 1000;
+	int32_t estop_from[NUM_TRAINS];
+	int estop_ms[NUM_TRAINS] = {0};
+	int settled[NUM_TRAINS];	// at the speed last asked for
+	portENTER_CRITICAL(&fade_lock);
+	for(int i = 0; i < NUM_TRAINS; i++){
+		train_t *t = &trains[i];
+		inertia_t *m = &t->inertia;
+		if(t->watchdog_us != 0 && now_us > t->watchdog_us){
+			int32_t from = m->cfg.enabled ? m->speed : fade_position(&t->fade, now_us);
+			int32_t to = m->cfg.enabled ? m->target : t->fade.to;
+			if(from != 0 || to != 0){
+				fade_start(&t->fade, 0, now_us, ((int64_t)abs(from) * t->estop_ms * 1000) / (100 * DUTY_SCALE));
+				m->target = 0;
+				m->start = m->speed;
+				m->estop_ms = t->estop_ms;
+				heartbeats_missed++;
+				estop_from[i] = from;
+				estop_ms[i] = MAX(t->estop_ms, 1);
+			}
+			t->watchdog_us = 0;
+		}
+		if(m->cfg.enabled){
+			if(m->speed != 0 || !reverse_dwell(t, m->target, now_us))
+				for(int s = 0; s < steps; s++)
+					inertia_step(m);
+			fade_start(&t->fade, m->speed, now_us, 0);
+		}
+		duty[i] = fade_position(&t->fade, now_us);
+		if(!m->cfg.enabled && reverse_dwell(t, duty[i], now_us))
+			duty[i] = 0;
+		if(duty[i] == 0 && t->zero_us == 0)
+			t->zero_us = now_us;
+		else if(duty[i] != 0)
+			t->zero_us = 0;
+		t->fade.now = duty[i];
+		settled[i] = m->cfg.enabled ? m->speed == m->target : duty[i] == t->fade.to;
+	}
+	portEXIT_CRITICAL(&fade_lock);
+	for(int i = 0; i < NUM_TRAINS; i++){
+		write_duty(&trains[i], duty[i]);
+		if(estop_ms[i] != 0)
+			trace_add(i, estop_from[i], 0, ((int64_t)abs(estop_from[i]) * estop_ms[i]) / (100 * DUTY_SCALE),
+					TRACE_SRC_HEARTBEAT, 0);
+	}
+	prog_tick(now_us, settled);
 }
 
-// sets duty when both initial and final duties are <= 0
+// runs the program of each train nobody controls until it has to wait, called at the end of fade_tick()
+// 'settled' is whether each train is at the speed last asked for
+// ramps are applied straight away, as if posted by set_duty()
+static void prog_tick(int64_t now_us, const int *settled){
+	mbox_slot_t sets[NUM_TRAINS] = {0};
+	portENTER_CRITICAL(&prog_lock);
+	for(int i = 0; i < NUM_TRAINS; i++){
+		prog_t *p = &progs[i];
+		if(!p->running || p->paused)
+			continue;
+		if(p->resume){	// back from a client, go back to the program's speed and start the step again
+			sets[i] = (mbox_slot_t){ .duty = p->duty, .source = TRACE_SRC_PROGRAM, .seq = p->pc, .full = 1 };
+			p->hold_us = 0;
+			p->resume = 0;
+		}
+		for(int steps = 0; steps < PROG_MAX_STEPS && p->running; steps++){
+			const uint8_t *op = p->prog.code + p->pc;
+			if(p->pc >= p->prog.len || op[0] == PROG_OP_END){
+				p->running = 0;
+				break;
+			}
+			if(op[0] == PROG_OP_HOLD){
+				if(p->hold_us == 0)
+					p->hold_us = now_us + (int64_t)proto_get32(op + 1) * 1000;
+				if(now_us < p->hold_us)
+					break;
+				p->hold_us = 0;
+			} else if(op[0] == PROG_OP_WAIT){
+				if(!settled[i] || sets[i].full)	// a ramp just asked for has not started yet
+					break;
+			} else if(op[0] == PROG_OP_RAMP){
+				p->duty = p->dir * (int16_t)proto_get16(op + 1) * (DUTY_SCALE / PROTO_DUTY_SCALE);
+				sets[i] = (mbox_slot_t){ .duty = p->duty, .time = proto_get32(op + 3), .source = TRACE_SRC_PROGRAM,
+						.seq = p->pc, .full = 1 };
+			} else if(op[0] == PROG_OP_REVERSE){
+				p->dir = -p->dir;
+			} else if(op[0] == PROG_OP_LOOP){
+				int l = 0;
+				while(p->prog.code + p->loop_pc[l] != op)	// set_program() noted every loop
+					l++;
+				if(op[2] == 0 || ++p->loop_runs[l] < op[2]){
+					p->pc = op[1];
+					continue;
+				}
+				p->loop_runs[l] = 0;
+			}
+			p->pc += prog_op_len(op[0]);
+		}
+	}
+	portEXIT_CRITICAL(&prog_lock);
+	for(int i = 0; i < NUM_TRAINS; i++)
+		if(sets[i].full)
+			apply_duty(i, &sets[i], now_us);
+}
+
+// runs the motors: applies new setpoints as soon as they are posted and advances the fades every FADE_TICK_MS
+static void motor_task(void *arg){
+	while(1){
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		sched_take();
+		mbox_take();
+		fade_tick();
+	}
+}
+
+// fade_timer and sched_timer callback, wakes the motor task for a fade tick or a scheduled setpoint
+static void motor_wake(void *arg){
+	xTaskNotifyGive(motor_task_handle);
+}
+
+// sets duty cycle of 'train' to 'duty' (scaled by DUTY_SCALE) with a fade time of 'time'
+// or 'MIN_DUTY_FADE_RATE'*change (whichever is larger)
+// the fade starts from wherever the motor is now, so a running fade is retargeted rather than waited for
+// fading through zero splits the time between directions in proportion to the duty on each side
+// returns immediately; the setpoint is posted to the motor task, replacing any it has not applied yet
+// 'source' and 'seq' say where it came from, for the trace
 // returns 0 when successful, non-zero otherwise
-static int set_duty_neg(int duty, int time){
-	int _duty = -1*(255*duty)/100;	// scale duty to correct precision
-	if(duty > 0){
-		ESP_LOGE(TAG, "set_duty_pos incorrectly used (duty pos)");
+static int set_duty(int train, int32_t duty, int time, int source, uint16_t seq){
+	if(train < 0 || train >= NUM_TRAINS || abs(duty) > 100 * DUTY_SCALE || time < 0){
+		ESP_LOGE(TAG, "set_duty invalid args (train %d, duty %d, time %d)", train, (int)duty, time);
 		return ESP_ERR_INVALID_ARG;
 	}
-	if(cur_duty > 0){
-		ESP_LOGE(TAG, "set_duty_pos incorrectly used (cur_duty pos");
-		return ESP_ERR_INVALID_STATE;
+	int64_t now_us = esp_timer_get_time();
+
+	portENTER_CRITICAL(&mbox_lock);
+	mbox_slot_t *slot = &mbox[train];
+	if(slot->full)
+		mbox_stats.dropped++;
+	slot->duty = duty;
+	slot->time = time;
+	slot->posted_us = now_us;
+	slot->source = source;
+	slot->seq = seq;
+	slot->full = 1;
+	mbox_stats.posted++;
+	int depth = 0;
+	for(int i = 0; i < NUM_TRAINS; i++)
+		depth += mbox[i].full;
+	if(depth > mbox_stats.depth_max)
+		mbox_stats.depth_max = depth;
+	portEXIT_CRITICAL(&mbox_lock);
+	xTaskNotifyGive(motor_task_handle);
+
+	LOG_COMMAND("Set train %d duty cycle to %s%d.%d%% over %d ms", train, duty < 0 ? "-" : "",
+			(int)(abs(duty) / DUTY_SCALE), (int)(abs(duty) % DUTY_SCALE) / (DUTY_SCALE / 10), time);
+	return ESP_OK;
+}
+
+// holds a setpoint for 'train' until esp_timer time 'at_us', when the motor task carries it out
+// one that is already due is posted straight away
+// returns 0 when successful, ESP_ERR_NO_MEM when SCHED_LEN are already waiting, non-zero otherwise
+static int schedule_duty(int train, int32_t duty, int time, int64_t at_us, uint16_t seq){
+	int64_t now_us = esp_timer_get_time();
+	if(train < 0 || train >= NUM_TRAINS || abs(duty) > 100 * DUTY_SCALE || time < 0 || at_us - now_us > SCHED_MAX_AHEAD_US){
+		ESP_LOGE(TAG, "schedule_duty invalid args (train %d, duty %d, time %d, in %lld us)", train, (int)duty, time,
+				(long long)(at_us - now_us));
+		return ESP_ERR_INVALID_ARG;
 	}
-	int success = ledc_set_fade_with_time(LEDC_LS_MODE, LEDC_LS_CH1_CHANNEL, _duty, time);
-	if(success == ESP_OK)
-		success = ledc_fade_start(LEDC_LS_MODE, LEDC_LS_CH1_CHANNEL, LEDC_FADE_WAIT_DONE);
-    if(success == ESP_OK){
-    	cur_duty = duty;
-    }
-    return success;
+	if(at_us <= now_us)
+		return set_duty(train, duty, time, TRACE_SRC_SCHEDULED, seq);
+
+	portENTER_CRITICAL(&sched_lock);
+	if(sched_len == SCHED_LEN){
+		portEXIT_CRITICAL(&sched_lock);
+		return ESP_ERR_NO_MEM;
+	}
+	sched_entry_t e = {
+		.at_us = at_us,
+		.order = sched_order++,
+		.train = train,
+		.set = { .duty = duty, .time = time, .posted_us = now_us, .source = TRACE_SRC_SCHEDULED, .seq = seq, .full = 1 },
+	};
+	int i = sched_len++;
+	sched_peak = MAX(sched_peak, sched_len);
+	while(i > 0 && sched_before(&e, &sched[(i - 1) / 2])){
+		sched[i] = sched[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	sched[i] = e;
+	portEXIT_CRITICAL(&sched_lock);
+	xTaskNotifyGive(motor_task_handle);	// to arm sched_timer if this is now the earliest
+
+	LOG_COMMAND("Set train %d duty cycle to %s%d.%d%% over %d ms in %lld us", train, duty < 0 ? "-" : "",
+			(int)(abs(duty) / DUTY_SCALE), (int)(abs(duty) % DUTY_SCALE) / (DUTY_SCALE / 10), time,
+			(long long)(at_us - now_us));
+	return ESP_OK;
 }
 
-// sets motor duty cycle to 'duty' with a fade time of 'time' or 'MIN_DUTY_FADE_RATE'*change (whichever is larger)
+// drops every setpoint scheduled for 'train', once another client takes it they are no longer wanted
+static void sched_cancel(int train){
+	portENTER_CRITICAL(&sched_lock);
+	int n = 0;
+	for(int i = 0; i < sched_len; i++)
+		if(sched[i].train != train)
+			sched[n++] = sched[i];
+	sched_len = n;
+	for(int i = n / 2 - 1; i >= 0; i--)
+		sched_sift_down(i, sched[i]);
+	portEXIT_CRITICAL(&sched_lock);
+}
+
+// copies the mailbox statistics and the number of setpoints waiting right now
+static void get_mbox_stats(mbox_stats_t *stats, int *depth){
+	portENTER_CRITICAL(&mbox_lock);
+	*stats = mbox_stats;
+	*depth = 0;
+	for(int i = 0; i < NUM_TRAINS; i++)
+		*depth += mbox[i].full;
+	portEXIT_CRITICAL(&mbox_lock);
+}
+
+// returns current duty of 'train' scaled by DUTY_SCALE, 0 for a train that does not exist
+static int32_t get_duty(int train){
+	if(train < 0 || train >= NUM_TRAINS)
+		return 0;
+	portENTER_CRITICAL(&fade_lock);
+	int32_t duty = trains[train].fade.now;
+	portEXIT_CRITICAL(&fade_lock);
+	return duty;
+}
+
+// reports the live state of a train's fade: the duty interpolated to this instant,
+// the duty it is fading to, how much of the fade is done in percent and how long is left of it
+// a modelled train's time left is at the rate it is changing speed now, and 'modelled' is set
+// a fade crossing zero that reverse_dwell() will hold there on the next tick is reported held already
+// from the last step of the frame's resolution before zero, the motor never sees the duty in between
+static void get_fade(int train, int32_t *duty, int32_t *target, int *progress, uint32_t *remaining_ms, int *modelled){
+	const train_t *t = &trains[train];
+	const fade_t *f = &t->fade;
+	int64_t now_us = esp_timer_get_time();
+	const inertia_t *m = &t->inertia;
+	portENTER_CRITICAL(&fade_lock);
+	*modelled = m->cfg.enabled;
+	if(m->cfg.enabled){
+		int away = (m->speed >= 0 && m->target > m->speed) || (m->speed <= 0 && m->target < m->speed);
+		*duty = m->speed;
+		*target = m->target;
+		*progress = m->target == m->start ? 100 : (int)(((int64_t)(m->speed - m->start) * 100) / (m->target - m->start));
+		*remaining_ms = ((int64_t)abs(m->target - m->speed) * FADE_TICK_MS) / inertia_step_size(m, away);
+	} else {
+		int64_t elapsed = now_us - f->start_us;
+		*duty = fade_position(f, now_us);
+		*target = f->to;
+		*progress = elapsed >= f->len_us ? 100 : elapsed <= 0 ? 0 : (int)((elapsed * 100) / f->len_us);
+		*remaining_ms = elapsed >= f->len_us ? 0 : (f->len_us - elapsed + 999) / 1000;
+		int64_t until_us = (t->zero_us != 0 ? t->zero_us : now_us) + (int64_t)t->motor_cfg.dwell_ms * 1000;
+		int reversing = elapsed >= 0 && elapsed < f->len_us && f->to != 0 && (f->to > 0) != (t->dir > 0);
+		int at_zero = abs(*duty) < DUTY_SCALE / PROTO_DUTY_SCALE;	// as far as the frame can tell
+		if(reversing && (at_zero || (*duty > 0) == (f->to > 0)) && now_us < until_us){
+			*duty = 0;
+			*progress = 0;
+			*remaining_ms += (until_us - now_us) / 1000;
+		}
+	}
+	portEXIT_CRITICAL(&fade_lock);
+}
+
+// reads the blob for 'train' in nvs namespace 'space', exactly 'len' bytes
+// returns 0 when successful, non-zero when there is none or it is not the expected size
+static esp_err_t nvs_load(const char *space, int train, void *blob, size_t len){
+	nvs_handle_t nvs;
+	char key[16];
+	size_t got = len;
+	snprintf(key, sizeof(key), "train%d", train);
+	esp_err_t err = nvs_open(space, NVS_READONLY, &nvs);
+	if(err != ESP_OK)
+		return err;
+	err = nvs_get_blob(nvs, key, blob, &got);
+	nvs_close(nvs);
+	if(err == ESP_OK && got != len)
+		err = ESP_ERR_INVALID_SIZE;
+	return err;
+}
+
+// saves the blob for 'train' in nvs namespace 'space'
 // returns 0 when successful, non-zero otherwise
-static int set_duty(int duty, int time){
-	int duty_delta = duty > cur_duty ? duty - cur_duty : cur_duty - duty;
-	int min_fade_time = duty == 0 ? 1 : duty_delta * MIN_FADE_RATE;
-	int fade_time = time > min_fade_time ? time : min_fade_time;
-	int success = 0;
-	if(cur_duty >= 0 && duty >= 0){
-		success = set_duty_pos(duty, fade_time);
+static esp_err_t nvs_save(const char *space, int train, const void *blob, size_t len){
+	nvs_handle_t nvs;
+	char key[16];
+	snprintf(key, sizeof(key), "train%d", train);
+	esp_err_t err = nvs_open(space, NVS_READWRITE, &nvs);
+	if(err == ESP_OK){
+		err = nvs_set_blob(nvs, key, blob, len);
+		if(err == ESP_OK)
+			err = nvs_commit(nvs);
+		nvs_close(nvs);
 	}
-	else if(cur_duty <= 0 && duty <= 0){
-		success = set_duty_neg(duty, fade_time);
+	if(err != ESP_OK)
+		ESP_LOGW(TAG, "Could not save %s of train %d: %d", space, train, err);
+	return err;
+}
+
+// reads the dynamics, speed curve, pwm profile, bridge settings and program of every train from nvs, leaving the defaults for any not saved
+// and starting the programs that were running
+static void load_train_settings(void){
+	static const uint16_t cal_default[CURVE_CAL_POINTS] = CURVE_CAL_DEFAULT;
+	for(int i = 0; i < NUM_TRAINS; i++){
+		inertia_cfg_t cfg;
+		uint8_t curve, profile;
+		curve_cfg_t curve_cfg;
+		motor_cfg_t motor;
+		if(nvs_load(INERTIA_NVS, i, &cfg, sizeof(cfg)) == ESP_OK && cfg.mass != 0 && cfg.accel != 0 && cfg.brake != 0)
+			trains[i].inertia.cfg = cfg;	// what set_inertia() accepts, the model divides by them
+		memcpy(trains[i].cal_points, cal_default, sizeof(cal_default));
+		if(nvs_load(CURVE_NVS, i, &curve_cfg, sizeof(curve_cfg)) == ESP_OK && curve_cfg.curve < CURVE_COUNT &&
+				curve_cal_sound(curve_cfg.cal_points)){
+			trains[i].curve = curve_cfg.curve;
+			memcpy(trains[i].cal_points, curve_cfg.cal_points, sizeof(curve_cfg.cal_points));
+		} else if(nvs_load(CURVE_NVS, i, &curve, sizeof(curve)) == ESP_OK && curve < CURVE_COUNT)
+			trains[i].curve = curve;	// saved before each train had its own calibration
+		curve_calibrate(trains[i].cal_curve[trains[i].cal_live], trains[i].cal_points);
+		if(nvs_load(PWM_NVS, i, &profile, sizeof(profile)) == ESP_OK && profile < PWM_PROFILE_COUNT)
+			trains[i].profile = profile;
+		if(nvs_load(MOTOR_NVS, i, &motor, sizeof(motor)) == ESP_OK && motor.stop_mode <= MOTOR_BRAKE)
+			trains[i].motor_cfg = motor;
+		prog_t *p = &progs[i];
+		if(nvs_load(PROGRAM_NVS, i, &p->prog, sizeof(p->prog)) != ESP_OK ||
+				prog_check(p->prog.code, p->prog.len, p->loop_pc) != ESP_OK)
+			memset(&p->prog, 0, sizeof(p->prog));
+		p->running = p->prog.run;
+		p->dir = 1;
 	}
-	else if(cur_duty > 0 && duty < 0){
-		int pos_time = (((cur_duty*1000)/duty_delta)*fade_time)/1000;
-		int neg_time  = (-1*((duty*1000)/duty_delta)*fade_time)/1000;
-		success = set_duty_pos(0, pos_time);
-		if(success == ESP_OK){
-			success = set_duty_neg(duty, neg_time);
-		}
+}
+
+// changes the dynamics of 'train' and saves them to nvs
+// a train switched between models carries on from its current speed
+// returns 0 when successful, non-zero otherwise
+static int set_inertia(int train, const inertia_cfg_t *cfg){
+	if(train < 0 || train >= NUM_TRAINS || cfg->mass == 0 || cfg->accel == 0 || cfg->brake == 0)
+		return ESP_ERR_INVALID_ARG;
+	train_t *t = &trains[train];
+	inertia_t *m = &t->inertia;
+	int64_t now_us = esp_timer_get_time();
+	portENTER_CRITICAL(&fade_lock);
+	if(cfg->enabled && !m->cfg.enabled){
+		m->speed = fade_position(&t->fade, now_us);
+		m->start = m->speed;
+		m->target = t->fade.to;
+		m->estop_ms = 0;
+	} else if(!cfg->enabled && m->cfg.enabled){
+		int duty_delta = abs(m->target - m->speed);
+		fade_start(&t->fade, m->target, now_us, ((int64_t)duty_delta * MIN_FADE_RATE * 1000) / DUTY_SCALE);
+	}
+	m->cfg = *cfg;
+	portEXIT_CRITICAL(&fade_lock);
+
+	nvs_save(INERTIA_NVS, train, cfg, sizeof(*cfg));
+	ESP_LOGI(TAG, "Train %d dynamics %s: mass %d%% accel %d brake %d grade %d", train, cfg->enabled ? "on" : "off",
+			cfg->mass, cfg->accel, cfg->brake, cfg->grade);
+	return ESP_OK;
+}
+
+// selects the speed curve of 'train', calibrates it to 'points' unless that is NULL, and saves both to nvs
+// a new calibration is built in the table the motor task is not reading and swapped in once it is whole
+// returns 0 when successful, non-zero otherwise
+static int set_curve(int train, int curve, const uint16_t *points){
+	if(train < 0 || train >= NUM_TRAINS || curve < 0 || curve >= CURVE_COUNT || (points != NULL && !curve_cal_sound(points)))
+		return ESP_ERR_INVALID_ARG;
+	train_t *t = &trains[train];
+	if(points != NULL){
+		int idle = !t->cal_live;
+		memcpy(t->cal_points, points, sizeof(t->cal_points));
+		curve_calibrate(t->cal_curve[idle], points);
+		__atomic_store_n(&t->cal_live, idle, __ATOMIC_RELEASE);
 	}
-	else if(cur_duty < 0 && duty > 0){
-		int neg_time = (-1*((cur_duty*1000)/duty_delta)*fade_time)/1000;
-		int pos_time = (((duty*1000)/duty_delta)*fade_time)/1000;
-		success |= set_duty_neg(0, neg_time);
-		if(success == ESP_OK){
-			success = set_duty_pos(duty, pos_time);
+	t->curve = curve;	// a single byte, read by the motor task on its next tick
+	curve_cfg_t saved = { .curve = curve };
+	memcpy(saved.cal_points, t->cal_points, sizeof(saved.cal_points));
+	nvs_save(CURVE_NVS, train, &saved, sizeof(saved));
+	ESP_LOGI(TAG, "Train %d uses speed curve %d%s", train, curve, points != NULL ? ", newly calibrated" : "");
+	return ESP_OK;
+}
+
+// selects the pwm profile of 'train' and saves it to nvs
+// the motor task moves the train's channel to the profile's timer on its next tick
+// returns 0 when successful, non-zero otherwise
+static int set_pwm(int train, int profile){
+	if(train < 0 || train >= NUM_TRAINS || profile < 0 || profile >= PWM_PROFILE_COUNT)
+		return ESP_ERR_INVALID_ARG;
+	uint8_t saved = profile;
+	trains[train].profile = profile;	// a single byte, like the curve
+	nvs_save(PWM_NVS, train, &saved, sizeof(saved));
+	ESP_LOGI(TAG, "Train %d runs at %u Hz with %d bit duty", train, (unsigned)pwm_profiles[profile].freq_hz,
+			pwm_profiles[profile].bits);
+	return ESP_OK;
+}
+
+// checks 'code' is a program prog_tick() can run: whole steps, duties and times in range
+// and loops back to the start of an earlier step
+// notes the offset of each loop in 'loop_pc'
+// returns 0 when it can be run, non-zero otherwise
+static int prog_check(const uint8_t *code, int len, uint8_t *loop_pc){
+	uint8_t starts[PROG_MAX_LEN] = {0};	// offsets steps start at
+	int loops = 0;
+	if(len > PROG_MAX_LEN)
+		return ESP_ERR_INVALID_SIZE;
+	for(int pc = 0; pc < len; pc += prog_op_len(code[pc])){
+		const uint8_t *op = code + pc;
+		int n = prog_op_len(op[0]);
+		if(n == 0 || pc + n > len)
+			return ESP_ERR_INVALID_ARG;
+		starts[pc] = 1;
+		if(op[0] == PROG_OP_RAMP && (abs((int16_t)proto_get16(op + 1)) > 100 * PROTO_DUTY_SCALE ||
+				proto_get32(op + 3) > INT32_MAX / 1000))
+			return ESP_ERR_INVALID_ARG;
+		if(op[0] == PROG_OP_HOLD && proto_get32(op + 1) > INT32_MAX / 1000)
+			return ESP_ERR_INVALID_ARG;
+		if(op[0] == PROG_OP_LOOP){
+			if(loops == PROG_MAX_LOOPS || op[1] >= pc || !starts[op[1]])
+				return ESP_ERR_INVALID_ARG;
+			loop_pc[loops++] = pc;
 		}
 	}
+	return ESP_OK;
+}
 
-	if(success == ESP_OK)
-		ESP_LOGI(TAG, "Set duty cycle to %d%%", duty);
-	return success;
+// sets how the h-bridge of 'train' stops and how long it rests at zero when reversing, and saves it to nvs
+// returns 0 when successful, non-zero otherwise
+static int set_motor(int train, const motor_cfg_t *cfg){
+	if(train < 0 || train >= NUM_TRAINS || (cfg->stop_mode != MOTOR_COAST && cfg->stop_mode != MOTOR_BRAKE))
+		return ESP_ERR_INVALID_ARG;
+	portENTER_CRITICAL(&fade_lock);
+	trains[train].motor_cfg = *cfg;
+	portEXIT_CRITICAL(&fade_lock);
+	nvs_save(MOTOR_NVS, train, cfg, sizeof(*cfg));
+	ESP_LOGI(TAG, "Train %d %s when stopped and rests %d ms when reversing", train,
+			cfg->stop_mode == MOTOR_BRAKE ? "brakes" : "coasts", cfg->dwell_ms);
+	return ESP_OK;
 }
 
-// returns current duty
-static int get_duty(void){
-	return cur_duty;
+// brakes 'train' to a stop at once, whoever is driving it
+// its program is stopped and anything scheduled for it dropped, so nothing starts it again behind the
+// operator's back; the setpoint goes through the mailbox like any other and is applied as soon as the
+// motor task wakes, which it is told to straight away
+static void emergency_stop(int train, uint16_t seq){
+	sched_cancel(train);
+	run_program(train, 0);
+	set_duty(train, 0, 0, TRACE_SRC_ESTOP, seq);	// replaces the program's stop, if it posted one
+	ESP_LOGW(TAG, "Emergency stop of train %d", train);
+}
+
+// replaces the program of 'train' and saves it to nvs, stopping the old one
+// returns 0 when successful, non-zero otherwise
+static int set_program(int train, const uint8_t *code, int len){
+	prog_code_t prog = { .len = len };
+	uint8_t loop_pc[PROG_MAX_LOOPS];
+	if(train < 0 || train >= NUM_TRAINS || prog_check(code, len, loop_pc) != ESP_OK)
+		return ESP_ERR_INVALID_ARG;
+	run_program(train, 0);
+	memcpy(prog.code, code, len);
+	portENTER_CRITICAL(&prog_lock);
+	progs[train].prog = prog;
+	memcpy(progs[train].loop_pc, loop_pc, sizeof(loop_pc));
+	portEXIT_CRITICAL(&prog_lock);
+	nvs_save(PROGRAM_NVS, train, &prog, sizeof(prog));
+	ESP_LOGI(TAG, "Train %d has a new program of %d bytes", train, len);
+	return ESP_OK;
+}
+
+// starts the program of 'train' from the beginning, or stops it, and saves whether it runs to nvs
+// a train the program was driving is ramped down to a stop
+// returns 0 when successful, non-zero otherwise
+static int run_program(int train, int run){
+	if(train < 0 || train >= NUM_TRAINS)
+		return ESP_ERR_INVALID_ARG;
+	prog_t *p = &progs[train];
+	portENTER_CRITICAL(&prog_lock);
+	int was_running = p->running;
+	int driving = p->running && !p->paused;
+	p->running = run;
+	p->paused = 0;
+	p->resume = 0;
+	p->pc = 0;
+	p->dir = 1;
+	p->duty = 0;
+	p->hold_us = 0;
+	memset(p->loop_runs, 0, sizeof(p->loop_runs));
+	int changed = p->prog.run != run;
+	p->prog.run = run;
+	prog_code_t prog = p->prog;
+	portEXIT_CRITICAL(&prog_lock);
+	if(driving && !run)
+		set_duty(train, 0, 0, TRACE_SRC_PROGRAM, 0);
+	if(changed)
+		nvs_save(PROGRAM_NVS, train, &prog, sizeof(prog));
+	if(run || was_running)
+		ESP_LOGI(TAG, "Train %d program %s", train, run ? "running" : "stopped");
+	return ESP_OK;
+}
+
+// pauses the program of 'train' while a client controls it and resumes it once nobody does
+static void pause_program(int train, int paused){
+	prog_t *p = &progs[train];
+	portENTER_CRITICAL(&prog_lock);
+	if(p->running && p->paused != paused){
+		p->paused = paused;
+		p->resume = !paused;
+		ESP_LOGI(TAG, "Train %d program %s", train, paused ? "paused" : "resumed");
+	}
+	portEXIT_CRITICAL(&prog_lock);
+}
+
+// copies the dynamics of 'train'
+static void get_inertia(int train, inertia_cfg_t *cfg){
+	portENTER_CRITICAL(&fade_lock);
+	*cfg = trains[train].inertia.cfg;
+	portEXIT_CRITICAL(&fade_lock);
 }
 
 // send() can return less bytes than supplied length.
-// Walk-around for robust implementation.
-static int tcp_server_send(int sock, char *buf){
-    int send_len = strlen(buf);
-    int to_write = send_len;
+// sends as much of buf as the socket will take without blocking
+// returns the number of bytes sent or -1 on error
+static int tcp_server_send(int sock, const void *buf, int len){
+    const char *p = buf;
+    int to_write = len;
+    int64_t start_us = esp_timer_get_time();
     while (to_write > 0) {
-        int written = send(sock, buf + (send_len - to_write), to_write, 0);
+        int written = send(sock, p + (len - to_write), to_write, 0);
         if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-            return errno;
+            return -1;
         }
         to_write -= written;
-        ESP_LOGI(TAG, "sent %d bytes", written);
-        ESP_LOGI(TAG, "len == %d", send_len);
+        LOG_PACKET("sent %d of %d bytes", written, len);
     }
-    return 0;
+    stats.bytes_tx += len - to_write;
+    hist_add(stats.send_us, STATS_BUCKETS, esp_timer_get_time() - start_us);
+    return len - to_write;
 }
 
-enum {GET, SET};
+// sends as many queued replies as the socket will take, the rest wait until it is writable
+// returns 0 when successful, non-zero otherwise
+static int conn_flush(conn_t *c){
+	if(c->tx_len == 0)
+		return 0;
+	int sent = tcp_server_send(c->sock, c->tx, c->tx_len);
+	if(sent < 0)
+		return errno;
+	memmove(c->tx, c->tx + sent, c->tx_len - sent);
+	c->tx_len -= sent;
+	return 0;
+}
 
-// recivies and executes commands from client, returns response
-static void tcp_server_talk(int sock){
-    int recv_len;
-    char rx_buffer[128];
-
-    do {
-        recv_len = recv(sock, rx_buffer, sizeof(rx_buffer) - 1, 0);
-        if (recv_len < 0) {
-            ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
-        } else if (recv_len == 0) {
-            ESP_LOGW(TAG, "Connection closed");
-        } else {
-            rx_buffer[recv_len] = 0; // Null-terminate whatever is received and treat it like a string
-            ESP_LOGI(TAG, "Received %d bytes: %s", recv_len, rx_buffer);
-
-            char *cmd_str = strtok(rx_buffer, " ");
-            int cmd = atoi(cmd_str);
-            char tx_buffer[32];
-            switch(cmd){
-				case GET:{	// get current duty cycle
-					sprintf(tx_buffer, "%d", get_duty());
-					tcp_server_send(sock, tx_buffer);
+// queues 'len' bytes to the client, replies go out together once the receive buffer has been parsed
+// returns 0 when successful, non-zero when the client is too far behind to take them
+static int conn_queue(conn_t *c, const void *buf, int len){
+	if(c->tx_len + len > sizeof(c->tx))
+		conn_flush(c);
+	if(c->tx_len + len > sizeof(c->tx))
+		return ESP_ERR_NO_MEM;
+	memcpy(c->tx + c->tx_len, buf, len);
+	c->tx_len += len;
+	return 0;
+}
+
+// queues a frame to the client
+// returns 0 when successful, non-zero when the client is too far behind to take it
+static int conn_reply(conn_t *c, uint8_t type, uint8_t train, uint16_t seq, const uint8_t *payload, uint8_t len){
+	uint8_t frame[PROTO_MAX_FRAME];
+	return conn_queue(c, frame, proto_encode(frame, type, train, seq, payload, len));
+}
+
+// acknowledges command 'f' with 'status' followed by 'len' bytes of reply data
+// a client that cannot take its acks is disconnected
+static void conn_ack(conn_t *c, const proto_frame_t *f, uint8_t status, const uint8_t *data, uint8_t len){
+	uint8_t payload[PROTO_MAX_PAYLOAD];
+	payload[0] = status;
+	if(status != PROTO_OK)
+		stats.nacks++;
+	if(len > 0)
+		memcpy(payload + 1, data, len);
+	if(conn_reply(c, MSG_ACK, f->train, f->seq, payload, 1 + len) != 0)
+		c->overflow = 1;
+}
+
+// sets the watchdog of 'train' from the heartbeat of its controller 'c', or disarms it when 'c' is NULL
+static void arm_watchdog(int train, const conn_t *c){
+	portENTER_CRITICAL(&fade_lock);
+	trains[train].watchdog_us = c != NULL && c->heartbeat_us != 0 ? c->last_rx_us + c->heartbeat_us : 0;
+	trains[train].estop_ms = c != NULL ? c->estop_ms : 0;
+	portEXIT_CRITICAL(&fade_lock);
+}
+
+// notes that the client was heard from, re-arming the watchdogs of the trains it controls
+static void conn_heard(conn_t *c){
+	int64_t now_us = esp_timer_get_time();
+	if(c->heartbeat_us != 0 && now_us - c->last_rx_us > c->heartbeat_us * 2 / 3)
+		heartbeats_late++;
+	c->last_rx_us = now_us;
+	if(c->heartbeat_us == 0)
+		return;
+	for(int i = 0; i < NUM_TRAINS; i++)
+		if(train_owner[i] == c)
+			arm_watchdog(i, c);
+}
+
+// makes 'c' the controller of 'train' if nobody else is, or regardless when 'force' is set
+// returns 0 when successful, non-zero otherwise
+static int take_train(conn_t *c, int train, int force){
+	if(train < 0 || train >= NUM_TRAINS)
+		return PROTO_ERR_ARG;
+	if(train_owner[train] != NULL && train_owner[train] != c && !force)
+		return PROTO_ERR_BUSY;
+	if(train_owner[train] != c){
+		ESP_LOGI(TAG, "Client %d takes train %d", c->sock, train);
+		udp_trains[train].have_seq = 0;		// the new controller numbers its throttles afresh
+		sched_cancel(train);
+		pause_program(train, 1);
+	}
+	train_owner[train] = c;
+	arm_watchdog(train, c);
+	return PROTO_OK;
+}
+
+// sets duty of a train on behalf of its controller, now or at esp_timer time 'at_us' when it is not 0,
+// remembering the direction for udp throttles
+static int drive_train(int train, int32_t duty, int time, int64_t at_us, int source, uint16_t seq){
+	int err = at_us != 0 ? schedule_duty(train, duty, time, at_us, seq) : set_duty(train, duty, time, source, seq);
+	if(err == ESP_OK && duty != 0)
+		train_dir[train] = duty > 0 ? 1 : -1;
+	return err;
+}
+
+// applies throttle datagrams waiting on the udp control port
+// only the newest throttle for a train matters, so anything older than one already applied is dropped
+static void udp_server_recv(int udp_sock){
+	uint8_t buf[PROTO_MAX_FRAME];
+	while(1){
+		int len = recv(udp_sock, buf, sizeof(buf), 0);
+		if(len < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				ESP_LOGE(TAG, "Error occurred during udp receive: errno %d", errno);
+			return;
+		}
+		proto_frame_t f;
+		stats.udp_rx++;
+		if(proto_decode(buf, len, &f) <= 0 || f.type != MSG_THROTTLE || f.len < 6 || f.train >= NUM_TRAINS){
+			stats.parse_errors++;
+			continue;
+		}
+		udp_train_t *u = &udp_trains[f.train];
+		conn_t *owner = train_owner[f.train];
+		if(owner == NULL || owner->token != proto_get32(f.payload)){
+			u->rejected++;
+			continue;
+		}
+		int16_t ahead = (int16_t)(f.seq - u->seq);
+		if(u->have_seq && ahead <= 0){
+			u->stale++;
+			continue;
+		}
+		if(u->have_seq && ahead > 1)
+			u->lost += ahead - 1;
+		u->seq = f.seq;
+		u->have_seq = 1;
+		u->received++;
+		conn_heard(owner);
+		int32_t throttle = proto_get16(f.payload + 4) * (DUTY_SCALE / PROTO_DUTY_SCALE);
+		if(throttle <= 100 * DUTY_SCALE)
+			set_duty(f.train, train_dir[f.train] * throttle, 0, TRACE_SRC_UDP, f.seq);
+	}
+}
+
+// executes one binary command and queues its ack
+static void handle_frame(conn_t *c, const proto_frame_t *f){
+	uint8_t reply[PROTO_MAX_PAYLOAD - 1];
+	if(!c->binary && f->type != MSG_HELLO){
+		conn_ack(c, f, PROTO_ERR_HANDSHAKE, NULL, 0);
+		return;
+	}
+	switch(f->type){
+		case MSG_HELLO:{	// switch to frames, answer with the version both sides speak
+			if(f->len < 1){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			c->binary = 1;
+			reply[0] = f->payload[0] < PROTO_VERSION ? f->payload[0] : PROTO_VERSION;
+			reply[1] = NUM_TRAINS;
+			proto_put32(reply + 2, c->token);
+			conn_reply(c, MSG_HELLO, 0, f->seq, reply, 6);
+			ESP_LOGI(TAG, "Client speaks protocol version %d", reply[0]);
+			break;
+		}
+		case MSG_GET:{	// get current duty cycle of train
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			proto_put16(reply, (int16_t)(get_duty(f->train) / (DUTY_SCALE / PROTO_DUTY_SCALE)));
+			conn_ack(c, f, PROTO_OK, reply, 2);
+			break;
+		}
+		case MSG_SET:{	// set duty cycle of train to 'duty' with 'fade_ms' fade, at 'at_us' if given
+			if(f->len < 6 || (f->len > 6 && f->len < 14)){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			int32_t duty = (int16_t)proto_get16(f->payload) * (DUTY_SCALE / PROTO_DUTY_SCALE);
+			uint32_t time = proto_get32(f->payload + 2);
+			int64_t at_us = f->len >= 14 ? (int64_t)proto_get64(f->payload + 6) : 0;
+			int status = take_train(c, f->train, 0);	// a train nobody controls is taken by driving it
+			if(status == PROTO_ERR_BUSY)
+				status = PROTO_ERR_OWNER;
+			if(status == PROTO_OK){
+				int err = time > INT32_MAX / 1000 ? ESP_ERR_INVALID_ARG :
+						drive_train(f->train, duty, time, at_us, TRACE_SRC_FRAME, f->seq);
+				if(err == ESP_ERR_NO_MEM)
+					status = PROTO_ERR_FULL;
+				else if(err != ESP_OK)
+					status = PROTO_ERR_ARG;
+			}
+			conn_ack(c, f, status, NULL, 0);
+			break;
+		}
+		case MSG_PROGRAM:{	// load, run or stop the program of a train, or just report it when the payload is empty
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			if(f->len >= 1){
+				int err = ESP_ERR_INVALID_ARG;
+				if(train_owner[f->train] != NULL && train_owner[f->train] != c){
+					conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
 					break;
 				}
-				case SET:{	// set duty cycle to 'duty' with 'time' fade
-					char *duty_str = strtok(NULL, " ");
-					char *time_str = strtok(NULL, " ");
-					int duty = atoi(duty_str);
-					int time = atoi(time_str);
-					set_duty(duty, time);
+				if(f->payload[0] == PROG_RUN){
+					sched_cancel(f->train);	// a set still scheduled would cut into the program once it came due
+					if(train_owner[f->train] == c){	// hand the train over to the program
+						train_owner[f->train] = NULL;
+						arm_watchdog(f->train, NULL);
+					}
+				}
+				if(f->payload[0] == PROG_LOAD)
+					err = set_program(f->train, f->payload + 1, f->len - 1);
+				else if(f->payload[0] == PROG_RUN || f->payload[0] == PROG_STOP)
+					err = run_program(f->train, f->payload[0] == PROG_RUN);
+				if(err != ESP_OK){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
 					break;
 				}
-            }
+			}
+			portENTER_CRITICAL(&prog_lock);
+			const prog_t *p = &progs[f->train];
+			reply[0] = !p->running ? PROG_STATE_STOPPED : p->paused ? PROG_STATE_PAUSED : PROG_STATE_RUNNING;
+			reply[1] = p->pc;
+			reply[2] = p->prog.len;
+			memcpy(reply + 3, p->prog.code, p->prog.len);
+			portEXIT_CRITICAL(&prog_lock);
+			conn_ack(c, f, PROTO_OK, reply, 3 + reply[2]);
+			break;
+		}
+		case MSG_TIME:{	// the server's clock, for the client to work out scheduled times
+			proto_put64(reply, esp_timer_get_time());
+			conn_ack(c, f, PROTO_OK, reply, 8);
+			break;
+		}
+		case MSG_TAKE:{	// become the controller of a train, taking it from its controller if 'force' is set
+			int force = f->len >= 1 && f->payload[0];
+			conn_ack(c, f, take_train(c, f->train, force), NULL, 0);
+			break;
+		}
+		case MSG_RELEASE:{	// give up control of a train, it keeps running
+			if(f->train >= NUM_TRAINS || train_owner[f->train] != c){
+				conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
+				break;
+			}
+			train_owner[f->train] = NULL;
+			arm_watchdog(f->train, NULL);
+			pause_program(f->train, 0);
+			ESP_LOGI(TAG, "Client %d releases train %d", c->sock, f->train);
+			conn_ack(c, f, PROTO_OK, NULL, 0);
+			break;
+		}
+		case MSG_UDP_STATS:{	// how the train's udp throttles have fared
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			const udp_train_t *u = &udp_trains[f->train];
+			proto_put32(reply, u->received);
+			proto_put32(reply + 4, u->lost);
+			proto_put32(reply + 8, u->stale);
+			proto_put32(reply + 12, u->rejected);
+			conn_ack(c, f, PROTO_OK, reply, 16);
+			break;
+		}
+		case MSG_HEARTBEAT_CFG:{	// expect to hear from the client every 'deadline_ms', stopping its trains over 'estop_ms' if not
+			if(f->len >= 4){
+				int deadline = proto_get16(f->payload);
+				int estop = proto_get16(f->payload + 2);
+				if(deadline != 0 && deadline < HEARTBEAT_MIN_MS){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+					break;
+				}
+				c->heartbeat_us = (int64_t)deadline * 1000;
+				c->estop_ms = estop != 0 ? estop : ESTOP_MS;
+				for(int i = 0; i < NUM_TRAINS; i++)
+					if(train_owner[i] == c)
+						arm_watchdog(i, c);
+			} else if(f->len != 0){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			portENTER_CRITICAL(&fade_lock);
+			uint32_t missed = heartbeats_missed;
+			portEXIT_CRITICAL(&fade_lock);
+			proto_put16(reply, c->heartbeat_us / 1000);
+			proto_put16(reply + 2, c->estop_ms);
+			proto_put32(reply + 4, heartbeats_late);
+			proto_put32(reply + 8, missed);
+			conn_ack(c, f, PROTO_OK, reply, 12);
+			break;
+		}
+		case MSG_INERTIA:{	// set the dynamics of a train, or just report them when the payload is empty
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			inertia_cfg_t cfg;
+			if(f->len >= 9){
+				if(train_owner[f->train] != NULL && train_owner[f->train] != c){
+					conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
+					break;
+				}
+				cfg.enabled = f->payload[0];
+				cfg.mass = proto_get16(f->payload + 1);
+				cfg.accel = proto_get16(f->payload + 3);
+				cfg.brake = proto_get16(f->payload + 5);
+				cfg.grade = (int16_t)proto_get16(f->payload + 7);
+				if(set_inertia(f->train, &cfg) != ESP_OK){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+					break;
+				}
+			} else if(f->len != 0){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			get_inertia(f->train, &cfg);
+			reply[0] = cfg.enabled;
+			proto_put16(reply + 1, cfg.mass);
+			proto_put16(reply + 3, cfg.accel);
+			proto_put16(reply + 5, cfg.brake);
+			proto_put16(reply + 7, cfg.grade);
+			conn_ack(c, f, PROTO_OK, reply, 9);
+			break;
+		}
+		case MSG_CURVE:{	// select the speed curve of a train, or just report it when the payload is empty
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			if(f->len >= 1){
+				if(train_owner[f->train] != NULL && train_owner[f->train] != c){
+					conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
+					break;
+				}
+				if(f->len != 1 && f->len != 1 + 2 * CURVE_CAL_POINTS){
+					conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+					break;
+				}
+				uint16_t points[CURVE_CAL_POINTS];
+				for(int j = 0; f->len > 1 && j < CURVE_CAL_POINTS; j++)
+					points[j] = proto_get16(f->payload + 1 + 2 * j);
+				if(set_curve(f->train, f->payload[0], f->len > 1 ? points : NULL) != ESP_OK){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+					break;
+				}
+			}
+			reply[0] = trains[f->train].curve;
+			reply[1] = CURVE_COUNT;
+			for(int j = 0; j < CURVE_CAL_POINTS; j++)
+				proto_put16(reply + 2 + 2 * j, trains[f->train].cal_points[j]);
+			conn_ack(c, f, PROTO_OK, reply, 2 + 2 * CURVE_CAL_POINTS);
+			break;
+		}
+		case MSG_PWM:{	// select the pwm profile of a train, or just report it when the payload is empty
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			if(f->len >= 1){
+				if(train_owner[f->train] != NULL && train_owner[f->train] != c){
+					conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
+					break;
+				}
+				if(set_pwm(f->train, f->payload[0]) != ESP_OK){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+					break;
+				}
+			}
+			const pwm_profile_t *pwm = &pwm_profiles[trains[f->train].profile];
+			reply[0] = trains[f->train].profile;
+			reply[1] = PWM_PROFILE_COUNT;
+			proto_put32(reply + 2, pwm->freq_hz);
+			reply[6] = pwm->bits;
+			conn_ack(c, f, PROTO_OK, reply, 7);
+			break;
+		}
+		case MSG_MOTOR:{	// set how a train's h-bridge stops and reverses, or just report it when the payload is empty
+			if(f->train >= NUM_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			motor_cfg_t cfg;
+			if(f->len >= 3){
+				if(train_owner[f->train] != NULL && train_owner[f->train] != c){
+					conn_ack(c, f, PROTO_ERR_OWNER, NULL, 0);
+					break;
+				}
+				cfg.stop_mode = f->payload[0];
+				cfg.dwell_ms = proto_get16(f->payload + 1);
+				if(set_motor(f->train, &cfg) != ESP_OK){
+					conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+					break;
+				}
+			} else if(f->len != 0){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			portENTER_CRITICAL(&fade_lock);
+			cfg = trains[f->train].motor_cfg;
+			portEXIT_CRITICAL(&fade_lock);
+			reply[0] = cfg.stop_mode;
+			proto_put16(reply + 1, cfg.dwell_ms);
+			reply[3] = trains[f->train].motor;	// a single byte written by the motor task
+			conn_ack(c, f, PROTO_OK, reply, 4);
+			break;
+		}
+		case MSG_ESTOP:{	// brake a train, or every train, to a stop, anyone can
+			if(f->train >= NUM_TRAINS && f->train != PROTO_ALL_TRAINS){
+				conn_ack(c, f, PROTO_ERR_ARG, NULL, 0);
+				break;
+			}
+			for(int i = 0; i < NUM_TRAINS; i++)
+				if(f->train == i || f->train == PROTO_ALL_TRAINS)
+					emergency_stop(i, f->seq);
+			conn_ack(c, f, PROTO_OK, NULL, 0);
+			break;
+		}
+		case MSG_STATS:{	// snapshot of the server's counters and histograms
+			mbox_stats_t mbox;
+			int depth;
+			get_mbox_stats(&mbox, &depth);
+			portENTER_CRITICAL(&fade_lock);
+			uint32_t missed = heartbeats_missed;
+			portEXIT_CRITICAL(&fade_lock);
+			const uint32_t counters[] = {
+				esp_timer_get_time() / 1000, stats.bytes_rx, stats.bytes_tx, stats.frames_rx, stats.text_rx,
+				stats.parse_errors, stats.nacks, stats.connects, stats.disconnects, stats.overflows,
+				stats.udp_rx, mbox.posted, mbox.dropped, missed,
+			};
+			_Static_assert(sizeof(counters) / sizeof(counters[0]) == STATS_NUM_COUNTERS, "MSG_STATS counters");
+			uint8_t *p = reply;
+			for(int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++, p += 4)
+				proto_put32(p, counters[i]);
+			for(int i = 0; i < STATS_BUCKETS; i++, p += 4)
+				proto_put32(p, stats.recv_parse_us[i]);
+			for(int i = 0; i < STATS_BUCKETS; i++, p += 4){	// the mailbox's finer histogram, its top buckets folded together
+				uint32_t n = mbox.latency[i];
+				for(int j = STATS_BUCKETS; i == STATS_BUCKETS - 1 && j < MBOX_LATENCY_BUCKETS; j++)
+					n += mbox.latency[j];
+				proto_put32(p, n);
+			}
+			for(int i = 0; i < STATS_BUCKETS; i++, p += 4)
+				proto_put32(p, stats.fade_ticks[i]);
+			for(int i = 0; i < STATS_BUCKETS; i++, p += 4)
+				proto_put32(p, stats.send_us[i]);
+			conn_ack(c, f, PROTO_OK, reply, p - reply);
+			break;
+		}
+		case MSG_MBOX_STATS:{	// how setpoints have fared on their way to the motor task
+			mbox_stats_t stats;
+			int depth;
+			get_mbox_stats(&stats, &depth);
+			proto_put32(reply, stats.posted);
+			proto_put32(reply + 4, stats.dropped);
+			reply[8] = depth;
+			reply[9] = stats.depth_max;
+			proto_put32(reply + 10, stats.latency_max_us);
+			for(int i = 0; i < MBOX_LATENCY_BUCKETS; i++)
+				proto_put32(reply + 14 + 4 * i, stats.latency[i]);
+			conn_ack(c, f, PROTO_OK, reply, 14 + 4 * MBOX_LATENCY_BUCKETS);
+			break;
+		}
+		case MSG_MEM_STATS:{	// heap, task stacks and how full the fixed pools are
+			TaskHandle_t tasks[MEM_NUM_TASKS] = { tcp_server_handle, motor_task_handle };
+			uint32_t stacks[MEM_NUM_TASKS] = { TCP_SERVER_STACK, MOTOR_TASK_STACK };
+			mbox_stats_t mbox_now;
+			int depth, scheduled, scheduled_peak;
+			uint32_t traced = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+			get_mbox_stats(&mbox_now, &depth);
+			portENTER_CRITICAL(&sched_lock);
+			scheduled = sched_len;
+			scheduled_peak = sched_peak;
+			portEXIT_CRITICAL(&sched_lock);
+			int pools[MEM_NUM_POOLS][3] = {
+				{ conns_used, conns_peak, MAX_CLIENTS },
+				{ scheduled, scheduled_peak, SCHED_LEN },
+				{ MIN(traced, TRACE_LEN), MIN(traced, TRACE_LEN), TRACE_LEN },
+				{ depth, mbox_now.depth_max, NUM_TRAINS },
+			};
+			uint8_t *p = reply;
+			proto_put32(p, esp_get_free_heap_size());
+			proto_put32(p + 4, esp_get_minimum_free_heap_size());
+			p += 8;
+			for(int i = 0; i < MEM_NUM_TASKS; i++, p += 8){
+				proto_put32(p, stacks[i]);
+				proto_put32(p + 4, tasks[i] != NULL ? uxTaskGetStackHighWaterMark(tasks[i]) : 0);
+			}
+			for(int i = 0; i < MEM_NUM_POOLS; i++, p += 6){
+				proto_put16(p, pools[i][0]);
+				proto_put16(p + 2, pools[i][1]);
+				proto_put16(p + 4, pools[i][2]);
+			}
+			conn_ack(c, f, PROTO_OK, reply, MEM_STATS_LEN);
+			break;
+		}
+		case MSG_TRACE:{	// the next page of the duty trace, from record 'first' or the oldest kept
+			trace_rec_t recs[TRACE_PAGE];
+			uint32_t first = f->len >= 4 ? proto_get32(f->payload) : 0;
+			uint32_t head;
+			int n = trace_read(&first, recs, TRACE_PAGE, &head);
+			proto_put32(reply, head);
+			proto_put32(reply + 4, first);
+			uint8_t *p = reply + 8;
+			for(int i = 0; i < n; i++, p += TRACE_RECORD_LEN){
+				proto_put32(p, recs[i].time_us);
+				p[4] = recs[i].train;
+				p[5] = recs[i].source;
+				proto_put16(p + 6, recs[i].seq);
+				proto_put16(p + 8, recs[i].from);
+				proto_put16(p + 10, recs[i].to);
+				proto_put32(p + 12, recs[i].fade_ms);
+			}
+			conn_ack(c, f, PROTO_OK, reply, p - reply);
+			break;
+		}
+		case MSG_NET_STATS:{	// how the wifi connection has fared
+			portENTER_CRITICAL(&wifi_lock);
+			wifi_t w = wifi;
+			portEXIT_CRITICAL(&wifi_lock);
+			reply[0] = w.state;
+			reply[1] = w.cache.channel;
+			const uint32_t values[] = {
+				w.attempts, w.connects, w.fast_connects, w.disconnects, w.restarts,
+				w.boot_ip_ms, stats.boot_cmd_ms, w.reconnect_last_ms, w.reconnect_max_ms,
+			};
+			for(int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+				proto_put32(reply + 2 + 4 * i, values[i]);
+			conn_ack(c, f, PROTO_OK, reply, 2 + sizeof(values));
+			break;
+		}
+		case MSG_HEARTBEAT:	// the recv already re-armed the watchdogs, heartbeats are not acked
+			break;
+		case MSG_SUBSCRIBE:{	// push telemetry every 'period_ms', 0 to stop
+			if(f->len < 2){
+				conn_ack(c, f, PROTO_ERR_LENGTH, NULL, 0);
+				break;
+			}
+			int period = proto_get16(f->payload);
+			if(period != 0 && period < TELEMETRY_MIN_PERIOD_MS)
+				period = TELEMETRY_MIN_PERIOD_MS;
+			c->telemetry_us = (int64_t)period * 1000;
+			c->next_telemetry_us = esp_timer_get_time();
+			conn_ack(c, f, PROTO_OK, NULL, 0);
+			break;
+		}
+		default:
+			conn_ack(c, f, PROTO_ERR_TYPE, NULL, 0);
+	}
+}
+
+// parses every whole frame in the receive buffer, leaving any partial frame for the next recv
+static void parse_frames(conn_t *c){
+	int pos = 0;
+	while(pos < c->rx_len){
+		proto_frame_t f;
+		int len = proto_decode(c->rx + pos, c->rx_len - pos, &f);
+		if(len == 0)
+			break;
+		if(len < 0){
+			// corrupt frame or garbage, tell the client if it looked like a frame and resync on the next byte
+			if(c->rx[pos] == PROTO_MAGIC && c->rx_len - pos >= PROTO_HDR_LEN){
+				proto_frame_t bad = { .train = c->rx[pos + 3], .seq = proto_get16(c->rx + pos + 4) };
+				ESP_LOGW(TAG, "Bad frame checksum, seq %d", bad.seq);
+				conn_ack(c, &bad, PROTO_ERR_CHECKSUM, NULL, 0);
+			}
+			stats.parse_errors++;
+			pos++;
+			continue;
+		}
+		stats.frames_rx++;
+		if(stats.boot_cmd_ms == 0)
+			stats.boot_cmd_ms = MAX(c->rx_us / 1000, 1);
+		hist_add(stats.recv_parse_us, STATS_BUCKETS, esp_timer_get_time() - c->rx_us);
+		handle_frame(c, &f);
+		pos += len;
+	}
+	memmove(c->rx, c->rx + pos, c->rx_len - pos);
+	c->rx_len -= pos;
+}
+
+// queues a telemetry frame with the live state of every train
+static void send_telemetry(conn_t *c){
+	uint8_t payload[NUM_TRAINS * TELEMETRY_ENTRY_LEN];
+	uint8_t *p = payload;
+	for(int i = 0; i < NUM_TRAINS; i++, p += TELEMETRY_ENTRY_LEN){
+		int32_t duty, target;
+		int progress, modelled;
+		uint32_t remaining_ms;
+		get_fade(i, &duty, &target, &progress, &remaining_ms, &modelled);
+		p[0] = i;
+		proto_put16(p + 1, (int16_t)(duty / (DUTY_SCALE / PROTO_DUTY_SCALE)));
+		proto_put16(p + 3, (int16_t)(target / (DUTY_SCALE / PROTO_DUTY_SCALE)));
+		p[5] = progress;
+		proto_put32(p + 6, remaining_ms);
+		p[10] = modelled ? TELEMETRY_MODELLED : 0;
+	}
+	// a client that is behind just misses a frame, the next one supersedes it anyway
+	conn_reply(c, MSG_TELEMETRY, 0, c->telemetry_seq++, payload, sizeof(payload));
+}
+
+enum {GET, SET};
+
+// executes one command of the original text protocol
+static void handle_text(conn_t *c){
+	c->rx[c->rx_len] = 0; // Null-terminate whatever is received and treat it like a string
+	c->rx_len = 0;
+
+	char *cmd_str = strtok((char *)c->rx, " ");
+	if(cmd_str == NULL)
+		return;
+	stats.text_rx++;
+	if(stats.boot_cmd_ms == 0)
+		stats.boot_cmd_ms = MAX(c->rx_us / 1000, 1);
+	hist_add(stats.recv_parse_us, STATS_BUCKETS, esp_timer_get_time() - c->rx_us);
+	int cmd = atoi(cmd_str);
+	char tx_buffer[32];
+	switch(cmd){
+		case GET:{	// get current duty cycle of train (train 0 if not given)
+			char *train_str = strtok(NULL, " ");
+			int train = train_str ? atoi(train_str) : 0;
+			sprintf(tx_buffer, "%d", (int)(get_duty(train) / DUTY_SCALE));
+			if(conn_queue(c, tx_buffer, strlen(tx_buffer)) != 0)
+				c->overflow = 1;
+			break;
+		}
+		case SET:{	// set duty cycle of train to 'duty' with 'time' fade (train 0 if not given)
+			char *duty_str = strtok(NULL, " ");
+			char *time_str = strtok(NULL, " ");
+			char *train_str = strtok(NULL, " ");
+			if(duty_str == NULL || time_str == NULL){
+				ESP_LOGE(TAG, "Truncated SET command");
+				stats.parse_errors++;
+				break;
+			}
+			int duty = atoi(duty_str);
+			int time = atoi(time_str);
+			int train = train_str ? atoi(train_str) : 0;
+			if(duty < -100 || duty > 100){
+				ESP_LOGE(TAG, "SET duty %d out of range", duty);
+				stats.parse_errors++;
+				break;
+			}
+			if(take_train(c, train, 0) != PROTO_OK){
+				ESP_LOGW(TAG, "Client %d does not control train %d", c->sock, train);
+				break;
+			}
+			drive_train(train, duty * DUTY_SCALE, time, 0, TRACE_SRC_TEXT, 0);
+			break;
+		}
+	}
+}
+
+// recivies and executes commands from client, queuing responses
+// called whenever the client's socket is readable
+// a connection speaks text, one command per recv, until the client sends MSG_HELLO,
+// then any number of frames can arrive in one recv or be split across several
+// returns the result of recv, the connection should be closed when it is <= 0
+static int tcp_server_talk(conn_t *c){
+    int recv_len = recv(c->sock, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len - 1, 0);
+    if (recv_len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+    } else if (recv_len == 0) {
+        ESP_LOGW(TAG, "Connection closed");
+    } else {
+        LOG_PACKET("Received %d bytes", recv_len);
+        c->rx_us = esp_timer_get_time();
+        stats.bytes_rx += recv_len;
+        conn_heard(c);
+        c->rx_len += recv_len;
+        if(c->binary || c->rx[0] == PROTO_MAGIC){
+            parse_frames(c);
+        } else {
+            handle_text(c);
         }
-    } while (recv_len > 0);
-    set_duty(0, 0); // stop train when client disconnects
+    }
+    return recv_len;
 }
 
-// initializes listening socket and accepts clients one at a time
-// refers each client to tcp_server_talk
-// closes client socket
-// looped by xTask
-static void tcp_server_task(void *pvParameters){
+// sets up a free connection slot for a newly accepted socket
+// returns the connection, or NULL when every slot is in use
+static conn_t *conn_open(int sock){
+	for(int i = 0; i < MAX_CLIENTS; i++){
+		conn_t *c = &conns[i];
+		if(c->sock < 0){
+			memset(c, 0, sizeof(*c));
+			c->sock = sock;
+			c->token = esp_random();
+			conns_used++;
+			conns_peak = MAX(conns_peak, conns_used);
+			return c;
+		}
+	}
+	return NULL;
+}
+
+// closes a connection, stopping and releasing the trains it controls
+static void conn_close(conn_t *c){
+	for(int i = 0; i < NUM_TRAINS; i++){
+		if(train_owner[i] == c){
+			sched_cancel(i);
+			set_duty(i, 0, 0, TRACE_SRC_DISCONNECT, 0); // stop train when its controller disconnects
+			train_owner[i] = NULL;
+			arm_watchdog(i, NULL);
+			pause_program(i, 0);	// a program it took the train from carries on
+		}
+	}
+	shutdown(c->sock, 0);
+	close(c->sock);
+	c->sock = -1;
+	conns_used--;
+	stats.disconnects++;
+}
+
+// pushes telemetry to every subscribed client that is due some
+// returns microseconds until the next frame is due, or -1 when nobody is subscribed
+static int64_t telemetry_due(void){
+	int64_t now_us = esp_timer_get_time();
+	int64_t wait_us = -1;
+	for(int i = 0; i < MAX_CLIENTS; i++){
+		conn_t *c = &conns[i];
+		if(c->sock < 0 || c->telemetry_us == 0)
+			continue;
+		if(now_us >= c->next_telemetry_us){
+			send_telemetry(c);
+			c->next_telemetry_us += c->telemetry_us;
+			if(c->next_telemetry_us < now_us)	// fell behind, skip rather than burst
+				c->next_telemetry_us = now_us + c->telemetry_us;
+		}
+		if(wait_us < 0 || c->next_telemetry_us - now_us < wait_us)
+			wait_us = c->next_telemetry_us - now_us;
+	}
+	return wait_us;
+}
+
+// accepts every pending connection on the listening socket
+static void tcp_server_accept(int listen_sock){
     char addr_str[128];
-    int addr_family = (int)pvParameters;
-    int ip_protocol = 0;
     int keepAlive = 1;
     int keepIdle = KEEPALIVE_IDLE;
     int keepInterval = KEEPALIVE_INTERVAL;
     int keepCount = KEEPALIVE_COUNT;
+    int noDelay = 1;
+
+    while (1) {
+        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
+        socklen_t addr_len = sizeof(source_addr);
+        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+        if (sock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            return;
+        }
+
+        // Set tcp keepalive option
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+        // Send acks and telemetry as soon as they are queued rather than waiting to coalesce them
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        // Convert ip address to string
+        if (source_addr.ss_family == PF_INET) {
+            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+        }
+#ifdef CONFIG_EXAMPLE_IPV6
+        else if (source_addr.ss_family == PF_INET6) {
+            inet6_ntoa_r(((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
+        }
+#endif
+        if (conn_open(sock) == NULL) {
+            ESP_LOGW(TAG, "Refused %s, all %d connections in use", addr_str, MAX_CLIENTS);
+            close(sock);
+            continue;
+        }
+        stats.connects++;
+        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
+    }
+}
+
+// serves clients for as long as wifi keeps the address it had when the server started,
+// the connection can drop and come back in between
+// starts the server again on every new address, since sockets on the old one are dead
+// looped by xTask
+static void tcp_server_task(void *pvParameters){
+    int addr_family = (int)(intptr_t)pvParameters;
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        conns[i].sock = -1;
+    for (int i = 0; i < NUM_TRAINS; i++)
+        train_dir[i] = 1;
+
+    while (1) {
+        xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        tcp_server_run(addr_family, wifi_ip_gen());
+        for (int i = 0; i < MAX_CLIENTS; i++)
+            if (conns[i].sock >= 0)
+                conn_close(&conns[i]);
+        portENTER_CRITICAL(&wifi_lock);
+        wifi.restarts++;
+        portEXIT_CRITICAL(&wifi_lock);
+        ESP_LOGI(TAG, "Restarting server");
+        vTaskDelay(pdMS_TO_TICKS(NET_CHECK_MS));	// don't spin on a socket that can't be bound yet
+    }
+}
+
+// initializes listening socket and serves every client from one select() loop
+// until the address changes from generation 'gen' or the sockets fail
+// no task is created per connection, each connection costs only its conn_t
+static void tcp_server_run(int addr_family, uint32_t gen){
+    int ip_protocol = 0;
+    int udp_sock = -1;
     struct sockaddr_storage dest_addr;
 
     if (addr_family == AF_INET) {
@@ -255,7 +2139,6 @@ static void tcp_server_task(void *pvParameters){
     int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (listen_sock < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-        vTaskDelete(NULL);
         return;
     }
     int opt = 1;
@@ -265,6 +2148,7 @@ static void tcp_server_task(void *pvParameters){
     // if both protocols used at the same time (used in CI)
     setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
 #endif
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
 
     ESP_LOGI(TAG, "Socket created");
 
@@ -276,66 +2160,115 @@ static void tcp_server_task(void *pvParameters){
     }
     ESP_LOGI(TAG, "Socket bound, port %d", PORT);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, MAX_CLIENTS);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
     }
+    ESP_LOGI(TAG, "Socket listening");
 
-    while (1) {
-
-        ESP_LOGI(TAG, "Socket listening");
-
-        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
-        socklen_t addr_len = sizeof(source_addr);
-        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-            break;
+    // udp throttle channel, the server carries on without it if it cannot be opened
+    if (UDP_PORT != 0) {
+        udp_sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
+        struct sockaddr_storage udp_addr = dest_addr;
+        ((struct sockaddr_in *)&udp_addr)->sin_port = htons(UDP_PORT);	// same offset in sockaddr_in6
+        if (udp_sock >= 0 && bind(udp_sock, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) == 0) {
+            fcntl(udp_sock, F_SETFL, fcntl(udp_sock, F_GETFL, 0) | O_NONBLOCK);
+            ESP_LOGI(TAG, "Udp socket bound, port %d", UDP_PORT);
+        } else {
+            ESP_LOGE(TAG, "Unable to open udp socket: errno %d", errno);
+            if (udp_sock >= 0)
+                close(udp_sock);
+            udp_sock = -1;
         }
+    }
 
-        // Set tcp keepalive option
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-        // Convert ip address to string
-        if (source_addr.ss_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    while (wifi_ip_gen() == gen) {
+        // queued before the sets are built, so a frame due now goes out now rather than after the sleep
+        int64_t wait_us = telemetry_due();
+        fd_set rfds, wfds;
+        int max_fd = listen_sock;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(listen_sock, &rfds);
+        if (udp_sock >= 0) {
+            FD_SET(udp_sock, &rfds);
+            max_fd = MAX(max_fd, udp_sock);
         }
-#ifdef CONFIG_EXAMPLE_IPV6
-        else if (source_addr.ss_family == PF_INET6) {
-            inet6_ntoa_r(((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            conn_t *c = &conns[i];
+            if (c->sock < 0)
+                continue;
+            FD_SET(c->sock, &rfds);
+            if (c->tx_len > 0)
+                FD_SET(c->sock, &wfds);
+            if (c->sock > max_fd)
+                max_fd = c->sock;
+        }
+
+        // sleep until a socket needs attention or telemetry is due, but no longer than NET_CHECK_MS
+        if (wait_us < 0 || wait_us > NET_CHECK_MS * 1000)
+            wait_us = NET_CHECK_MS * 1000;
+        struct timeval tv = { .tv_sec = wait_us / 1000000, .tv_usec = wait_us % 1000000 };
+        int ready = select(max_fd + 1, &rfds, &wfds, NULL, &tv);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            break;
         }
-#endif
-        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
 
-        tcp_server_talk(sock);
+        if (FD_ISSET(listen_sock, &rfds))
+            tcp_server_accept(listen_sock);
+        if (udp_sock >= 0 && FD_ISSET(udp_sock, &rfds))
+            udp_server_recv(udp_sock);
 
-        shutdown(sock, 0);
-        close(sock);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            conn_t *c = &conns[i];
+            if (c->sock < 0)
+                continue;
+            int open = 1;
+            if (FD_ISSET(c->sock, &rfds))
+                open = tcp_server_talk(c) > 0;
+            if (open && (FD_ISSET(c->sock, &wfds) || c->tx_len > 0))
+                open = conn_flush(c) == 0;
+            if (c->overflow)
+                stats.overflows++;
+            if (!open || c->overflow)
+                conn_close(c);
+        }
     }
 
 CLEAN_UP:
+    if (udp_sock >= 0)
+        close(udp_sock);
     close(listen_sock);
-    vTaskDelete(NULL);
+}
+
+// widest duty resolution a ledc timer can count at 'freq_hz', up to PWM_MAX_BITS
+static int pwm_bits(uint32_t freq_hz){
+	int bits = 1;
+	while(bits < PWM_MAX_BITS && PWM_CLK_HZ / freq_hz >= 2u << bits)
+		bits++;
+	return bits;
 }
 
 // initializes ledc to drive hbridge
 static void my_ledc_init(void){
     /*
      * Prepare and set configuration of timers
-     * that will be used by LED Controller
+     * that will be used by LED Controller,
+     * one per pwm profile at the finest resolution its frequency allows
      */
-    ledc_timer_config_t ledc_timer = {
-        .duty_resolution = LEDC_TIMER_8_BIT, // resolution of PWM duty
-        .freq_hz = 10000,                      // frequency of PWM signal
-        .speed_mode = LEDC_LS_MODE,           // timer mode
-        .timer_num = LEDC_LS_TIMER,            // timer index
-        .clk_cfg = LEDC_AUTO_CLK,              // Auto select the source clock
-    };
-    // Set configuration of timer0 for high speed channels
-    ledc_timer_config(&ledc_timer);
+    for (int i = 0; i < PWM_PROFILE_COUNT; i++) {
+        pwm_profiles[i].bits = pwm_bits(pwm_profiles[i].freq_hz);
+        ledc_timer_config_t ledc_timer = {
+            .duty_resolution = pwm_profiles[i].bits, // resolution of PWM duty
+            .freq_hz = pwm_profiles[i].freq_hz,      // frequency of PWM signal
+            .speed_mode = LEDC_LS_MODE,           // timer mode
+            .timer_num = pwm_profiles[i].timer,    // timer index
+            .clk_cfg = LEDC_AUTO_CLK,              // Auto select the source clock
+        };
+        ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
+    }
     /*
      * Prepare individual configuration
      * for each channel of LED Controller
@@ -348,44 +2281,63 @@ static void my_ledc_init(void){
      *   Note: if different channels use one timer,
      *         then frequency and bit_num of these channels
      *         will be the same
+     * Each train's channel starts out routed to its forward input,
+     * the reverse input is a plain output held low.
+     * Channels start on the standard profile's timer, the motor task
+     * moves them to their own profile's on its first tick.
      */
-    ledc_channel_config_t ledc_channel[2] = {
-
-        {
-            .channel    = LEDC_LS_CH0_CHANNEL,
+    for (int i = 0; i < NUM_TRAINS; i++) {
+        ledc_channel_config_t ledc_channel = {
+            .channel    = trains[i].channel,
             .duty       = 0,
-            .gpio_num   = LEDC_LS_CH0_GPIO,
+            .gpio_num   = trains[i].fwd_gpio,
             .speed_mode = LEDC_LS_MODE,
             .hpoint     = 0,
-            .timer_sel  = LEDC_LS_TIMER
-        },
-        {
-            .channel    = LEDC_LS_CH1_CHANNEL,
-            .duty       = 0,
-            .gpio_num   = LEDC_LS_CH1_GPIO,
-            .speed_mode = LEDC_LS_MODE,
-            .hpoint     = 0,
-            .timer_sel  = LEDC_LS_TIMER
-        },
+            .timer_sel  = pwm_profiles[PWM_PROFILE_STANDARD].timer
+        };
+        ledc_channel_config(&ledc_channel);
 
-    };
-
-    // Set LED Controller with previously prepared configuration
-	ledc_channel_config(&ledc_channel[0]);
-	ledc_channel_config(&ledc_channel[1]);
+        gpio_config_t rev_conf = {
+            .pin_bit_mask = 1ULL << trains[i].rev_gpio,
+            .mode = GPIO_MODE_OUTPUT,
+        };
+        gpio_config(&rev_conf);
+        gpio_set_level(trains[i].rev_gpio, 0);
+        trains[i].dir = 1;
+        trains[i].inertia.cfg = (inertia_cfg_t){ .mass = 100, .accel = INERTIA_ACCEL, .brake = INERTIA_BRAKE };
+        trains[i].motor_cfg = (motor_cfg_t){ .stop_mode = MOTOR_COAST, .dwell_ms = MOTOR_DWELL_MS };
+#ifdef HOST_BUILD
+        host_motor_attach(i, trains[i].fwd_gpio, trains[i].rev_gpio);	// the simulator's model of the loco
+#endif
+    }
+    load_train_settings();
 
-    // Initialize fade service.
-    ledc_fade_func_install(0);
+    // Start the fade engine. Fades are interpolated in software so they can be retargeted at any time.
+    // The motor task applies setpoints and is woken by fade_timer for each tick,
+    // and by sched_timer when a scheduled setpoint is due.
+    xTaskCreate(motor_task, "motor", MOTOR_TASK_STACK, NULL, MOTOR_TASK_PRIORITY, &motor_task_handle);
+    const esp_timer_create_args_t fade_timer_args = {
+        .callback = &motor_wake,
+        .name = "fade"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&fade_timer_args, &fade_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(fade_timer, FADE_TICK_MS * 1000));
+    const esp_timer_create_args_t sched_timer_args = {
+        .callback = &motor_wake,
+        .name = "sched"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&sched_timer_args, &sched_timer));
 }
 
-// initializes wifi
+// initializes wifi and starts connecting, without waiting for the connection
+// event_handler() carries on from here, for as long as the server runs
 void wifi_init_sta(void){
     s_wifi_event_group = xEventGroupCreate();
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -402,8 +2354,13 @@ void wifi_init_sta(void){
                                                         &event_handler,
                                                         NULL,
                                                         &instance_got_ip));
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = &wifi_connect,
+        .name = "wifi_retry"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&retry_timer_args, &wifi_retry_timer));
 
-    wifi_config_t wifi_config = {
+    wifi_config = (wifi_config_t){
         .sta = {
             .ssid = ESP_WIFI_SSID,
             .password = ESP_WIFI_PASS,
@@ -418,56 +2375,142 @@ void wifi_init_sta(void){
             },
         },
     };
+    wifi_cache_t cache;
+    nvs_handle_t nvs;
+    size_t len = sizeof(cache);
+    if (nvs_open(WIFI_NVS, NVS_READONLY, &nvs) == ESP_OK) {
+        if (nvs_get_blob(nvs, "ap", &cache, &len) == ESP_OK && len == sizeof(cache)) {
+            wifi.cache = cache;
+            wifi.use_cache = 1;
+            ESP_LOGI(TAG, "cached ap on channel %d, ip " IPSTR, cache.channel, IP2STR((esp_ip4_addr_t *)&cache.ip));
+        }
+        nvs_close(nvs);
+    }
+    wifi.state = NET_STATE_STARTING;
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
     ESP_ERROR_CHECK(esp_wifi_start() );
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
+}
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 ESP_WIFI_SSID, ESP_WIFI_PASS);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 ESP_WIFI_SSID, ESP_WIFI_PASS);
+// starts an attempt to join the AP, wifi_retry_timer callback
+// goes straight to the cached AP on its channel with the cached address when there is one,
+// otherwise scans for the ssid and asks dhcp for an address
+static void wifi_connect(void *arg){
+    portENTER_CRITICAL(&wifi_lock);
+    wifi_cache_t cache = wifi.cache;
+    int fast = wifi.use_cache && cache.channel != 0;
+    wifi.fast = fast;
+    wifi.state = NET_STATE_CONNECTING;
+    wifi.attempts++;
+    portEXIT_CRITICAL(&wifi_lock);
+
+    wifi_config.sta.bssid_set = fast;
+    memcpy(wifi_config.sta.bssid, cache.bssid, sizeof(cache.bssid));
+    wifi_config.sta.channel = fast ? cache.channel : 0;
+    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+    if (fast && WIFI_REUSE_IP && cache.ip != 0) {
+        esp_netif_ip_info_t info = { .ip.addr = cache.ip, .netmask.addr = cache.netmask, .gw.addr = cache.gw };
+        esp_netif_dhcpc_stop(sta_netif);
+        esp_netif_set_ip_info(sta_netif, &info);
     } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+        esp_netif_dhcpc_start(sta_netif);
+    }
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_wifi_connect failed: %d", err);
+        esp_timer_start_once(wifi_retry_timer, WIFI_RETRY_MAX_MS * 1000);
     }
+}
 
-    /* The event will not be processed after unregister */
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-    vEventGroupDelete(s_wifi_event_group);
+// number of times the address has changed, the tcp server restarts when it moves on
+static uint32_t wifi_ip_gen(void){
+    portENTER_CRITICAL(&wifi_lock);
+    uint32_t gen = wifi.ip_gen;
+    portEXIT_CRITICAL(&wifi_lock);
+    return gen;
 }
 
+// moves the connection state machine on
+// a lost connection is tried again at once, then after WIFI_RETRY_MIN_MS doubling up to WIFI_RETRY_MAX_MS,
+// for as long as it takes. An attempt with the cache that fails is tried again at once without it.
 static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data){
+    int64_t now_us = esp_timer_get_time();
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        wifi_connect(NULL);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        wifi_ap_record_t ap;
+        int have_ap = esp_wifi_sta_get_ap_info(&ap) == ESP_OK;
+        portENTER_CRITICAL(&wifi_lock);
+        if (have_ap) {
+            memcpy(wifi.cache.bssid, ap.bssid, sizeof(wifi.cache.bssid));
+            wifi.cache.channel = ap.primary;
+        }
+        wifi.state = NET_STATE_LINKED;
+        portEXIT_CRITICAL(&wifi_lock);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        portENTER_CRITICAL(&wifi_lock);
+        if (wifi.state == NET_STATE_UP) {
+            wifi.disconnects++;
+            wifi.down_us = now_us;
+        }
+        int delay_ms = wifi.retry_ms;
+        if (wifi.fast) {
+            wifi.use_cache = 0;	// the AP moved or the address was refused, look for it properly
+            delay_ms = 0;
         } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            wifi.retry_ms = wifi.retry_ms == 0 ? WIFI_RETRY_MIN_MS : MIN(wifi.retry_ms * 2, WIFI_RETRY_MAX_MS);
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
+        wifi.state = NET_STATE_WAITING;
+        portEXIT_CRITICAL(&wifi_lock);
+        ESP_LOGI(TAG, "connect to the AP fail, reason %d, retry in %d ms", event ? event->reason : 0, delay_ms);
+        if (delay_ms == 0)
+            wifi_connect(NULL);
+        else
+            esp_timer_start_once(wifi_retry_timer, (uint64_t)delay_ms * 1000);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
+        portENTER_CRITICAL(&wifi_lock);
+        wifi_cache_t was = wifi.cache;
+        wifi.cache.ip = event->ip_info.ip.addr;
+        wifi.cache.netmask = event->ip_info.netmask.addr;
+        wifi.cache.gw = event->ip_info.gw.addr;
+        int save = memcmp(&was, &wifi.cache, sizeof(was)) != 0 || !wifi.use_cache;
+        wifi.use_cache = 1;
+        if (wifi.ip != event->ip_info.ip.addr) {
+            wifi.ip = event->ip_info.ip.addr;
+            wifi.ip_gen++;
+        }
+        int fast = wifi.fast;
+        wifi.fast = 0;
+        wifi.connects++;
+        wifi.fast_connects += fast;
+        if (wifi.boot_ip_ms == 0)
+            wifi.boot_ip_ms = MAX(now_us / 1000, 1);
+        if (wifi.down_us != 0) {
+            wifi.reconnect_last_ms = (now_us - wifi.down_us) / 1000;
+            wifi.reconnect_max_ms = MAX(wifi.reconnect_max_ms, wifi.reconnect_last_ms);
+            wifi.down_us = 0;
+        }
+        wifi.retry_ms = 0;
+        wifi.state = NET_STATE_UP;
+        wifi_cache_t cache = wifi.cache;
+        portEXIT_CRITICAL(&wifi_lock);
+        ESP_LOGI(TAG, "connected to ap SSID:%s on channel %d%s", ESP_WIFI_SSID, cache.channel,
+                 fast ? " from the cache" : "");
+        if (save) {	// only when it changed, to spare the flash
+            nvs_handle_t nvs;
+            if (nvs_open(WIFI_NVS, NVS_READWRITE, &nvs) == ESP_OK) {
+                if (nvs_set_blob(nvs, "ap", &cache, sizeof(cache)) == ESP_OK)
+                    nvs_commit(nvs);
+                nvs_close(nvs);
+            }
+        }
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
-
-
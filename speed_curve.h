@@ -0,0 +1,128 @@
+/*
+** speed_curve.h
+** Speed curves for server.c, built into constant tables by the compiler
+**
+** A curve maps the speed asked for to the share of full power given to the
+** motor. Each table has an entry every half percent of speed (CURVE_STEPS
+** entries per percent) in 1/65535ths of full power; write_duty() interpolates
+** between entries, so setting the PWM is a table lookup, not a formula.
+**
+** N scale motors do not turn until the power passes a dead band, and above it
+** their speed does not rise in proportion to the power:
+**	CURVE_LINEAR		power in proportion to speed, as the server always did
+**	CURVE_EXPO			starts at the dead band and rises with the square of speed,
+**						for fine control at low speed
+**	CURVE_SCURVE		starts at the dead band, gentle at both ends
+**	CURVE_CALIBRATED	through points measured on a loco every 10% of speed
+**
+** Every table is checked at compile time to rise with speed and stay in range.
+** The calibrated table here is only the one a train starts with: each train
+** keeps its own points, and curve_calibrate() builds its table from them
+** when they are loaded or changed. Build with -DCURVE_CAL_POINT_n=... to
+** start every train from other points.
+*/
+#ifndef SPEED_CURVE_H
+#define SPEED_CURVE_H
+
+#include <stdint.h>
+
+#define CURVE_STEPS		2		// table entries per percent of speed
+#define CURVE_LEN		(100 * CURVE_STEPS + 1)
+#define CURVE_FULL		65535	// full power
+
+#ifndef CURVE_DEAD_BAND
+#define CURVE_DEAD_BAND	12		// percent of full power a motor needs before it turns
+#endif
+
+// power at 0%, 10% .. 100% of speed in tenths of a percent, for CURVE_CALIBRATED
+#define CURVE_CAL_POINTS	11
+#ifndef CURVE_CAL_POINT_0
+#define CURVE_CAL_POINT_0	0
+#define CURVE_CAL_POINT_1	180
+#define CURVE_CAL_POINT_2	260
+#define CURVE_CAL_POINT_3	330
+#define CURVE_CAL_POINT_4	400
+#define CURVE_CAL_POINT_5	470
+#define CURVE_CAL_POINT_6	550
+#define CURVE_CAL_POINT_7	630
+#define CURVE_CAL_POINT_8	720
+#define CURVE_CAL_POINT_9	850
+#define CURVE_CAL_POINT_10	1000
+#endif
+#define CURVE_CAL_DEFAULT	{ CURVE_CAL_POINT_0, CURVE_CAL_POINT_1, CURVE_CAL_POINT_2, CURVE_CAL_POINT_3,		\
+							  CURVE_CAL_POINT_4, CURVE_CAL_POINT_5, CURVE_CAL_POINT_6, CURVE_CAL_POINT_7,		\
+							  CURVE_CAL_POINT_8, CURVE_CAL_POINT_9, CURVE_CAL_POINT_10 }
+
+enum {
+	CURVE_LINEAR,
+	CURVE_EXPO,
+	CURVE_SCURVE,
+	CURVE_CALIBRATED,
+	CURVE_COUNT
+};
+
+// the shapes, power at entry 'i' of the table
+#define CURVE_I(i)		((long long)(i))
+#define CURVE_N			((long long)(CURVE_LEN - 1))
+#define CURVE_BASE		(CURVE_DEAD_BAND * CURVE_FULL / 100)
+#define CURVE_LIFT(i, v)	((i) == 0 ? 0 : CURVE_BASE + (v) * (CURVE_FULL - CURVE_BASE) / CURVE_FULL)
+#define CURVE_LINEAR_AT(i)	(CURVE_I(i) * CURVE_FULL / CURVE_N)
+#define CURVE_EXPO_AT(i)	CURVE_LIFT(i, CURVE_I(i) * CURVE_I(i) * CURVE_FULL / (CURVE_N * CURVE_N))
+#define CURVE_SCURVE_AT(i)	CURVE_LIFT(i, (3 * CURVE_N - 2 * CURVE_I(i)) * CURVE_I(i) * CURVE_I(i) * CURVE_FULL \
+								/ (CURVE_N * CURVE_N * CURVE_N))
+#define CURVE_CAL_SEG		(10 * CURVE_STEPS)
+#define CURVE_CAL(j)		((j) == 0 ? CURVE_CAL_POINT_0 : (j) == 1 ? CURVE_CAL_POINT_1 : (j) == 2 ? CURVE_CAL_POINT_2 :	\
+							 (j) == 3 ? CURVE_CAL_POINT_3 : (j) == 4 ? CURVE_CAL_POINT_4 : (j) == 5 ? CURVE_CAL_POINT_5 :	\
+							 (j) == 6 ? CURVE_CAL_POINT_6 : (j) == 7 ? CURVE_CAL_POINT_7 : (j) == 8 ? CURVE_CAL_POINT_8 :	\
+							 (j) == 9 ? CURVE_CAL_POINT_9 : CURVE_CAL_POINT_10)
+#define CURVE_CALIBRATED_AT(i)	((CURVE_CAL((i) / CURVE_CAL_SEG) * CURVE_CAL_SEG + (CURVE_CAL((i) / CURVE_CAL_SEG + 1)	\
+								- CURVE_CAL((i) / CURVE_CAL_SEG)) * ((i) % CURVE_CAL_SEG)) * CURVE_FULL / (1000 * CURVE_CAL_SEG))
+
+// applies F(curve, i) to every entry of a table
+#define CURVE_EACH_10(F, C, i)	F(C, i) F(C, (i) + 1) F(C, (i) + 2) F(C, (i) + 3) F(C, (i) + 4)	\
+								F(C, (i) + 5) F(C, (i) + 6) F(C, (i) + 7) F(C, (i) + 8) F(C, (i) + 9)
+#define CURVE_EACH_100(F, C, i)	CURVE_EACH_10(F, C, i) CURVE_EACH_10(F, C, (i) + 10) CURVE_EACH_10(F, C, (i) + 20)	\
+								CURVE_EACH_10(F, C, (i) + 30) CURVE_EACH_10(F, C, (i) + 40) CURVE_EACH_10(F, C, (i) + 50)	\
+								CURVE_EACH_10(F, C, (i) + 60) CURVE_EACH_10(F, C, (i) + 70) CURVE_EACH_10(F, C, (i) + 80)	\
+								CURVE_EACH_10(F, C, (i) + 90)
+#define CURVE_EACH(F, C)		CURVE_EACH_100(F, C, 0) CURVE_EACH_100(F, C, 100) F(C, 200)
+_Static_assert(CURVE_LEN == 201, "CURVE_EACH must visit every entry");
+
+#define CURVE_ENTRY(C, i)	(uint16_t)C##_AT(i),
+#define CURVE_SOUND(C, i)	(C##_AT(i) >= 0 && C##_AT(i) <= CURVE_FULL && ((i) == CURVE_LEN - 1 || C##_AT((i) + 1) >= C##_AT(i))) &&
+
+static const uint16_t speed_curves[CURVE_COUNT][CURVE_LEN] = {
+	[CURVE_LINEAR]		= { CURVE_EACH(CURVE_ENTRY, CURVE_LINEAR) },
+	[CURVE_EXPO]		= { CURVE_EACH(CURVE_ENTRY, CURVE_EXPO) },
+	[CURVE_SCURVE]		= { CURVE_EACH(CURVE_ENTRY, CURVE_SCURVE) },
+	[CURVE_CALIBRATED]	= { CURVE_EACH(CURVE_ENTRY, CURVE_CALIBRATED) },
+};
+_Static_assert(CURVE_EACH(CURVE_SOUND, CURVE_LINEAR) 1, "CURVE_LINEAR must rise with speed and stay in range");
+_Static_assert(CURVE_EACH(CURVE_SOUND, CURVE_EXPO) 1, "CURVE_EXPO must rise with speed and stay in range");
+_Static_assert(CURVE_EACH(CURVE_SOUND, CURVE_SCURVE) 1, "CURVE_SCURVE must rise with speed and stay in range");
+_Static_assert(CURVE_EACH(CURVE_SOUND, CURVE_CALIBRATED) 1, "CURVE_CALIBRATED must rise with speed and stay in range");
+_Static_assert(CURVE_LINEAR_AT(CURVE_LEN - 1) == CURVE_FULL && CURVE_EXPO_AT(CURVE_LEN - 1) == CURVE_FULL &&
+		CURVE_SCURVE_AT(CURVE_LEN - 1) == CURVE_FULL && CURVE_CALIBRATED_AT(CURVE_LEN - 1) == CURVE_FULL,
+		"every curve must reach full power at full speed");
+
+// returns non-zero when calibration 'points' make a curve the tables above would pass:
+// rising with speed and at full power at full speed
+static inline int curve_cal_sound(const uint16_t *points){
+	for(int j = 1; j < CURVE_CAL_POINTS; j++)
+		if(points[j] < points[j - 1])
+			return 0;
+	return points[CURVE_CAL_POINTS - 1] == 1000;
+}
+
+// fills 'table' with the calibrated curve through 'points', entry for entry as CURVE_CALIBRATED_AT()
+// does for the points built in
+static inline void curve_calibrate(uint16_t *table, const uint16_t *points){
+	for(int i = 0; i < CURVE_LEN; i++){
+		int j = i / CURVE_CAL_SEG;
+		int rise = j < CURVE_CAL_POINTS - 1 ? points[j + 1] - points[j] : 0;
+		table[i] = ((long long)points[j] * CURVE_CAL_SEG + (long long)rise * (i % CURVE_CAL_SEG)) * CURVE_FULL
+				/ (1000 * CURVE_CAL_SEG);
+	}
+}
+
+#endif